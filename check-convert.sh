@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# sid-collector: round trip check of sidc-convert and sidc-query
+#
+#  A text data file with two headings, a gap and a restart is converted
+#  to binary records with an index and a rollup: compressed, plain, and
+#  compressed without an index.  sidc-query must give the same CSV from
+#  each converted file as from the text, over the whole file and over a
+#  time window found through the index, and the rollup must hold the
+#  expected buckets, with powers in dB averaged as power given -s db.
+#  sidc-query must also read the text with other timestamps given -t,
+#  and refuse it without.
+#
+#  usage: check-convert.sh [directory of sidc-convert and sidc-query]
+#
+
+BIN=${1:-.}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' 0
+FAIL=0
+
+fail()
+{
+   echo "check-convert: FAIL $*"
+   FAIL=1
+}
+
+# Values are exact in single precision, so both forms print the same
+awk 'BEGIN {
+   t = 1700000000
+   print "# stamp lpeak rpeak lrms rrms NAA GQD"
+   for( i = 0; i < 40; i++)
+   {
+      if( i == 23)
+      {
+         printf "# gap %d 4800 0.100\n", t + 2 * i
+         print "# stamp lpeak rpeak lrms rrms NAA GQD ICV"
+      }
+      printf "%d.500 0.5 0.25 0.125 0.0625 %g %g", \
+             t + 2 * i, 40 + i / 8, -20 - i / 4
+      if( i >= 23) printf " %g", i / 4
+      print ""
+   }
+}' > "$DIR/m.dat"
+
+mkdir "$DIR/conv" "$DIR/plain" "$DIR/noidx"
+"$BIN/sidc-convert" -o "$DIR/conv" -i 4 -r 10:r10.dat "$DIR/m.dat" ||
+   fail "sidc-convert exited with status $?"
+"$BIN/sidc-convert" -o "$DIR/plain" -i 4 -z 0 "$DIR/m.dat" ||
+   fail "sidc-convert -z 0 exited with status $?"
+"$BIN/sidc-convert" -o "$DIR/noidx" -i 0 "$DIR/m.dat" ||
+   fail "sidc-convert -i 0 exited with status $?"
+
+[ "$(head -c 4 "$DIR/conv/m.dat")" = SIDZ ] || fail "not compressed"
+[ "$(head -c 4 "$DIR/plain/m.dat")" = SIDR ] || fail "-z 0 compressed"
+
+for conv in conv plain noidx
+do
+   for args in "" "-c GQD,NAA" "-c 5-7" "-s 1700000030 -e 1700000060" \
+               "-s 1700000070 -c ICV" "-d 3 -c NAA"
+   do
+      "$BIN/sidc-query" $args "$DIR/m.dat" > "$DIR/text.csv"
+      "$BIN/sidc-query" $args "$DIR/$conv/m.dat" > "$DIR/conv.csv" ||
+         fail "sidc-query $args $conv exited with status $?"
+      [ -s "$DIR/text.csv" ] || fail "no output from sidc-query $args"
+      cmp -s "$DIR/text.csv" "$DIR/conv.csv" ||
+         fail "sidc-query $args $conv differs: $(diff "$DIR/text.csv" "$DIR/conv.csv" | head -4)"
+   done
+done
+
+[ -s "$DIR/conv/m.dat.idx" ] || fail "no index written"
+[ -e "$DIR/noidx/m.dat.idx" ] && fail "index written with -i 0"
+
+# The same records stamped with seconds of the day, dated by the file name
+awk '/^[0-9]/ { $1 = sprintf( "T%.3f", $1 - 1699920000) }
+     /^# gap/ { $3 = "T" ($3 - 1699920000) } { print }' "$DIR/m.dat" \
+   > "$DIR/231114.dat"
+"$BIN/sidc-query" "$DIR/231114.dat" > /dev/null 2>&1 &&
+   fail "sidc-query read timestamps of the wrong format"
+"$BIN/sidc-query" -s 1700000030 "$DIR/m.dat" > "$DIR/text.csv"
+"$BIN/sidc-query" -t T%e -n %y%m%d.dat -s 1700000030 "$DIR/231114.dat" \
+   > "$DIR/tod.csv" || fail "sidc-query -t exited with status $?"
+cmp -s "$DIR/text.csv" "$DIR/tod.csv" ||
+   fail "sidc-query -t differs: $(diff "$DIR/text.csv" "$DIR/tod.csv" | head -4)"
+
+# 40 records 2 seconds apart, the heading change splitting a bucket
+n=$("$BIN/sidc-query" "$DIR/conv/r10.dat" | grep -c '^1700')
+[ "$n" = 9 ] || fail "expected 9 rollup buckets, found $n"
+
+# With -s db the powers, 40 and 50 dB alternately, average as power
+awk 'BEGIN {
+   print "# stamp lpeak rpeak lrms rrms NAA NAA_coh"
+   for( i = 0; i < 5; i++)
+      printf "%d 0.5 0.25 0.125 0.0625 %d 0.%d\n", 1700000000 + i, 40 + 10 * (i % 2), i
+}' > "$DIR/db.dat"
+mkdir "$DIR/db"
+"$BIN/sidc-convert" -o "$DIR/db" -s db -r 10:r10.dat "$DIR/db.dat" ||
+   fail "sidc-convert -s db exited with status $?"
+r=$("$BIN/sidc-query" "$DIR/db/r10.dat" | tail -1 | cut -d, -f2,3,15,18)
+[ "$r" = "5,0.5,46.6276,0.2" ] || fail "sidc-convert -s db rollup gave $r"
+
+[ $FAIL = 0 ] && echo "check-convert: ok"
+exit $FAIL
@@ -0,0 +1,1118 @@
+/*
+# sid-collector: A VLF signal monitor for recording sudden ionospheric disturbances
+#
+#  sidc-convert: convert text data files to compressed binary records,
+#  with the time index and rollups which sidc would have written.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; version 2 of the License.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//  Tuneable Settings                                                        //
+///////////////////////////////////////////////////////////////////////////////
+
+//  Max number of rollup tiers on the command line.
+#define MAXTIERS 16
+
+//  Max number of threads converting files.
+#define MAXTHREADS 64
+
+//  Size of each output file's stdio buffer.
+#define OUTBUF (1024 * 1024)
+
+//  Records per compressed block when there is no index.
+#define ZBLOCK 60
+
+//
+//  End of tuneable definitions.
+//
+
+//////////////////////////////////////////////////////////////////////////////
+//  C Headers                                                               //
+//////////////////////////////////////////////////////////////////////////////
+
+#include "config.h"
+
+#if HAVE_STDINT_H
+   #include <stdint.h>
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "sidc_format.h"
+#include "sidc_stamp.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//  Globals and fixed definitions                                            //
+///////////////////////////////////////////////////////////////////////////////
+
+char *stamp_format = "%u";               // The timestamp option of the files
+char *name_format = NULL;         // The output_files option, for the date
+char *out_dir = NULL;                         // Where the output files go
+int index_block = 60;             // Records per index entry, 0 for no index
+int zlevel = 6;                    // zlib compression level, 0 for none
+int log_scale = 0;                // The field_scale option of the files is db
+int nthreads = 0;                       // Converter threads, 0 = one per CPU
+int VFLAG = 0;
+
+//
+//  Rollup tiers, as sidc's rollup option.  File names are relative to the
+//  output directory.
+//
+
+struct TIER
+{
+   double secs;                                       // Bucket length, seconds
+   char *file;                                        // File name format
+   int group;                  // SPECTRUM bins per value, 1 for bands
+}
+ tiers[MAXTIERS];
+
+int ntiers = 0;
+
+//
+//  One job per input file.  Rollup summaries can't be written by the
+//  converter threads, as a rollup file takes buckets from many input files
+//  in time order.  They are kept in memory as chunks, each for one rollup
+//  file, and written by the main thread in command line order.
+//
+
+struct CHUNK
+{
+   int tier;
+   char *name;                                        // Rollup file name
+   char *data;                              // SIDC_ROLLUP summaries
+   size_t len;
+};
+
+struct JOB
+{
+   char *name;                                           // Input file
+   char *out;                                            // Output file
+   struct CHUNK *chunks;
+   int nchunks;
+
+   long records, gaps, bad;                         // Lines of each kind
+   off_t in_size, out_size;
+   int failed;
+   int done;
+};
+
+struct JOB *jobs;
+int njobs;
+int next_job = 0;
+
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+//
+//  Rollup bucket being summed, one for each tier
+//
+
+struct BUCKET
+{
+   long bucket;                  // Number of the current bucket, -1 if none
+   int count;                          // Number of records in the bucket
+   int nvals;                                        // Values per summary
+   int group;
+   int *n;                          // Records in each value's sum, not NaN
+   char *db;                        // Set for each value of powers in dB
+   double *sum;
+   float *min, *max;
+};
+
+//
+//  State of a thread working through one file
+//
+
+struct CONV
+{
+   struct JOB *job;
+   FILE *fo;             // Data file, or when compressing the block so far
+   FILE *fz;                    // Compressed data file, NULL if none
+   FILE *fx;                                    // Its index, NULL if none
+   off_t offset;                               // Bytes written to the data
+
+   char *blk;                      // Records of the block, from fo
+   size_t blen;
+   char *head;                // Last HEADING record, with its text
+   size_t head_len;
+   int need_head;                  // Set to start the block with head
+
+   struct STAMP_DATE date;          // From the file name, see sidc_stamp.h
+
+   int spectrum;                       // Set after a "# FREQ" heading
+   int nvals;                     // Values per record, -1 until known
+   char *db;                   // Set for each value that is a power in dB
+   float *vals;
+   int vsize;                                      // Allocated size of vals
+
+   off_t ix_start;                // Offset of the first record in the block
+   int ix_count;                           // Records in the current block
+   double ix_first, ix_last;
+   float *ix_min, *ix_max;
+
+   struct BUCKET buckets[MAXTIERS];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  Various Utility Functions                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+void bailout( char *format, ...)
+{
+   va_list ap;
+
+   va_start( ap, format);
+   fputs( "sidc-convert: ", stderr);
+   vfprintf( stderr, format, ap);
+   fputs( "\n", stderr);
+   va_end( ap);
+   exit( 1);
+}
+
+//
+//  Report a problem with one file, which is then left unconverted
+//
+
+void complain( struct JOB *j, char *format, ...)
+{
+   va_list ap;
+
+   va_start( ap, format);
+   flockfile( stderr);
+   fprintf( stderr, "sidc-convert: %s: ", j->name);
+   vfprintf( stderr, format, ap);
+   fputs( "\n", stderr);
+   funlockfile( stderr);
+   va_end( ap);
+   j->failed = 1;
+}
+
+void *xmalloc( size_t n)
+{
+   void *p = malloc( n ? n : 1);
+
+   if( !p) bailout( "out of memory");
+   return p;
+}
+
+void *xrealloc( void *p, size_t n)
+{
+   if( (p = realloc( p, n ? n : 1)) == NULL) bailout( "out of memory");
+   return p;
+}
+
+double seconds_now( void)
+{
+   struct timeval tv;
+
+   gettimeofday( &tv, NULL);
+   return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+//
+//  Parse a rollup tier given as secs:file[:group]
+//
+
+void parse_tier( char *s)
+{
+   struct TIER *r = tiers + ntiers;
+   char *p, *q;
+
+   if( ntiers == MAXTIERS) bailout( "too many rollups");
+
+   r->secs = strtod( s, &p);
+   if( *p != ':' || !p[1]) bailout( "bad rollup [%s]", s);
+   r->file = strdup( p + 1);
+   r->group = 1;
+   if( (q = strchr( r->file, ':')) != NULL)
+   {
+      *q = 0;
+      r->group = atoi( q + 1);
+   }
+
+   if( r->secs <= 0 || r->group < 1 || !*r->file)
+      bailout( "bad rollup [%s]", s);
+   ntiers++;
+}
+
+//
+//  Expand a rollup file name format for the start of a bucket
+//
+
+char *substitute_name( char *format, double t, char *band)
+{
+   char *d = NULL;
+   size_t len;
+   FILE *f = open_memstream( &d, &len);
+   time_t ud = floor( t);
+   struct tm tm;
+
+   gmtime_r( &ud, &tm);
+   while( *format)
+   {
+      if( *format != '%') { putc( *format++, f); continue; }
+
+      format++;
+      switch( *format++)
+      {
+         case '%': if( *format) putc( *format++, f); break;
+
+         case 'y': fprintf( f, "%02d", tm.tm_year % 100);  break;
+         case 'm': fprintf( f, "%02d", tm.tm_mon+1); break;
+         case 'd': fprintf( f, "%02d", tm.tm_mday); break;
+
+         case 'H': fprintf( f, "%02d", tm.tm_hour);  break;
+         case 'M': fprintf( f, "%02d", tm.tm_min);  break;
+         case 'S': fprintf( f, "%02d", tm.tm_sec);  break;
+
+         case 'B': fputs( band, f);   break;
+         case 'U': fprintf( f, "%ld", (long) ud); break;
+         case 'u': fprintf( f, "%.3f", t);  break;
+
+         case 'E': fprintf( f, "%d", (int)(ud % 86400)); break;
+         case 'e': fprintf( f, "%.3f", t - ud + (ud % 86400)); break;
+         default: bailout( "error in rollup file name [%s]", format);
+      }
+   }
+
+   fclose( f);
+   return d;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Time Index                                                               //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  As sidc's index: an entry for every index_block records, giving their
+//  time span, byte range and the range of every value.  A change in the
+//  number of values, after a restart of sidc with different bands, ends
+//  the block.
+//
+//  When compressing, the records of each block are collected in memory
+//  and written as one SIDC_BLOCK when it ends, so the entry's byte range
+//  is that of the compressed block.
+//
+
+void block_flush( struct CONV *c)
+{
+   struct SIDC_BLOCK *b;
+   uLongf len;
+
+   if( !c->fz) return;
+
+   fclose( c->fo);
+   if( c->blen)
+   {
+      len = compressBound( c->blen);
+      b = xmalloc( sizeof( *b) + len);
+      if( compress2( (Bytef *)(b + 1), &len, (Bytef *) c->blk, c->blen,
+                     zlevel) != Z_OK)
+         complain( c->job, "cannot compress block");
+
+      b->magic = SIDC_BLOCK_MAGIC;
+      b->count = c->ix_count;
+      b->length = len;
+      b->size = c->blen;
+      fwrite( b, 1, sizeof( *b) + len, c->fz);
+      c->offset += sizeof( *b) + len;
+      free( b);
+   }
+   free( c->blk);
+
+   if( (c->fo = open_memstream( &c->blk, &c->blen)) == NULL)
+      bailout( "cannot open block stream: %s", strerror( errno));
+   c->need_head = c->head != NULL;
+}
+
+void index_flush( struct CONV *c)
+{
+   struct SIDC_INDEX_ENTRY e;
+
+   block_flush( c);
+   if( !c->fx || !c->ix_count)
+   {
+      c->ix_count = 0;
+      return;
+   }
+
+   e.magic = SIDC_INDEX_MAGIC;
+   e.nvals = c->nvals;
+   e.count = c->ix_count;
+   e.reserved = 0;
+   e.first = c->ix_first;
+   e.last = c->ix_last;
+   e.offset = c->ix_start;
+   e.length = c->offset - c->ix_start;
+   fwrite( &e, sizeof( e), 1, c->fx);
+   fwrite( c->ix_min, sizeof( float), c->nvals, c->fx);
+   fwrite( c->ix_max, sizeof( float), c->nvals, c->fx);
+
+   c->ix_count = 0;
+}
+
+void index_record( struct CONV *c, double t, off_t start)
+{
+   int i;
+
+   if( !c->fx && !c->fz) return;
+
+   if( !c->ix_count)
+   {
+      c->ix_start = start;
+      c->ix_first = t;
+      for( i = 0; i < c->nvals; i++) c->ix_min[i] = c->ix_max[i] = c->vals[i];
+   }
+
+   for( i = 0; i < c->nvals; i++)
+   {
+      if( c->vals[i] < c->ix_min[i]) c->ix_min[i] = c->vals[i];
+      if( c->vals[i] > c->ix_max[i]) c->ix_max[i] = c->vals[i];
+   }
+   c->ix_last = t;
+   if( ++c->ix_count == (index_block ? index_block : ZBLOCK)) index_flush( c);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Rollups                                                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Buckets are summed exactly as sidc sums them, powers in dB as power
+//  with -s db.  The last bucket of a file is written when the file ends,
+//  so a bucket spanning two input files has two summaries with the same
+//  start, as after a restart of sidc.
+//
+
+void add_chunk( struct JOB *j, int tier, char *name, char *data, size_t len)
+{
+   struct CHUNK *k = j->nchunks ? j->chunks + j->nchunks - 1 : NULL;
+
+   if( !k || k->tier != tier || strcmp( k->name, name))
+   {
+      j->chunks = xrealloc( j->chunks, (j->nchunks + 1) * sizeof( *k));
+      k = j->chunks + j->nchunks++;
+      k->tier = tier;
+      k->name = strdup( name);
+      k->data = NULL;
+      k->len = 0;
+   }
+
+   k->data = xrealloc( k->data, k->len + len);
+   memcpy( k->data + k->len, data, len);
+   k->len += len;
+}
+
+void rollup_flush( struct CONV *c, int tier)
+{
+   struct TIER *r = tiers + tier;
+   struct BUCKET *b = c->buckets + tier;
+   int i, len = sizeof( struct SIDC_ROLLUP) + 3 * b->nvals * sizeof( float);
+   struct SIDC_ROLLUP *s;
+   float *v;
+   char *name;
+
+   if( b->bucket < 0 || !b->count) return;
+
+   s = xmalloc( len);
+   s->magic = SIDC_ROLLUP_MAGIC;
+   s->nvals = b->nvals;
+   s->count = b->count;
+   s->group = b->group;
+   s->start = b->bucket * r->secs;
+   s->secs = r->secs;
+
+   for( i = 0, v = (float *)(s + 1); i < b->nvals; i++, v += 3)
+   {
+      v[0] = b->n[i] ? b->sum[i] / b->n[i] : NAN;
+      if( b->db[i]) v[0] = 10 * log10( v[0]);
+      v[1] = b->min[i];
+      v[2] = b->max[i];
+   }
+
+   name = substitute_name( r->file, s->start, c->date.band);
+   add_chunk( c->job, tier, name, (char *) s, len);
+   free( name);
+   free( s);
+
+   b->bucket = -1;
+}
+
+//
+//  Size the buckets for a new number of values, writing out what was
+//  summed with the old
+//
+
+void rollup_setup( struct CONV *c)
+{
+   int i;
+
+   for( i = 0; i < ntiers; i++)
+   {
+      struct BUCKET *b = c->buckets + i;
+
+      rollup_flush( c, i);
+      b->group = c->spectrum ? tiers[i].group : 1;
+      b->nvals = (c->nvals + b->group - 1) / b->group;
+      b->bucket = -1;
+      b->n = xrealloc( b->n, b->nvals * sizeof( int));
+      b->db = xrealloc( b->db, b->nvals);
+      b->sum = xrealloc( b->sum, b->nvals * sizeof( double));
+      b->min = xrealloc( b->min, b->nvals * sizeof( float));
+      b->max = xrealloc( b->max, b->nvals * sizeof( float));
+   }
+}
+
+void rollup_record( struct CONV *c, double t)
+{
+   int i, j;
+
+   for( i = 0; i < ntiers; i++)
+   {
+      struct BUCKET *b = c->buckets + i;
+      long bucket = floor( t / tiers[i].secs);
+
+      if( bucket != b->bucket)
+      {
+         rollup_flush( c, i);
+         b->bucket = bucket;
+         b->count = 0;
+      }
+
+      for( j = 0; j < b->nvals; j++)
+      {
+         int k, k1 = j * b->group, k2 = k1 + b->group;
+         double e, p = 0;
+
+         if( !b->count)
+         {
+            b->n[j] = 0;
+            b->db[j] = c->db[k1];
+            b->sum[j] = 0;
+            b->min[j] = b->max[j] = NAN;
+         }
+
+         if( k2 > c->nvals) k2 = c->nvals;
+         for( k = k1; k < k2; k++)
+            p += b->db[j] ? pow( 10, c->vals[k] / 10) : c->vals[k];
+         p /= k2 - k1;
+         e = b->db[j] ? 10 * log10( p) : p;
+
+         if( isnan( e)) continue;
+         if( !b->n[j]++) b->min[j] = b->max[j] = e;
+
+         b->sum[j] += p;
+         if( e < b->min[j]) b->min[j] = e;
+         if( e > b->max[j]) b->max[j] = e;
+      }
+      b->count++;
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Conversion                                                               //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Write a binary record of the given type.  Only data records have values.
+//
+
+void put_record( struct CONV *c, int type, double t, long count, int nvals)
+{
+   struct SIDC_RECORD h;
+
+   if( c->need_head)
+   {
+      fwrite( c->head, 1, c->head_len, c->fo);
+      c->need_head = 0;
+   }
+
+   h.magic = SIDC_RECORD_MAGIC;
+   h.type = type;
+   h.count = count;
+   h.reserved = 0;
+   h.stamp = t;
+   fwrite( &h, sizeof( h), 1, c->fo);
+   if( nvals) fwrite( c->vals, sizeof( float), nvals, c->fo);
+   if( !c->fz) c->offset += sizeof( h) + nvals * sizeof( float);
+}
+
+//
+//  Write a heading line as a HEADING record, padded with NULs to a whole
+//  number of values.  Its time is not known, so is left as zero.  The
+//  record is kept to start each compressed block.
+//
+
+void put_heading( struct CONV *c, char *p, char *e)
+{
+   struct SIDC_RECORD *h;
+   size_t n = e - p + 1, pad = (n + 3) & ~(size_t) 3;
+
+   free( c->head);
+   c->head_len = sizeof( *h) + pad;
+   c->head = xmalloc( c->head_len);
+   memset( c->head, 0, c->head_len);
+
+   h = (struct SIDC_RECORD *) c->head;
+   h->magic = SIDC_RECORD_MAGIC;
+   h->type = SIDC_RECORD_HEADING;
+   h->count = pad;
+   memcpy( h + 1, p, n);                           // Including the newline
+
+   fwrite( c->head, 1, c->head_len, c->fo);
+   c->need_head = 0;
+   if( !c->fz) c->offset += c->head_len;
+}
+
+//
+//  Start a new layout of nvals values per record
+//
+
+void set_nvals( struct CONV *c, int nvals)
+{
+   if( nvals == c->nvals) return;
+
+   index_flush( c);
+   c->nvals = nvals;
+   c->ix_min = xrealloc( c->ix_min, nvals * sizeof( float));
+   c->ix_max = xrealloc( c->ix_max, nvals * sizeof( float));
+   c->db = xrealloc( c->db, nvals);
+   memset( c->db, 0, nvals);
+   rollup_setup( c);
+}
+
+//
+//  Whether a heading's column of band values is a power, rather than one
+//  of the cross values, which sidc names ident_coh and so on, or coh alone
+//  in the file of a band
+//
+
+int power_column( char *p, char *e)
+{
+   static char *cross[] = { "coh", "phase", "brg" };
+   int i, n;
+
+   for( i = 0; i < 3; i++)
+   {
+      n = strlen( cross[i]);
+      if( e - p >= n && !strncmp( e - n, cross[i], n) &&
+          (e - p == n || e[-n - 1] == '_')) return 0;
+   }
+   return 1;
+}
+
+//
+//  Comment lines: headings set the layout and are kept as HEADING records,
+//  gap and shed markers become records with no values, and anything else
+//  is dropped
+//
+
+void convert_comment( struct CONV *c, char *p, char *e)
+{
+   struct STAMP s;
+   double t;
+   long n;
+   char *q;
+
+   if( !strncmp( p, "# stamp ", 8) || !strncmp( p, "# FREQ ", 7))
+   {
+      int i, nvals = 0, spectrum = p[2] == 'F', multi;
+
+      for( q = p + (spectrum ? 7 : 8); q < e; )
+      {
+         while( q < e && isspace( *q)) q++;
+         if( q == e) break;
+         while( q < e && !isspace( *q)) q++;
+         nvals++;
+      }
+      multi = !spectrum && !strncmp( p, "# stamp lpeak rpeak lrms rrms", 29);
+
+      //  Group spectrum bins in the rollups, but not band values
+      if( spectrum != c->spectrum)
+      {
+         index_flush( c);
+         c->nvals = -1;
+         c->spectrum = spectrum;
+      }
+      set_nvals( c, nvals);
+
+      //  With -s db, every spectrum bin and band power is in dB; the peak
+      //  and rms levels of BANDS_MULTI and the cross values are not
+      for( q = p + (spectrum ? 7 : 8), i = 0; log_scale && i < nvals; i++)
+      {
+         char *w;
+
+         while( q < e && isspace( *q)) q++;
+         for( w = q; q < e && !isspace( *q); q++);
+         c->db[i] = spectrum || ((!multi || i >= 4) && power_column( w, q));
+      }
+
+      put_heading( c, p, e);
+      return;
+   }
+
+   if( !strncmp( p, "# gap ", 6) || !strncmp( p, "# shed ", 7))
+   {
+      int gap = p[2] == 'g';
+
+      q = parse_stamp( stamp_format, p + (gap ? 6 : 7), e, &s);
+      if( !q || *q != ' ' || !scan_int( q + 1, e, &n) ||
+          (t = stamp_time( &c->date, &s)) < 0)
+      {
+         c->job->bad++;
+         return;
+      }
+
+      put_record( c, gap ? SIDC_RECORD_GAP : SIDC_RECORD_SHED, t, n, 0);
+      if( gap) c->job->gaps++;
+   }
+}
+
+//
+//  Data records: the timestamp, then values separated by spaces
+//
+
+void convert_record( struct CONV *c, char *p, char *e)
+{
+   struct JOB *j = c->job;
+   struct STAMP s;
+   off_t start = c->offset;
+   double t;
+   int n = 0;
+   char *q;
+
+   if( (p = parse_stamp( stamp_format, p, e, &s)) == NULL ||
+       (t = stamp_time( &c->date, &s)) < 0)
+   {
+      j->bad++;
+      return;
+   }
+
+   for( ;;)
+   {
+      while( p < e && (*p == ' ' || *p == '\t')) p++;
+      if( p >= e) break;
+
+      if( n == c->vsize)
+      {
+         c->vsize = c->vsize ? 2 * c->vsize : 64;
+         c->vals = xrealloc( c->vals, c->vsize * sizeof( float));
+      }
+
+      c->vals[n] = scan_num( p, &q);
+      if( q == p || q > e || (q < e && !isspace( *q)))
+      {
+         j->bad++;
+         return;
+      }
+      p = q;
+      n++;
+   }
+
+   //  A record which doesn't fit the heading means the heading was lost,
+   //  or sidc was restarted without output_header
+   if( n != c->nvals) set_nvals( c, n);
+
+   put_record( c, SIDC_RECORD_DATA, t, n, n);
+   index_record( c, t, start);
+   rollup_record( c, t);
+   j->records++;
+}
+
+void convert_text( struct CONV *c, char *d, size_t size)
+{
+   size_t p;
+   char *e;
+
+   for( p = 0; p < size; p = e - d + 1)
+   {
+      //  A last line without a newline was cut short when sidc stopped
+      if( (e = memchr( d + p, '\n', size - p)) == NULL)
+      {
+         c->job->bad++;
+         break;
+      }
+
+      if( d[p] == '#') convert_comment( c, d + p, e);
+      else
+      if( d + p < e) convert_record( c, d + p, e);
+   }
+}
+
+//
+//  Each file is written under a temporary name and renamed when complete,
+//  so that an interrupted run leaves no half converted files.
+//
+
+FILE *open_output( struct JOB *j, char *name, char **tmp)
+{
+   FILE *f;
+
+   *tmp = xmalloc( strlen( name) + 5);
+   sprintf( *tmp, "%s.tmp", name);
+   if( (f = fopen( *tmp, "w")) == NULL)
+   {
+      complain( j, "cannot create %s: %s", *tmp, strerror( errno));
+      return NULL;
+   }
+   setvbuf( f, NULL, _IOFBF, OUTBUF);
+   return f;
+}
+
+int close_output( struct JOB *j, FILE *f, char *tmp, char *name)
+{
+   int err = ferror( f);
+
+   if( fclose( f) || err)
+   {
+      complain( j, "cannot write %s", tmp);
+      unlink( tmp);
+      return 0;
+   }
+   if( j->failed) unlink( tmp);
+   else
+   if( rename( tmp, name) < 0)
+   {
+      complain( j, "cannot rename %s: %s", tmp, strerror( errno));
+      unlink( tmp);
+      return 0;
+   }
+   return 1;
+}
+
+void convert_file( struct JOB *j)
+{
+   struct CONV c;
+   struct stat st, ost;
+   char *d = NULL, *base, *tmp = NULL, *xname = NULL, *xtmp = NULL;
+   int fd, i;
+
+   memset( &c, 0, sizeof( c));
+   c.job = j;
+   c.nvals = -1;
+   for( i = 0; i < ntiers; i++) c.buckets[i].bucket = -1;
+   parse_name( &c.date, name_format, j->name);
+
+   base = strrchr( j->name, '/');
+   base = base ? base + 1 : j->name;
+   j->out = xmalloc( strlen( out_dir) + strlen( base) + 2);
+   sprintf( j->out, "%s/%s", out_dir, base);
+
+   if( (fd = open( j->name, O_RDONLY)) < 0)
+   {
+      complain( j, "cannot open: %s", strerror( errno));
+      return;
+   }
+
+   if( fstat( fd, &st) < 0) bailout( "cannot stat %s", j->name);
+   if( !stat( j->out, &ost) && ost.st_dev == st.st_dev &&
+       ost.st_ino == st.st_ino)
+   {
+      complain( j, "would be overwritten, choose another -o directory");
+      close( fd);
+      return;
+   }
+
+   j->in_size = st.st_size;
+   if( st.st_size)
+   {
+      d = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if( d == MAP_FAILED)
+         bailout( "cannot map %s: %s", j->name, strerror( errno));
+      madvise( d, st.st_size, MADV_SEQUENTIAL);
+   }
+   close( fd);
+
+   if( st.st_size >= 4 && (*(uint32_t *) d == SIDC_RECORD_MAGIC ||
+                           *(uint32_t *) d == SIDC_BLOCK_MAGIC ||
+                           *(uint32_t *) d == SIDC_ROLLUP_MAGIC))
+      complain( j, "not a text data file");
+   else
+   if( (c.fo = open_output( j, j->out, &tmp)) != NULL)
+   {
+      if( index_block)
+      {
+         xname = xmalloc( strlen( j->out) + 5);
+         sprintf( xname, "%s.idx", j->out);
+         c.fx = open_output( j, xname, &xtmp);
+      }
+
+      if( zlevel)
+      {
+         c.fz = c.fo;
+         if( (c.fo = open_memstream( &c.blk, &c.blen)) == NULL)
+            bailout( "cannot open block stream: %s", strerror( errno));
+      }
+
+      if( !j->failed) convert_text( &c, d, st.st_size);
+
+      index_flush( &c);
+      for( i = 0; i < ntiers; i++) rollup_flush( &c, i);
+
+      if( c.fz)
+      {
+         fclose( c.fo);
+         free( c.blk);
+         c.fo = c.fz;
+      }
+
+      j->out_size = c.offset;
+      if( c.fx) close_output( j, c.fx, xtmp, xname);
+      close_output( j, c.fo, tmp, j->out);
+   }
+
+   if( d) munmap( d, st.st_size);
+   free( tmp);
+   free( xtmp);
+   free( xname);
+   free( c.vals);
+   free( c.db);
+   free( c.head);
+   free( c.ix_min);
+   free( c.ix_max);
+   for( i = 0; i < ntiers; i++)
+   {
+      free( c.buckets[i].n);
+      free( c.buckets[i].db);
+      free( c.buckets[i].sum);
+      free( c.buckets[i].min);
+      free( c.buckets[i].max);
+   }
+}
+
+void *convert_thread( void *arg)
+{
+   int n;
+
+   while( (n = __sync_fetch_and_add( &next_job, 1)) < njobs)
+   {
+      convert_file( jobs + n);
+
+      pthread_mutex_lock( &job_lock);
+      jobs[n].done = 1;
+      pthread_cond_broadcast( &job_done);
+      pthread_mutex_unlock( &job_lock);
+   }
+
+   return NULL;
+}
+
+//
+//  Append a job's rollup summaries to the rollup files.  Each tier keeps
+//  its file open until the name changes.
+//
+
+void write_chunks( struct JOB *j)
+{
+   static char *names[MAXTIERS];
+   static FILE *files[MAXTIERS];
+   int i;
+
+   for( i = 0; i < j->nchunks; i++)
+   {
+      struct CHUNK *k = j->chunks + i;
+
+      if( !names[k->tier] || strcmp( names[k->tier], k->name))
+      {
+         char *filename = xmalloc( strlen( out_dir) + strlen( k->name) + 2);
+
+         if( files[k->tier] && fclose( files[k->tier]))
+            bailout( "cannot write %s: %s", names[k->tier], strerror( errno));
+         free( names[k->tier]);
+
+         sprintf( filename, "%s/%s", out_dir, k->name);
+         if( (files[k->tier] = fopen( filename, "a")) == NULL)
+            bailout( "cannot open [%s], %s", filename, strerror( errno));
+         names[k->tier] = filename;
+         if( VFLAG > 1) fprintf( stderr, "rollup %s\n", filename);
+      }
+
+      fwrite( k->data, 1, k->len, files[k->tier]);
+      free( k->data);
+      free( k->name);
+   }
+   free( j->chunks);
+
+   //  Called with no chunks at the end, to close the files
+   if( !j->nchunks)
+      for( i = 0; i < MAXTIERS; i++)
+         if( files[i])
+         {
+            if( fclose( files[i]))
+               bailout( "cannot write %s: %s", names[i], strerror( errno));
+            files[i] = NULL;
+            free( names[i]);
+            names[i] = NULL;
+         }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Main                                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+void usage( void)
+{
+   fprintf( stderr,
+      "usage: sidc-convert -o dir [options] file ...\n"
+      "\n"
+      "  -o dir      directory for the binary files, which keep the names\n"
+      "              of the text files; also for the rollup files\n"
+      "  -t format   the timestamp option the files were written with,\n"
+      "              default %%u\n"
+      "  -n format   the output_files option the files were named with,\n"
+      "              for the date when the timestamp has none, and %%B\n"
+      "  -s scale    the field_scale option the files were written with,\n"
+      "              db or linear, default linear; with db the rollups\n"
+      "              average powers as power, as sidc does\n"
+      "  -i n        records per index entry, default 60, 0 for no index\n"
+      "  -z n        zlib compression level of the blocks of records, one\n"
+      "              for each index entry, default 6, 0 for uncompressed\n"
+      "  -r secs:file[:group]\n"
+      "              add a rollup tier, as the rollup option in sidc.conf\n"
+      "  -j n        number of converter threads, default one per CPU\n"
+      "  -v          list each file converted, -vv also the rollup files\n"
+      "\n"
+      "Give the files in time order, as rollups are written in that order.\n");
+   exit( 1);
+}
+
+int main( int argc, char *argv[])
+{
+   int i, c, failed = 0;
+   pthread_t tids[MAXTHREADS];
+   struct JOB end;
+   long records = 0, gaps = 0, bad = 0;
+   double in_bytes = 0, out_bytes = 0, t0 = seconds_now();
+
+   while( (c = getopt( argc, argv, "o:t:n:s:i:z:r:j:v")) != -1)
+   {
+      if( c == 'o') out_dir = optarg;
+      else
+      if( c == 't') stamp_format = optarg;
+      else
+      if( c == 'n') name_format = optarg;
+      else
+      if( c == 's')
+      {
+         if( !strcmp( optarg, "db")) log_scale = 1;
+         else
+         if( strcmp( optarg, "linear")) bailout( "bad field scale");
+      }
+      else
+      if( c == 'i')
+      {
+         if( (index_block = atoi( optarg)) < 0) bailout( "bad index block");
+      }
+      else
+      if( c == 'z')
+      {
+         if( (zlevel = atoi( optarg)) < 0 || zlevel > 9)
+            bailout( "bad compression level");
+      }
+      else
+      if( c == 'r') parse_tier( optarg);
+      else
+      if( c == 'j') nthreads = atoi( optarg);
+      else
+      if( c == 'v') VFLAG++;
+      else usage();
+   }
+
+   if( optind == argc || !out_dir) usage();
+
+   njobs = argc - optind;
+   jobs = xmalloc( njobs * sizeof( struct JOB));
+   memset( jobs, 0, njobs * sizeof( struct JOB));
+   for( i = 0; i < njobs; i++) jobs[i].name = argv[optind + i];
+
+   if( nthreads <= 0) nthreads = sysconf( _SC_NPROCESSORS_ONLN);
+   if( nthreads > njobs) nthreads = njobs;
+   if( nthreads > MAXTHREADS) nthreads = MAXTHREADS;
+   if( nthreads < 1) nthreads = 1;
+
+   for( i = 0; i < nthreads; i++)
+      if( (c = pthread_create( tids + i, NULL, convert_thread, NULL)) != 0)
+         bailout( "cannot create thread: %s", strerror( c));
+
+   //
+   //  Write the rollups of each file as soon as it and all before it are
+   //  done
+   //
+
+   for( i = 0; i < njobs; i++)
+   {
+      struct JOB *j = jobs + i;
+
+      pthread_mutex_lock( &job_lock);
+      while( !j->done) pthread_cond_wait( &job_done, &job_lock);
+      pthread_mutex_unlock( &job_lock);
+
+      if( j->failed)
+      {
+         failed++;
+         for( c = 0; c < j->nchunks; c++)
+         {
+            free( j->chunks[c].data);
+            free( j->chunks[c].name);
+         }
+         free( j->chunks);
+      }
+      else
+      {
+         if( VFLAG)
+            fprintf( stderr, "%s: %ld records, %ld gaps, %ld bad lines, "
+                             "%ld -> %ld bytes\n", j->out, j->records, j->gaps,
+                             j->bad, (long) j->in_size, (long) j->out_size);
+         if( j->nchunks) write_chunks( j);
+      }
+
+      records += j->records;
+      gaps += j->gaps;
+      bad += j->bad;
+      in_bytes += j->in_size;
+      out_bytes += j->out_size;
+      free( j->out);
+   }
+
+   memset( &end, 0, sizeof( end));
+   write_chunks( &end);
+
+   for( i = 0; i < nthreads; i++) pthread_join( tids[i], NULL);
+
+   if( VFLAG)
+   {
+      double secs = seconds_now() - t0;
+
+      fprintf( stderr, "%d files, %ld records, %ld gaps, %ld bad lines, "
+                       "%.1f MB in %.1f secs, %.1f MB/s, %.0f%% of the size\n",
+                       njobs - failed, records, gaps, bad, in_bytes / 1e6,
+                       secs, in_bytes / 1e6 / (secs > 0 ? secs : 1),
+                       in_bytes ? 100 * out_bytes / in_bytes : 0);
+   }
+
+   free( jobs);
+   return failed ? 1 : 0;
+}
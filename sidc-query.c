@@ -0,0 +1,1271 @@
+/*
+# sid-collector: A VLF signal monitor for recording sudden ionospheric disturbances
+#
+#  sidc-query: extract time ranges and columns from sidc output files.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; version 2 of the License.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//  Tuneable Settings                                                        //
+///////////////////////////////////////////////////////////////////////////////
+
+//  Max number of column selections on the command line.
+#define MAXSELS 64
+
+//  Max number of threads reading files.
+#define MAXTHREADS 64
+
+//
+//  End of tuneable definitions.
+//
+
+//////////////////////////////////////////////////////////////////////////////
+//  C Headers                                                               //
+//////////////////////////////////////////////////////////////////////////////
+
+#include "config.h"
+
+#if HAVE_STDINT_H
+   #include <stdint.h>
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "sidc_format.h"
+#include "sidc_stamp.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//  Globals and fixed definitions                                            //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Output columns are chosen by band or field name, by ranges of value
+//  column numbers counting from 1 after the timestamp, or for spectrum
+//  files by a frequency range.  With no selection, every column is output.
+//
+
+struct SEL
+{
+   char *name;                          // Column name, or NULL for a range
+   int from, to;                          // Range of value column numbers
+}
+ sels[MAXSELS];
+
+int nsels = 0;
+
+double freq_lo = 0, freq_hi = -1;     // Frequency range, Hz, if freq_hi >= 0
+
+double start_time = -HUGE_VAL;                       // Time window, unix secs
+double end_time = HUGE_VAL;
+
+char *stamp_format = "%u";       // The timestamp option of text files
+char *name_format = NULL;         // The output_files option, for the date
+int decimate = 1;                  // Number of records averaged into one
+int binary_out = 0;                 // Set to 1 for SIDC_RECORD output
+int nthreads = 0;                         // Reader threads, 0 = one per CPU
+int VFLAG = 0;
+int failed = 0;                     // Set if any file could not be read
+
+//
+//  One job per input file.  Each job's output is built in memory by a
+//  reader thread and written to stdout in command line order.
+//
+
+struct JOB
+{
+   char *name;
+   char *out;                                             // Output so far
+   size_t len;
+   char *first_head;   // CSV heading at the start of out, if any, else NULL
+   char *last_head;                       // CSV heading in force at the end
+   int done;
+};
+
+struct JOB *jobs;
+int njobs;
+int next_job = 0;
+
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+//
+//  State of a reader working through one file
+//
+
+struct READER
+{
+   struct JOB *job;
+   FILE *f;                                             // Output stream
+   struct STAMP_DATE date;             // From the file name, for text files
+
+   char **names;                // Value column names from the last heading
+   int nnames;
+
+   int ncols;                       // Number of output columns, -1 if not
+   int *cols;                       // yet known.  Value column of each, or
+   char **colnames;                 // -1 if the file doesn't have it
+   int maxcol;                                  // Largest column needed
+
+   char **tok;                       // Fields of the current line, and
+   int *toklen;                      // their lengths, up to maxcol
+   int ntok;
+
+   double *acc;                          // Decimation accumulators
+   float *acc_min, *acc_max;                             // (rollups only)
+   int nacc;                                      // Records accumulated
+   long acc_count;                                // (rollups only)
+   double acc_time;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  Various Utility Functions                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+void bailout( char *format, ...)
+{
+   va_list ap;
+
+   va_start( ap, format);
+   fputs( "sidc-query: ", stderr);
+   vfprintf( stderr, format, ap);
+   fputs( "\n", stderr);
+   va_end( ap);
+   exit( 1);
+}
+
+void *xmalloc( size_t n)
+{
+   void *p = malloc( n ? n : 1);
+
+   if( !p) bailout( "out of memory");
+   return p;
+}
+
+void *xrealloc( void *p, size_t n)
+{
+   if( (p = realloc( p, n ? n : 1)) == NULL) bailout( "out of memory");
+   return p;
+}
+
+//
+//  Parse a time given as unix seconds or as YYYY-MM-DD[THH:MM[:SS]], UTC
+//
+
+double parse_time( char *s)
+{
+   struct tm tm;
+   char *p;
+   double t = strtod( s, &p);
+   int n;
+
+   if( !*p && p != s) return t;
+
+   memset( &tm, 0, sizeof( tm));
+   n = sscanf( s, "%d-%d-%d%*[T ]%d:%d:%d", &tm.tm_year, &tm.tm_mon,
+               &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+   if( n != 3 && n != 5 && n != 6) bailout( "cannot understand time [%s]", s);
+
+   tm.tm_year -= 1900;
+   tm.tm_mon -= 1;
+   return timegm( &tm);
+}
+
+//
+//  Parse a comma separated list of names and column ranges such as
+//  NAA,GQD,3-5,7
+//
+
+void parse_sels( char *list)
+{
+   char *p;
+
+   for( p = strtok( list, ","); p; p = strtok( NULL, ","))
+   {
+      struct SEL *s = sels + nsels;
+      int a, b, n;
+
+      if( nsels == MAXSELS) bailout( "too many columns selected");
+
+      s->name = NULL;
+      if( sscanf( p, "%d-%d%n", &a, &b, &n) == 2 && !p[n])
+         s->from = a, s->to = b;
+      else
+      if( sscanf( p, "%d%n", &a, &n) == 1 && !p[n])
+         s->from = s->to = a;
+      else
+         s->name = p;
+
+      if( !s->name && (s->from < 1 || s->to < s->from))
+         bailout( "bad column range [%s]", p);
+      nsels++;
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Output                                                                   //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Write one output record: CSV, or a SIDC_RECORD followed by floats.
+//
+
+void put_record( struct READER *r, double t, double *v, int n)
+{
+   int i;
+
+   if( binary_out)
+   {
+      struct SIDC_RECORD h;
+      float x;
+
+      h.magic = SIDC_RECORD_MAGIC;
+      h.type = SIDC_RECORD_DATA;
+      h.count = n;
+      h.reserved = 0;
+      h.stamp = t;
+      fwrite( &h, sizeof( h), 1, r->f);
+      for( i = 0; i < n; i++)
+      {
+         x = v[i];
+         fwrite( &x, sizeof( x), 1, r->f);
+      }
+      return;
+   }
+
+   fprintf( r->f, "%.3f", t);
+   for( i = 0; i < n; i++)
+      if( isnan( v[i])) fputs( ",nan", r->f);
+      else fprintf( r->f, ",%.6g", v[i]);
+   fputs( "\n", r->f);
+}
+
+void put_gap( struct READER *r, double t, long frames)
+{
+   struct SIDC_RECORD h;
+
+   if( !binary_out) return;
+
+   h.magic = SIDC_RECORD_MAGIC;
+   h.type = SIDC_RECORD_GAP;
+   h.count = frames;
+   h.reserved = 0;
+   h.stamp = t;
+   fwrite( &h, sizeof( h), 1, r->f);
+}
+
+//
+//  Start a new CSV heading, if it differs from the one in force
+//
+
+void put_heading( struct READER *r, char *head)
+{
+   struct JOB *j = r->job;
+
+   if( binary_out) return;
+
+   if( j->last_head && !strcmp( j->last_head, head))
+   {
+      free( head);
+      return;
+   }
+
+   fflush( r->f);
+   if( !j->len && !j->first_head) j->first_head = strdup( head);
+   fputs( head, r->f);
+
+   free( j->last_head);
+   j->last_head = head;
+}
+
+//
+//  Emit the decimated record accumulated so far, if any
+//
+
+void flush_acc( struct READER *r)
+{
+   int i;
+
+   if( !r->nacc) return;
+
+   for( i = 0; i < r->ncols; i++) r->acc[i] /= r->nacc;
+   put_record( r, r->acc_time, r->acc, r->ncols);
+   r->nacc = 0;
+}
+
+void add_record( struct READER *r, double t, double *v)
+{
+   int i;
+
+   if( decimate == 1)
+   {
+      put_record( r, t, v, r->ncols);
+      return;
+   }
+
+   if( !r->nacc)
+   {
+      r->acc_time = t;
+      for( i = 0; i < r->ncols; i++) r->acc[i] = 0;
+   }
+   for( i = 0; i < r->ncols; i++) r->acc[i] += v[i];
+   if( ++r->nacc == decimate) flush_acc( r);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Column Selection                                                         //
+///////////////////////////////////////////////////////////////////////////////
+
+void add_col( struct READER *r, int col, char *name)
+{
+   r->cols = xrealloc( r->cols, (r->ncols + 1) * sizeof( int));
+   r->colnames = xrealloc( r->colnames, (r->ncols + 1) * sizeof( char *));
+   r->cols[r->ncols] = col;
+   r->colnames[r->ncols] = name;
+   r->ncols++;
+   if( col > r->maxcol) r->maxcol = col;
+}
+
+//
+//  Work out the output columns from the selection and the column names of
+//  the last heading, or the number of values, nvals, if known.  Without
+//  names or a selection, ncols is left at -1 until a record is seen.
+//
+
+void resolve_cols( struct READER *r, int nvals)
+{
+   int i, k;
+
+   r->ncols = 0;
+   r->maxcol = -1;
+
+   if( !nsels && freq_hi < 0)
+   {
+      if( !r->nnames && nvals < 0) { r->ncols = -1; return; }
+      for( i = 0; i < (r->nnames ? r->nnames : nvals); i++)
+         add_col( r, i, i < r->nnames ? r->names[i] : NULL);
+   }
+
+   for( k = 0; k < nsels; k++)
+   {
+      struct SEL *s = sels + k;
+
+      if( s->name)
+      {
+         for( i = 0; i < r->nnames; i++)
+            if( !strcasecmp( r->names[i], s->name)) break;
+         add_col( r, i < r->nnames ? i : -1, s->name);
+      }
+      else
+         for( i = s->from - 1; i < s->to; i++)
+            add_col( r, i, i < r->nnames ? r->names[i] : NULL);
+   }
+
+   if( freq_hi >= 0)
+      for( i = 0; i < r->nnames; i++)
+      {
+         char *p;
+         double hz = strtod( r->names[i], &p);
+
+         if( !*p && hz >= freq_lo && hz <= freq_hi)
+            add_col( r, i, r->names[i]);
+      }
+
+   r->tok = xrealloc( r->tok, (r->maxcol + 2) * sizeof( char *));
+   r->toklen = xrealloc( r->toklen, (r->maxcol + 2) * sizeof( int));
+   r->acc = xrealloc( r->acc, (r->ncols + 1) * sizeof( double));
+}
+
+void text_heading( struct READER *r)
+{
+   int i;
+   char *head = NULL;
+   size_t hlen;
+   FILE *f = open_memstream( &head, &hlen);
+
+   fputs( "stamp", f);
+   for( i = 0; i < r->ncols; i++)
+      if( r->colnames[i]) fprintf( f, ",%s", r->colnames[i]);
+      else fprintf( f, ",c%d", r->cols[i] + 1);
+   fputs( "\n", f);
+   fclose( f);
+   put_heading( r, head);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Text Data Files                                                          //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Data files are mapped and worked through in place.  Lines are only
+//  parsed as far as the last column wanted.  The start of the time window
+//  is found with the sidecar index if there is one, otherwise by a binary
+//  search on the lines themselves, which are in time order.
+//
+
+//
+//  Start of the first line beginning at or after p
+//
+
+size_t line_at( char *d, size_t size, size_t p)
+{
+   char *q;
+
+   if( !p || p >= size || d[p - 1] == '\n') return p;
+   q = memchr( d + p, '\n', size - p);
+   return q ? q - d + 1 : size;
+}
+
+//
+//  Start of the next line after the one at p, or size if p's line is not
+//  complete yet
+//
+
+size_t line_next( char *d, size_t size, size_t p)
+{
+   char *q = memchr( d + p, '\n', size - p);
+
+   return q ? q - d + 1 : size;
+}
+
+int complete_line( char *d, size_t size, size_t p)
+{
+   return memchr( d + p, '\n', size - p) != NULL;
+}
+
+//
+//  Time of the timestamp at p, in the -t format, and its end, which must
+//  be followed by a space or the end of the line.  NAN if it doesn't
+//  parse, or has no date and none could be taken from the file name.
+//
+
+double text_stamp( struct READER *r, char *p, char *e, char **end)
+{
+   struct STAMP s;
+   double t;
+
+   *end = parse_stamp( stamp_format, p, e, &s);
+   if( !*end || *end == p || (*end < e && !isspace( **end)) ||
+       (t = stamp_time( &r->date, &s)) < 0) return NAN;
+   return t;
+}
+
+//
+//  Time of the first record at or after p, or HUGE_VAL if none
+//
+
+double stamp_after( struct READER *r, char *d, size_t size, size_t p)
+{
+   char *e, *q;
+   double t;
+
+   for( p = line_at( d, size, p); p < size; p = line_next( d, size, p))
+   {
+      if( d[p] == '#' || (e = memchr( d + p, '\n', size - p)) == NULL)
+         continue;
+      if( !isnan( t = text_stamp( r, d + p, e, &q))) return t;
+   }
+   return HUGE_VAL;
+}
+
+//
+//  Start of the first record at or after 'from' with a time of t or later
+//
+
+size_t search_text( struct READER *r, char *d, size_t size, size_t from,
+                    double t)
+{
+   size_t lo = from, hi = size, mid;
+
+   while( lo < hi)
+   {
+      mid = lo + (hi - lo) / 2;
+      if( stamp_after( r, d, size, mid) < t) lo = mid + 1;
+      else hi = mid;
+   }
+
+   return line_at( d, size, lo);
+}
+
+//
+//  Use the sidecar index, if present, to find where to start.  Records
+//  after the last block indexed so far are left to search_text().
+//
+
+int search_index( char *name, double t, size_t *pos, size_t *tail)
+{
+   char *iname = xmalloc( strlen( name) + 5);
+   struct stat st;
+   char *d, *p;
+   int fd;
+
+   sprintf( iname, "%s.idx", name);
+   fd = open( iname, O_RDONLY);
+   free( iname);
+   if( fd < 0) return 0;
+
+   if( fstat( fd, &st) < 0 || !st.st_size ||
+       (d = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+          MAP_FAILED)
+   {
+      close( fd);
+      return 0;
+   }
+   close( fd);
+
+   *pos = (size_t) -1;
+   *tail = 0;
+   for( p = d; p + sizeof( struct SIDC_INDEX_ENTRY) <= d + st.st_size; )
+   {
+      struct SIDC_INDEX_ENTRY *e = (struct SIDC_INDEX_ENTRY *) p;
+
+      if( e->magic != SIDC_INDEX_MAGIC) break;
+      if( e->last >= t)
+      {
+         *pos = e->offset;
+         break;
+      }
+      *tail = e->offset + e->length;
+      p += sizeof( *e) + 2 * e->nvals * sizeof( float);
+   }
+
+   munmap( d, st.st_size);
+   return 1;
+}
+
+//
+//  Split the fields after the timestamp, as far as the last one wanted.
+//  Returns the number of fields found, all of them if count is set.
+//
+
+int split_line( struct READER *r, char *q, char *e, int count)
+{
+   int n;
+
+   for( n = 0; count || n <= r->maxcol; n++)
+   {
+      while( q < e && (*q == ' ' || *q == '\t')) q++;
+      if( q >= e) break;
+      if( !count)
+      {
+         r->tok[n] = q;
+         while( q < e && *q != ' ' && *q != '\t') q++;
+         r->toklen[n] = q - r->tok[n];
+      }
+      else
+         while( q < e && *q != ' ' && *q != '\t') q++;
+   }
+
+   return n;
+}
+
+int is_heading( char *line)
+{
+   return !strncmp( line, "# stamp ", 8) || !strncmp( line, "# FREQ ", 7);
+}
+
+//
+//  Take the value column names from a heading line: "# stamp a b c" or
+//  "# FREQ f1 f2 ..." and set up the columns and CSV heading to match.
+//
+
+void read_heading( struct READER *r, char *line, char *end)
+{
+   char *p = line + 2;
+   int i;
+
+   for( i = 0; i < r->nnames; i++) free( r->names[i]);
+   r->nnames = 0;
+
+   // Skip the 'stamp' word; spectrum headings have no timestamp name
+   if( !strncmp( p, "stamp ", 6)) p += 6;
+   else p += 5;
+
+   while( p < end)
+   {
+      char *w;
+
+      while( p < end && isspace( *p)) p++;
+      for( w = p; p < end && !isspace( *p); p++);
+      if( p == w) break;
+
+      r->names = xrealloc( r->names, (r->nnames + 1) * sizeof( char *));
+      r->names[r->nnames++] = strndup( w, p - w);
+   }
+
+   flush_acc( r);
+   resolve_cols( r, -1);
+   if( r->ncols >= 0) text_heading( r);
+}
+
+//
+//  Find the heading line which applies at p, if any.  A heading at p
+//  itself is left for the caller to read.
+//
+
+int find_heading( struct READER *r, char *d, size_t size, size_t p)
+{
+   char *q;
+
+   if( is_heading( d + p)) return 1;
+
+   while( p > 0)
+   {
+      q = memrchr( d, '\n', p - 1);
+      p = q ? q - d + 1 : 0;
+
+      if( is_heading( d + p))
+      {
+         read_heading( r, d + p, memchr( d + p, '\n', size - p));
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+//
+//  Text files are refused if the first record's timestamp doesn't parse,
+//  as the time search would find nothing, or the wrong place
+//
+
+int check_stamps( struct READER *r, char *d, size_t size)
+{
+   size_t p;
+   char *e, *q;
+
+   for( p = 0; p < size; p = line_next( d, size, p))
+   {
+      if( d[p] == '#' || (e = memchr( d + p, '\n', size - p)) == NULL)
+         continue;
+      if( !isnan( text_stamp( r, d + p, e, &q))) return 1;
+
+      fprintf( stderr, "sidc-query: %s: cannot read timestamp [%.*s] as "
+               "'%s', see -t and -n\n", r->job->name,
+               (int) strcspn( d + p, " \t\n"), d + p, stamp_format);
+      failed = 1;
+      return 0;
+   }
+
+   return 1;
+}
+
+void query_text( struct READER *r, char *d, size_t size)
+{
+   size_t p;
+   double t;
+   double *out = NULL;
+   int i, plain = !strcmp( stamp_format, "%u");
+
+   size_t tail;
+
+   parse_name( &r->date, name_format, r->job->name);
+   if( !check_stamps( r, d, size)) return;
+
+   if( !search_index( r->job->name, start_time, &p, &tail))
+      p = search_text( r, d, size, 0, start_time);
+   else
+   if( p == (size_t) -1 && tail < size)
+      p = search_text( r, d, size, tail, start_time);
+   if( p >= size) return;
+
+   if( !find_heading( r, d, size, p))
+   {
+      resolve_cols( r, -1);
+      if( r->ncols >= 0) text_heading( r);
+   }
+
+   for( ; p < size && complete_line( d, size, p); p = line_next( d, size, p))
+   {
+      char *q, *e = memchr( d + p, '\n', size - p);
+
+      if( d[p] == '#')
+      {
+         if( is_heading( d + p)) read_heading( r, d + p, e);
+         else
+         if( !strncmp( d + p, "# gap ", 6))
+         {
+            long frames;
+
+            flush_acc( r);
+            t = text_stamp( r, d + p + 6, e, &q);
+            if( !isnan( t) && sscanf( q, " %ld", &frames) == 1 &&
+                t >= start_time && t <= end_time) put_gap( r, t, frames);
+         }
+         continue;
+      }
+
+      if( isnan( t = text_stamp( r, d + p, e, &q))) continue;
+      if( t > end_time) break;
+      if( t < start_time) continue;
+
+      //  Count the columns of the first record if nothing else says
+      if( r->ncols < 0)
+      {
+         resolve_cols( r, split_line( r, q, e, 1));
+         text_heading( r);
+      }
+
+      r->ntok = split_line( r, q, e, 0);
+
+      //  CSV records are copied from the file as they are, unless averaged
+      //  or the timestamps are not unix seconds
+      if( !binary_out && decimate == 1)
+      {
+         if( plain) fwrite( d + p, 1, q - (d + p), r->f);
+         else fprintf( r->f, "%.3f", t);
+         for( i = 0; i < r->ncols; i++)
+         {
+            int k = r->cols[i];
+
+            putc( ',', r->f);
+            if( k >= 0 && k < r->ntok) fwrite( r->tok[k], 1, r->toklen[k], r->f);
+            else fputs( "nan", r->f);
+         }
+         putc( '\n', r->f);
+         continue;
+      }
+
+      out = xrealloc( out, (r->ncols + 1) * sizeof( double));
+      for( i = 0; i < r->ncols; i++)
+      {
+         int k = r->cols[i];
+         char *x;
+
+         out[i] = k >= 0 && k < r->ntok ? scan_num( r->tok[k], &x) : NAN;
+      }
+      add_record( r, t, out);
+   }
+
+   flush_acc( r);
+   free( out);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Binary Data Files                                                        //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Binary data files are a sequence of SIDC_RECORDs.  Records can't be
+//  found by searching, so the start of the time window is taken from the
+//  sidecar index if there is one, and otherwise the records are walked
+//  from the start of the file, looking only at their headers.  The
+//  heading in force at the start is found by the same walk.
+//
+
+size_t binary_size( struct SIDC_RECORD *h)
+{
+   if( h->type == SIDC_RECORD_DATA)
+      return sizeof( *h) + h->count * sizeof( float);
+   if( h->type == SIDC_RECORD_HEADING) return sizeof( *h) + h->count;
+   return sizeof( *h);
+}
+
+void binary_heading( struct READER *r, struct SIDC_RECORD *h)
+{
+   char *line = (char *)(h + 1);
+   char *e = memchr( line, '\n', h->count);
+
+   if( !is_heading( line)) return;
+   read_heading( r, line, e ? e : line + h->count);
+}
+
+//
+//  Output the records in d from pos on, taking the heading in force from
+//  those before.  Returns 0 once past the end of the time window, or at a
+//  bad record.
+//
+
+int binary_records( struct READER *r, char *d, size_t size, size_t pos,
+                    double **outp)
+{
+   size_t p, n;
+   struct SIDC_RECORD *head = NULL;
+   double *out = *outp;
+   int i, more = 1;
+
+   for( p = 0; p + sizeof( struct SIDC_RECORD) <= size; p += n)
+   {
+      struct SIDC_RECORD *h = (struct SIDC_RECORD *)(d + p);
+      float *v = (float *)(h + 1);
+
+      if( h->magic != SIDC_RECORD_MAGIC)
+      {
+         fprintf( stderr, "sidc-query: %s: bad record at byte %lu\n",
+                  r->job->name, (unsigned long) p);
+         failed = 1;
+         more = 0;
+         break;
+      }
+      n = binary_size( h);
+      if( p + n > size) break;                     // Still being written
+
+      if( h->type == SIDC_RECORD_HEADING)
+      {
+         if( p < pos) head = h;
+         else binary_heading( r, h);
+         continue;
+      }
+      if( p < pos) continue;
+
+      //  First record in range: put out the heading in force
+      if( head)
+      {
+         binary_heading( r, head);
+         head = NULL;
+      }
+
+      if( h->type == SIDC_RECORD_GAP)
+      {
+         flush_acc( r);
+         if( h->stamp >= start_time && h->stamp <= end_time)
+            put_gap( r, h->stamp, h->count);
+         continue;
+      }
+      if( h->type != SIDC_RECORD_DATA) continue;
+
+      if( h->stamp > end_time)
+      {
+         more = 0;
+         break;
+      }
+      if( h->stamp < start_time) continue;
+
+      //  Without a heading, count the values of the first record
+      if( r->ncols < 0)
+      {
+         if( !r->nnames)
+            for( i = 0; i < nsels; i++)
+               if( sels[i].name)
+               {
+                  fprintf( stderr, "sidc-query: %s: no heading record, "
+                           "select columns by number\n", r->job->name);
+                  failed = 1;
+                  break;
+               }
+         resolve_cols( r, h->count);
+         text_heading( r);
+      }
+
+      out = xrealloc( out, (r->ncols + 1) * sizeof( double));
+      for( i = 0; i < r->ncols; i++)
+      {
+         int k = r->cols[i];
+
+         out[i] = k >= 0 && k < (int) h->count ? v[k] : NAN;
+      }
+      add_record( r, h->stamp, out);
+   }
+
+   *outp = out;
+   return more;
+}
+
+void query_binary( struct READER *r, char *d, size_t size)
+{
+   size_t pos = 0, tail;
+   double *out = NULL;
+
+   if( search_index( r->job->name, start_time, &pos, &tail) &&
+       pos == (size_t) -1) pos = tail;
+   r->ncols = -1;
+
+   binary_records( r, d, size, pos, &out);
+
+   flush_acc( r);
+   free( out);
+}
+
+//
+//  Compressed files, from sidc-convert, are a sequence of SIDC_BLOCKs.
+//  The index gives the block to start at; without one every block is
+//  inflated from the start.  The heading which starts each block is left
+//  out when it is the one already in force, so that it doesn't end a run
+//  of decimated records.
+//
+
+void query_compressed( struct READER *r, char *d, size_t size)
+{
+   size_t p = 0, pos, tail, q, last_len = 0;
+   char *buf = NULL, *last = NULL;
+   double *out = NULL;
+   int more = 1;
+
+   if( search_index( r->job->name, start_time, &pos, &tail))
+      p = pos == (size_t) -1 ? tail : pos;
+   r->ncols = -1;
+
+   for( ; more && p + sizeof( struct SIDC_BLOCK) <= size; )
+   {
+      struct SIDC_BLOCK *b = (struct SIDC_BLOCK *)(d + p);
+      struct SIDC_RECORD *h;
+      uLongf n = b->size;
+      size_t skip = 0;
+
+      if( b->magic != SIDC_BLOCK_MAGIC)
+      {
+         fprintf( stderr, "sidc-query: %s: bad block at byte %lu\n",
+                  r->job->name, (unsigned long) p);
+         failed = 1;
+         break;
+      }
+      if( p + sizeof( *b) + b->length > size) break;
+
+      buf = xrealloc( buf, b->size);
+      if( uncompress( (Bytef *) buf, &n, (Bytef *)(b + 1), b->length) != Z_OK ||
+          n != b->size)
+      {
+         fprintf( stderr, "sidc-query: %s: cannot inflate block at byte %lu\n",
+                  r->job->name, (unsigned long) p);
+         failed = 1;
+         break;
+      }
+      p += sizeof( *b) + b->length;
+
+      h = (struct SIDC_RECORD *) buf;
+      if( last && n >= sizeof( *h) && h->magic == SIDC_RECORD_MAGIC &&
+          h->type == SIDC_RECORD_HEADING && binary_size( h) == last_len &&
+          !memcmp( h, last, last_len)) skip = last_len;
+
+      more = binary_records( r, buf + skip, n - skip, 0, &out);
+
+      //  Keep the last heading of the block, to compare with the next
+      for( q = 0; q + sizeof( *h) <= n; q += binary_size( h))
+      {
+         h = (struct SIDC_RECORD *)(buf + q);
+         if( h->magic != SIDC_RECORD_MAGIC || q + binary_size( h) > n) break;
+         if( h->type != SIDC_RECORD_HEADING) continue;
+
+         last_len = binary_size( h);
+         last = xrealloc( last, last_len);
+         memcpy( last, h, last_len);
+      }
+   }
+
+   flush_acc( r);
+   free( out);
+   free( buf);
+   free( last);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Rollup Files                                                             //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Each selected value of a rollup is output as three columns: mean, min
+//  and max.  Decimation merges buckets, weighting the means by count.
+//
+
+void rollup_heading( struct READER *r)
+{
+   int i;
+   char *head = NULL;
+   size_t hlen;
+   FILE *f = open_memstream( &head, &hlen);
+
+   fputs( "stamp,count", f);
+   for( i = 0; i < r->ncols; i++)
+      fprintf( f, ",c%d_mean,c%d_min,c%d_max",
+               r->cols[i] + 1, r->cols[i] + 1, r->cols[i] + 1);
+   fputs( "\n", f);
+   fclose( f);
+   put_heading( r, head);
+}
+
+void flush_rollup( struct READER *r, int nv)
+{
+   int i;
+   double *out;
+
+   if( !r->nacc) return;
+
+   out = xmalloc( (1 + 3 * r->ncols) * sizeof( double));
+   out[0] = r->acc_count;
+   for( i = 0; i < r->ncols; i++)
+   {
+      int ok = r->cols[i] >= 0 && r->cols[i] < nv && r->acc_count;
+
+      out[1 + 3*i] = ok ? r->acc[i] / r->acc_count : NAN;
+      out[2 + 3*i] = ok ? r->acc_min[i] : NAN;
+      out[3 + 3*i] = ok ? r->acc_max[i] : NAN;
+   }
+   put_record( r, r->acc_time, out, 1 + 3 * r->ncols);
+   free( out);
+   r->nacc = 0;
+}
+
+void query_rollup( struct READER *r, char *d, size_t size)
+{
+   char *p = d;
+   int i, k, nv = -1;
+
+   while( p + sizeof( struct SIDC_ROLLUP) <= d + size)
+   {
+      struct SIDC_ROLLUP *s = (struct SIDC_ROLLUP *) p;
+      float *v = (float *)(s + 1);
+
+      if( s->magic != SIDC_ROLLUP_MAGIC)
+         bailout( "%s: bad rollup record", r->job->name);
+      p += sizeof( *s) + 3 * s->nvals * sizeof( float);
+      if( p > d + size) break;
+
+      if( s->start + s->secs <= start_time) continue;
+      if( s->start > end_time) break;
+
+      if( (int) s->nvals != nv)
+      {
+         flush_rollup( r, nv);
+         nv = s->nvals;
+         resolve_cols( r, nv);
+         rollup_heading( r);
+         r->acc_min = xrealloc( r->acc_min, (r->ncols + 1) * sizeof( float));
+         r->acc_max = xrealloc( r->acc_max, (r->ncols + 1) * sizeof( float));
+      }
+
+      if( !r->nacc)
+      {
+         r->acc_time = s->start;
+         r->acc_count = 0;
+         for( i = 0; i < r->ncols; i++)
+         {
+            r->acc[i] = 0;
+            r->acc_min[i] = HUGE_VAL;
+            r->acc_max[i] = -HUGE_VAL;
+         }
+      }
+
+      for( i = 0; i < r->ncols; i++)
+      {
+         if( (k = r->cols[i]) < 0 || k >= nv) continue;
+         r->acc[i] += v[3*k] * s->count;
+         if( v[3*k + 1] < r->acc_min[i]) r->acc_min[i] = v[3*k + 1];
+         if( v[3*k + 2] > r->acc_max[i]) r->acc_max[i] = v[3*k + 2];
+      }
+      r->acc_count += s->count;
+
+      if( ++r->nacc == decimate) flush_rollup( r, nv);
+   }
+
+   flush_rollup( r, nv);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Reader Threads                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+void query_file( struct JOB *j)
+{
+   struct READER r;
+   struct stat st;
+   char *d;
+   int fd, i;
+
+   memset( &r, 0, sizeof( r));
+   r.job = j;
+   if( (r.f = open_memstream( &j->out, &j->len)) == NULL)
+      bailout( "cannot open output stream: %s", strerror( errno));
+
+   if( (fd = open( j->name, O_RDONLY)) < 0)
+   {
+      fprintf( stderr, "sidc-query: cannot open %s: %s\n",
+               j->name, strerror( errno));
+      failed = 1;
+      fclose( r.f);
+      return;
+   }
+
+   if( fstat( fd, &st) < 0) bailout( "cannot stat %s", j->name);
+   if( st.st_size)
+   {
+      d = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if( d == MAP_FAILED)
+         bailout( "cannot map %s: %s", j->name, strerror( errno));
+      madvise( d, st.st_size, MADV_SEQUENTIAL);
+
+      if( st.st_size >= 4 && *(uint32_t *) d == SIDC_ROLLUP_MAGIC)
+         query_rollup( &r, d, st.st_size);
+      else
+      if( st.st_size >= 4 && *(uint32_t *) d == SIDC_RECORD_MAGIC)
+         query_binary( &r, d, st.st_size);
+      else
+      if( st.st_size >= 4 && *(uint32_t *) d == SIDC_BLOCK_MAGIC)
+         query_compressed( &r, d, st.st_size);
+      else
+      if( *d == '#' || isdigit( *d) || *d == '-' || *d == '.')
+         query_text( &r, d, st.st_size);
+      else
+      {
+         fprintf( stderr, "sidc-query: %s: not a sidc data or rollup file\n",
+                  j->name);
+         failed = 1;
+      }
+
+      munmap( d, st.st_size);
+   }
+   close( fd);
+
+   fclose( r.f);
+   for( i = 0; i < r.nnames; i++) free( r.names[i]);
+   free( r.names);
+   free( r.cols);
+   free( r.colnames);
+   free( r.tok);
+   free( r.toklen);
+   free( r.acc);
+   free( r.acc_min);
+   free( r.acc_max);
+}
+
+void *reader_thread( void *arg)
+{
+   int n;
+
+   while( (n = __sync_fetch_and_add( &next_job, 1)) < njobs)
+   {
+      query_file( jobs + n);
+
+      pthread_mutex_lock( &job_lock);
+      jobs[n].done = 1;
+      pthread_cond_broadcast( &job_done);
+      pthread_mutex_unlock( &job_lock);
+   }
+
+   return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Main                                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+void usage( void)
+{
+   fprintf( stderr,
+      "usage: sidc-query [options] file ...\n"
+      "\n"
+      "  -s time     start of the time window, unix seconds or\n"
+      "              YYYY-MM-DD[THH:MM[:SS]] UTC\n"
+      "  -e time     end of the time window\n"
+      "  -c cols     comma separated band names, field names or column\n"
+      "              numbers and ranges such as 3-5, counting from 1\n"
+      "  -f lo:hi    spectrum columns in the frequency range, Hz\n"
+      "  -d n        average every n records into one\n"
+      "  -t format   the timestamp option text files were written with,\n"
+      "              default %%u\n"
+      "  -n format   the output_files option text files were named with,\n"
+      "              for the date when the timestamp has none\n"
+      "  -b          binary output, as SIDC_RECORD in sidc_format.h\n"
+      "  -j n        number of reader threads, default one per CPU\n");
+   exit( 1);
+}
+
+int main( int argc, char *argv[])
+{
+   int i, c;
+   pthread_t tids[MAXTHREADS];
+   char *last_head = NULL;
+
+   while( (c = getopt( argc, argv, "s:e:c:f:d:t:n:bj:v")) != -1)
+   {
+      if( c == 's') start_time = parse_time( optarg);
+      else
+      if( c == 'e') end_time = parse_time( optarg);
+      else
+      if( c == 'c') parse_sels( optarg);
+      else
+      if( c == 'f')
+      {
+         if( sscanf( optarg, "%lf:%lf", &freq_lo, &freq_hi) != 2 ||
+             freq_hi < freq_lo) bailout( "bad frequency range [%s]", optarg);
+      }
+      else
+      if( c == 'd')
+      {
+         if( (decimate = atoi( optarg)) < 1) bailout( "bad decimation");
+      }
+      else
+      if( c == 't') stamp_format = optarg;
+      else
+      if( c == 'n') name_format = optarg;
+      else
+      if( c == 'b') binary_out = 1;
+      else
+      if( c == 'j') nthreads = atoi( optarg);
+      else
+      if( c == 'v') VFLAG++;
+      else usage();
+   }
+
+   if( optind == argc) usage();
+
+   njobs = argc - optind;
+   jobs = xmalloc( njobs * sizeof( struct JOB));
+   memset( jobs, 0, njobs * sizeof( struct JOB));
+   for( i = 0; i < njobs; i++) jobs[i].name = argv[optind + i];
+
+   if( nthreads <= 0) nthreads = sysconf( _SC_NPROCESSORS_ONLN);
+   if( nthreads > njobs) nthreads = njobs;
+   if( nthreads > MAXTHREADS) nthreads = MAXTHREADS;
+   if( nthreads < 1) nthreads = 1;
+
+   for( i = 0; i < nthreads; i++)
+      if( (c = pthread_create( tids + i, NULL, reader_thread, NULL)) != 0)
+         bailout( "cannot create thread: %s", strerror( c));
+
+   //
+   //  Write each file's output as soon as it and all before it are done,
+   //  dropping a heading which repeats the one before
+   //
+
+   for( i = 0; i < njobs; i++)
+   {
+      struct JOB *j = jobs + i;
+      size_t skip = 0;
+
+      pthread_mutex_lock( &job_lock);
+      while( !j->done) pthread_cond_wait( &job_done, &job_lock);
+      pthread_mutex_unlock( &job_lock);
+
+      if( VFLAG) fprintf( stderr, "%s: %ld bytes\n", j->name, (long) j->len);
+
+      if( j->first_head && last_head && !strcmp( j->first_head, last_head))
+         skip = strlen( j->first_head);
+      if( j->len > skip) fwrite( j->out + skip, 1, j->len - skip, stdout);
+      if( j->last_head)
+      {
+         free( last_head);
+         last_head = strdup( j->last_head);
+      }
+
+      free( j->out);
+      free( j->first_head);
+      free( j->last_head);
+   }
+
+   for( i = 0; i < nthreads; i++) pthread_join( tids[i], NULL);
+
+   free( last_head);
+   free( jobs);
+   if( fflush( stdout)) bailout( "write failed: %s", strerror( errno));
+   return failed;
+}
@@ -25,6 +25,16 @@
 //  Max number of bands which can be read from the config file.
 #define MAXBANDS 40
 
+//
+//  Max number of clients which can subscribe to the record socket.
+#define MAXCLIENTS 16
+
+//  Max number of rollup tiers which can be read from the config file.
+#define MAXROLLUPS 8
+
+//  Max number of fields on a line of the config file.
+#define MAXFIELDS 64
+
 //
 //  Name of the default configuration file.  Override with -c option
 #define CONFIG_FILE "/etc/sidc.conf"
@@ -70,9 +80,23 @@
 #include <signal.h>
 #include <time.h>
 #include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <malloc.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <setjmp.h>
 
 #include "/usr/include/fftw3.h"
 
+#include "sidc_format.h"
+
 #if LINUX
    #ifndef OPEN_MAX
       #define OPEN_MAX sysconf(_SC_OPEN_MAX)
@@ -102,6 +126,9 @@
 #if SOLARIS && OSS
    #include <sys/soundcard.h>
 #endif
+#if HAVE_JACK
+   #include <jack/jack.h>
+#endif
 
 //
 //  Set a suitable default device
@@ -134,6 +161,8 @@ int CF_bins = 2048;                                 // Number of frequency bins
 int CF_card_delay = 0;                    // Delay seconds before starting work
 int CF_output_header = 0;                // Whether to output data file headers
 int CF_nread = 2048;             // Number of samples (pairs) to read at a time
+int CF_period_size = 0;             // Soundcard period, frames, 0 for default
+int CF_buffer_size = 0;             // Soundcard buffer, frames, 0 for default
 char *CF_output_files = "%y%m%d.dat";                // Output file name format
 char *CF_timestamp = "%u";               // Format of timestamps in output file
 char *CF_field_format = "%.2e";     // Format of power fields in output file
@@ -146,37 +175,86 @@ int VFLAG = 0;                                    //  Set non-zero by -v option
 
 double CF_uspec_secs = 30  ;    // Issue a spectrum for every spec_secs seconds
 char *CF_uspec_file = NULL;                     // Filename of utility spectrum
-int uspec_cnt = 0;                        // Frame counter for utility spectrum
-int uspec_max = 0;                     // Number of frames per utility spectrum
+int uspec_cnt = 0;         // Number of frames in the utility spectrum so far
+
+char *CF_shm_name = NULL;            // Name of shared memory spectrum object
+int CF_shm_rows = 0;                   // Number of rows in the shared waterfall
+struct SIDC_SHM_HEADER *shm = NULL;           // Mapped shared memory, if any
 
 unsigned int CF_sample_rate = 192000;                     // Samples per second
 
 double CF_output_interval = 0;               // Output record interval, seconds
 int output_int;                               // Output record interval, frames
-int frame_cnt = 0;                          // Frame counter for output records
+int CF_output_binary = 0;              // Set to 1 for binary data file records
+int CF_output_average = 0;                  // Averaging mode, one of the AV_
+double CF_output_avparam = 0;                   // and its parameter, if any
 
 int CF_priority = 0;                    // Set to 1 if high scheduling priority
+int CF_lock_memory = 0;          // Set to 1 to prefault and lock all memory
+
+#define HP_NONE 0
+#define HP_TRANSPARENT 1
+#define HP_EXPLICIT 2
+int CF_huge_pages = HP_NONE;             // Huge page policy for DSP buffers
 struct sigaction sa;
 
+double CF_stats_secs = 0;          // Interval between statistics reports, 0=off
+long frames_total = 0;                          // Number of FT frames processed
+long records_total = 0;                        // Number of output records made
+int running = 1;                       // Cleared to leave the main loop
+
 int CF_output_peak = 0;                  // Set to 1 if peak output is required
 int CF_output_power = 0;          // Set to 1 if total power output is required
 
 int alert_on = 0;                  // Set when the program actually starts work
 char *CF_mailaddr = NULL;                         // Address for alert messages
+char *CF_alert_hook = NULL;                    // Script to run for each alert
+char *CF_alert_file = NULL;                        // File to append alerts to
+double CF_alert_hold = 600;       // Seconds before an alert is sent again
+int CF_alert_max = 10;          // Most alerts sent in any alert_hold seconds
 
 double CF_los_thresh = 0;                 // Threshold for loss of signal, 0..1
 int CF_los_timeout = 0;     // Number of seconds before loss of signal declared
 
-double *hamwin;                    // Array of precomputed hamming coefficients
+double *hamwin;      // Precomputed window, a sine window despite the name
+
+int CF_pfb_taps = 0;      // Filter bank taps per bin, 0 for the windowed FFT
+double *pfb_coef;                      // Prototype filter, pfb_taps frames
+int pfb_block = 0;              // Frame of pfb_hist now being filled
+
+int overrun_cnt = 0;                        // Number of capture overruns so far
+long frames_lost = 0;    // Total frames lost through overruns, add atomically
+long capture_lost = 0;   // Frames lost before the last read, not yet recorded
 
 double DF;                                   // Frequency resolution of the FFT
 int bailout_flag = 0;                           // To prevent bailout() looping
+__thread int reloading = 0;      // Set in the dsp thread while reloading
+jmp_buf reload_env;               // Where bailout() goes instead, if so
 int grab_cnt = 0;                       // Count of samples into the FFT buffer
 
 char *logfile = "/var/log/sidc/sidc.log";
 char *CF_device = DEVICE;                              // Soundcard device name
 
-char CF_datadir[100] = "/var/lib/sidc/";          // Directory for output files
+char *CF_datadir = "/var/lib/sidc/";              // Directory for output files
+
+int CF_fft_threads = 1;                // FFTW threads used by each transform
+int CF_fft_workers = 0;      // Threads doing the other channels' transforms
+#if FIXED_POINT
+int CF_fixed = 1;                 // Set to 1 to use the fixed-point DSP path
+#endif
+
+#define SHED_USPEC 1                    // Utility spectrum and waterfall
+#define SHED_SPECTRUM 2                                 // SPECTRUM outputs
+#define SHED_CROSS 4                                      // Cross spectrum
+#define SHED_SKIP 8                            // Transform alternate frames
+#define MAXSHED 4
+
+double CF_shed_high = 0;    // Shed load above this fraction of real time
+double CF_shed_low = 0;          // Restore load below this fraction
+int shed_steps[MAXSHED];             // SHED_ value of each step, in order
+int nshed_steps = 0;
+int shed_level = 0;                          // Number of steps taken
+int shed = 0;                        // SHED_ values of the steps taken
 
 #define FFTWID (2 * CF_bins)                  // Number of samples per FT frame
 
@@ -189,16 +267,55 @@ struct CHAN
    double *sigavg;
    double *powspec;
    double *fft_inbuf;
+   double *pfb_hist;          // Last pfb_taps frames of input, filter bank
    fftw_complex *fft_data;
    fftw_plan ffp;
-   double peak;
-   double sum_sq;
+   double peak;                                   // Peak level in this frame
+   double sum_sq;                           // Sum of squares in this frame
+#if FIXED_POINT
+   int32_t *fx_in;          // Windowed frame, Q30, and its transform in place
+   uint64_t *fx_pow;                                  // Power of each bin
+   uint32_t fx_peak;                        // Peak level in this frame, Q31
+   uint64_t fx_sum_sq;     // Sum of squares in this frame, Q19 samples
+#endif
    int los_state;
    time_t los_time;
-   char fname[100];
 }
  left = { "left" }, right = { "right" };
 
+//
+//  State of the flare detector for one band
+//
+
+struct FLARE
+{
+   long n;                                         // Number of records seen
+   double mean;                                 // Baseline power, dB (EWMA)
+   double var;                       // Robust variance about the baseline
+   double hi, lo;                         // Upward and downward CUSUM sums
+   struct timeval hi_tv, lo_tv;       // When each sum last rose from zero
+   int state;                        // 0 = quiet, +1 rising, -1 falling
+   struct timeval start_tv, peak_tv, quiet_tv;
+   double peak_z, peak_e;              // Largest deviation and its power
+   int quiet;                 // Consecutive records back near the baseline
+};
+
+//
+//  Sidecar time index of a data file
+//
+
+struct INDEX
+{
+   FILE *fo;                               // Index file, NULL if not indexing
+   off_t base;         // Size of the data file when opened, writer thread only
+   off_t offset;          // Bytes queued for the data file since it was opened
+   off_t start;                // Offset of the first record in the block
+   int count;                              // Records in the current block
+   int nvals;                                  // Number of values per record
+   double first, last;       // Times of the first and last records, seconds
+   float *min, *max;                        // Range of each value in block
+};
+
 //
 // Table of frequency bands to monitor
 //
@@ -210,16 +327,20 @@ struct BAND
    struct CHAN *side;    // Input side to use, left or right
    int start, end;       // Frequency range, Hertz
 
-   FILE *fo;         // Output handle when using BANDS_EACH policy
+   struct FLARE flare;      // Flare detector state
+
+   double xre, xim;         // Cross spectrum L.conj(R) summed over the band
+   double sxx, syy;      // Left and right power over the same bins and frames
 }
  bands[MAXBANDS];    // Table of bands to be monitored
 
 int nbands = 0;
+int cross_frames = 0;         // Frames summed into the cross spectra so far
 
 #define MIN( a, b)           ( a < b ? a : b)
+#define MAX( a, b)           ( a > b ? a : b)
 #define STRMIN( a, b)        MIN( strlen( a), strlen( b))
 #define bound_strcmp( a, b)  (!a || !b || strncmp( a, b, STRMIN( a, b)))
-char *out_prefix = NULL;
 
 //
 //  Output policy
@@ -230,25 +351,203 @@ char *out_prefix = NULL;
 #define OP_BANDS_EACH 3
 int CF_output_policy = OP_BANDS_EACH;
 
-// 
-// Variables for output policy BANDS_MULTI
+//
+// Variables for output policy SPECTRUM
+//
+
+int CF_range1;
+int CF_range2;
+int cuton;
+int cutoff;
+double CF_zoom_df = 0;           // Zoom FFT bin width, Hz, 0 for no zoom
+
+//
+//  Outputs.  outputs[0] is the main output, set by output_policy,
+//  output_interval and output_files; each 'output' option adds another.
+//  All of them are fed from the same FFT frames, each summing the power
+//  over its own interval.  The record socket, rollups, flare detection and
+//  the cross spectrum go with the main output.
 //
 
-FILE *bm_fo = NULL;
+#define MAXOUTPUTS 8
 
 //
-// Variables for output policy BANDS_EACH
+//  How an output combines the frames of its interval.  MEAN sums the power
+//  and divides at output time.  EMA is an exponential average which runs
+//  on across intervals.  MAX and MIN hold the largest and smallest.  These
+//  apply to each bin of a SPECTRUM output and to the power of each band,
+//  frame by frame, of a BANDS output.  PERCENTILE, BANDS only, is taken
+//  from a histogram of each band's frame power.
 //
 
+#define AV_MEAN 0
+#define AV_EMA 1
+#define AV_MAX 2
+#define AV_MIN 3
+#define AV_PERCENTILE 4
+
+#define NHIST 512                         // Buckets in each band's histogram
+#define HIST_LO -156.0                       // Power of the lowest bucket, dB
+#define HIST_STEP 0.5                                 // Bucket width, dB
+
+struct OUTPUT
+{
+   int policy;                                   // One of the OP_ values
+   double secs;                                 // Output interval, seconds
+   int interval;                                 // Output interval, frames
+   int frame_cnt;                         // Frames summed so far
+   int summed;               // Of those, frames transformed and not shed
+   char *files;                                  // Output file name format
+   int binary;                           // Set to 1 for binary data records
+   char *prefix;                 // Current file name, NULL if none open
+
+   int average;                                    // One of the AV_ values
+   double param;             // EMA time constant, seconds, or percentile
+   int bin_mode;                     // How the pow[] bins are accumulated
+   double alpha;                          // EMA smoothing factor per frame
+   long nframes;                              // Frames seen since starting
+
+   double *pow[2];              // Power spectrum sums, left and right
+   double *bval;           // Each band's EMA, maximum or minimum frame power
+   unsigned *hist;          // Each band's histogram of frame power, PERCENTILE
+   double peak[2];                            // Peak levels, left and right
+   double sum_sq[2];                       // Sums of squares, left and right
+
+   FILE *fo;                     // Data file, SPECTRUM and BANDS_MULTI
+   struct INDEX ix;                                       // Its time index
+   FILE **bfo;                          // Data file of each band, BANDS_EACH
+   struct INDEX *bix;                                   // Their time indexes
+
+   double *zpow;               // Zoom spectrum sums, SPECTRUM with zoom only
+   int zsummed;                        // Zoom frames summed this interval
+   double zalpha;                    // EMA smoothing factor per zoom frame
+}
+ outputs[MAXOUTPUTS];
+
+int noutputs = 1;
+int band_stats = 0;           // Set if any output needs per band frame power
+
 //
-// Variables for output policy SPECTRUM
+// Zoom FFT state, see the Zoom FFT section
 //
 
-int CF_range1;
-int CF_range2;
-int cuton;
-int cutoff;
-FILE *sf_fo;
+#define ZOOM_TAPS 32                // Filter taps per decimated sample
+#define ZOOM_MARGIN 1.25          // Least decimated rate over the range width
+
+struct ZOOM
+{
+   int n;                                   // Transform size, 0 if no zoom
+   int decim;                                            // Decimation factor
+   int ntaps;                                   // Filter length, input samples
+   double fc;                                    // Centre frequency, Hertz
+   double df;                                            // Bin width, Hertz
+   double scale;                                   // Bin power scale factor
+   double *tre, *tim;           // Filter taps, shifted to fc, in reverse
+   double *hist;              // The last ntaps input samples, twice over
+   int hpos;                     // Index in hist of the oldest sample
+   int phase;                          // Input samples until the next output
+   double theta, dtheta;     // Phase of the shift at the next output, step
+   double *win;                                                  // Window
+   fftw_complex *buf;                     // The decimated frame, in place
+   int fill;                                     // Samples in buf so far
+   long frames;                                     // Frames since starting
+   fftw_plan plan;
+}
+ zoom;
+
+// Set if an output's bins come from the zoom transform
+static inline int output_zoomed( struct OUTPUT *o)
+{
+   return zoom.n && o->policy == OP_SPECTRUM;
+}
+
+//
+// Variables for the record subscription socket
+//
+
+char *CF_rsock_path = NULL;            // Path of the record socket, if wanted
+int CF_rsock_binary = 0;           // Set to 1 if subscribers get binary records
+int CF_rsock_queue = 64;                  // Max records queued per subscriber
+int rsock = -1;                                     // Listening socket handle
+
+double *rec_vals;                      // Values of the record being output
+
+int CF_cross = 0;         // Set to 1 to output the cross-spectral measures
+int ncross = 0;                   // Number of cross-spectral values per record
+
+char *CF_raw_file = NULL;       // Raw capture file name format, NULL if none
+double CF_raw_pre = 0;               // Seconds of raw input kept before a trigger
+double CF_raw_post = 0;                     // and written after it
+int CF_raw_los = 0;                         // Set to trigger on loss of signal
+int CF_raw_flare = 0;                          // Set to trigger on flare start
+double CF_raw_peak = 0;           // Trigger on a frame peak above this, 0 = off
+
+int CF_index_block = 0;       // Records per sidecar index entry, 0 = no index
+
+//
+// Rollup tiers: summaries of the output records over fixed periods
+//
+
+struct ROLLUP
+{
+   double secs;                                       // Bucket length, seconds
+   char *file;                                        // File name format
+   int group;                  // SPECTRUM bins per value, 1 for bands
+   int db1, db2;          // Record values db1 to db2 - 1 are in dB, if any
+
+   char *prefix;                                   // Name of the open file
+   FILE *fo;
+   long bucket;                  // Number of the current bucket, -1 if none
+   int count;                          // Number of records in the bucket
+   int nvals;                                        // Values per summary
+   int *n;                          // Records in each value's sum, not NaN
+   double *sum;
+   float *min, *max;
+}
+ rollups[MAXROLLUPS];
+
+int nrollups = 0;
+
+//
+// Variables for flare detection
+//
+
+char *CF_flare_file = NULL;        // Events file name format, NULL if not used
+double CF_flare_tau = 900;            // Baseline time constant, seconds
+double CF_flare_k = 0.5;            // CUSUM allowance, standard deviations
+double CF_flare_h = 8;              // CUSUM decision threshold, deviations
+double CF_flare_end = 60;        // Seconds near the baseline to end an event
+FILE *ev_fo = NULL;                                     // Events file handle
+char *ev_prefix = NULL;                      // Name of the open events file
+
+///////////////////////////////////////////////////////////////////////////////
+//  Prototypes                                                               //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Functions used before they are defined
+//
+
+void bailout( char *format, ...);
+void queue_alert( char *text);
+void send_alert( char *text, time_t t, int count);
+void raw_trigger( char *why);
+void flare_update( struct BAND *b, struct timeval *tv, double e);
+void rollup_record( struct timeval *tv, int nvals);
+void rollup_flush( struct ROLLUP *r);
+double hist_percentile( unsigned *h, double pct);
+void pfb_reset( void);
+size_t fixed_memory( void);
+size_t fixed_channel_memory( void);
+double zoom_freq( int k);
+size_t zoom_memory( void);
+static inline int output_shed( struct OUTPUT *o);
+static inline void accumulate( double *a, double f, int mode, double alpha);
+static inline double window( int i, int n);
+void load_measure( double busy, int frames);
+void initialise_channel( struct CHAN *c);
+int reload_key( char *key);
+void reload_config( void);
 
 ///////////////////////////////////////////////////////////////////////////////
 //  Various Utility Functions                                                //
@@ -261,7 +560,6 @@ FILE *sf_fo;
 void report( int level, char *format, ...)
 {
    va_list ap, ap2;
-   void bailout( char *format, ...);
 
    if( VFLAG < level) return;
 
@@ -295,29 +593,39 @@ void report( int level, char *format, ...)
    }
 }
 
+//
+//  Seconds from an arbitrary fixed point, unaffected by clock adjustments
+//
+
+double monotonic_time( void)
+{
+   struct timespec ts;
+
+   clock_gettime( CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+//
+//  Log an alert and queue it for the alert thread to send.  Safe to call
+//  from the dsp thread: it never waits for delivery.
+//
+
 void alert( char *format, ...)
 {
-   FILE *f;
    va_list( ap);
-   char cmd[100], temp[100];
+   char *temp;
 
    va_start( ap, format);
-   vsprintf( temp, format, ap);
+   if( vasprintf( &temp, format, ap) < 0) temp = NULL;
    va_end( ap);
+   if( !temp) return;
 
    report( -1, "%s", temp);
 
-   if( !alert_on || !CF_mailaddr) return;
-
-   sprintf( cmd, "mail -s 'sidc alert' '%s'", CF_mailaddr);
-   if( (f=popen( cmd, "w")) == NULL)
-   {
-      report( 0, "cannot exec [%s]: %s", cmd, strerror( errno));
-      return;
-   }
-
-   fprintf( f, "sidc: %s\n", temp);
-   fclose( f);
+   if( alert_on && (CF_mailaddr || CF_alert_hook || CF_alert_file))
+      queue_alert( temp);
+   else
+      free( temp);
 }
 
 //
@@ -327,15 +635,29 @@ void alert( char *format, ...)
 void bailout( char *format, ...)
 {
    va_list ap;
-   char temp[ 200];
+   char *temp, *msg;
+
+   // A mistake in the configuration is not fatal on a reload
+   if( reloading)
+   {
+      va_start( ap, format);
+      if( vasprintf( &temp, format, ap) < 0) temp = format;
+      va_end( ap);
+      report( 0, "configuration not reloaded: %s", temp);
+      longjmp( reload_env, 1);
+   }
 
    if( bailout_flag) exit( 1);
    bailout_flag = 1;
    va_start( ap, format);
-   vsprintf( temp, format, ap);
+   if( vasprintf( &temp, format, ap) < 0) temp = format;
    va_end( ap);
 
-   alert( "terminating: %s", temp);
+   report( -1, "terminating: %s", temp);
+
+   // Sent directly, as the alert thread will not outlive us
+   if( alert_on && asprintf( &msg, "terminating: %s", temp) >= 0)
+      send_alert( msg, time( NULL), 1);
    exit( 1);
 }
 
@@ -350,22 +672,25 @@ void handle_sigs( int signum)
 
 void check_los( struct CHAN *c)
 {
+   double peak = outputs[0].peak[c == &right];  // Since the last main record
+
    if( !c->los_state)
    {
-      if( !c->los_time && c->peak < CF_los_thresh) time( &c->los_time);
-      if( c->los_time && c->peak > CF_los_thresh) c->los_time = 0;
+      if( !c->los_time && peak < CF_los_thresh) time( &c->los_time);
+      if( c->los_time && peak > CF_los_thresh) c->los_time = 0;
       if( c->los_time && c->los_time + CF_los_timeout < time( NULL))
       {
          c->los_state = 1;
          c->los_time = 0;
+         if( CF_raw_los) raw_trigger( "loss of signal");
          if( CF_chans == 1) alert( "loss of signal");
          else alert( "loss of signal on %s", c->name);
       }
    }
    else
    {
-      if( !c->los_time && c->peak > CF_los_thresh) time( &c->los_time);
-      if( c->los_time && c->peak < CF_los_thresh) c->los_time = 0;
+      if( !c->los_time && peak > CF_los_thresh) time( &c->los_time);
+      if( c->los_time && peak < CF_los_thresh) c->los_time = 0;
       if( c->los_time && c->los_time + CF_los_timeout < time( NULL))
       {
          c->los_state = 0;
@@ -376,27 +701,161 @@ void check_los( struct CHAN *c)
    } 
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//  Shared Memory Spectrum                                                   //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  The layout of the shared memory object is described in sidc_format.h.
+//  sidc is the only writer; each update is bracketed by a sequence lock
+//  so that readers can detect and retry torn copies.
+//
+
+#define shm_spectrum() ((float *)((char *) shm + shm->spectrum_offset))
+#define shm_waterfall() ((float *)((char *) shm + shm->waterfall_offset))
+#define shm_stamps() ((double *)((char *) shm + shm->stamps_offset))
+
+void setup_shm_spectrum( void)
+{
+   int fd;
+   size_t spec_bytes = sizeof( float) * CF_chans * CF_bins;
+   size_t size = sizeof( struct SIDC_SHM_HEADER) +
+                 sizeof( double) * CF_shm_rows + spec_bytes * (1 + CF_shm_rows);
+
+   // Start from a fresh object.  Readers still attached to an old one keep
+   // their mapping and will notice that it is no longer updated.
+   shm_unlink( CF_shm_name);
+
+   if( (fd = shm_open( CF_shm_name, O_CREAT | O_RDWR, 0644)) < 0)
+      bailout( "cannot open shared memory [%s]: %s",
+                CF_shm_name, strerror( errno));
+
+   if( ftruncate( fd, size) < 0)
+      bailout( "cannot size shared memory [%s]: %s",
+                CF_shm_name, strerror( errno));
+
+   shm = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if( shm == MAP_FAILED)
+      bailout( "cannot map shared memory [%s]: %s",
+                CF_shm_name, strerror( errno));
+   close( fd);
+
+   memset( shm, 0, size);
+   shm->version = SIDC_SHM_VERSION;
+   shm->bins = CF_bins;
+   shm->chans = CF_chans;
+   shm->rows = CF_shm_rows;
+   shm->sample_rate = CF_sample_rate;
+   shm->df = DF;
+   shm->stamps_offset = sizeof( struct SIDC_SHM_HEADER);
+   shm->spectrum_offset = shm->stamps_offset + sizeof( double) * CF_shm_rows;
+   shm->waterfall_offset = shm->spectrum_offset + spec_bytes;
+
+   // Readers must not trust the header until the magic number appears
+   __sync_synchronize();
+   shm->magic = SIDC_SHM_MAGIC;
+
+   report( 1, "shared memory spectrum [%s], %d waterfall rows, %ld bytes",
+               CF_shm_name, CF_shm_rows, (long) size);
+}
+
+//
+//  Return the waterfall row for the given channel in the frame currently
+//  being written, or NULL if there is no waterfall.
+//
+
+static inline float *shm_row( int side)
+{
+   if( !shm || !CF_shm_rows) return NULL;
+   return shm_waterfall() + (shm->wf_head * CF_chans + side) * CF_bins;
+}
+
+static inline void shm_begin_row( void)
+{
+   if( !shm || !CF_shm_rows) return;
+   shm->wf_seq++;
+   __sync_synchronize();
+}
+
+static inline void shm_end_row( void)
+{
+   struct timeval tv;
+
+   if( !shm || !CF_shm_rows) return;
+
+   gettimeofday( &tv, NULL);
+   shm_stamps()[shm->wf_head] = tv.tv_sec + 1e-6 * tv.tv_usec;
+   shm->wf_head = (shm->wf_head + 1) % CF_shm_rows;
+   shm->wf_count++;
+   __sync_synchronize();
+   shm->wf_seq++;
+}
+
+void shm_publish_spectrum( void)
+{
+   int i;
+   float *sp;
+   struct timeval tv;
+
+   if( !shm) return;
+
+   gettimeofday( &tv, NULL);
+   shm->spec_seq++;
+   __sync_synchronize();
+
+   sp = shm_spectrum();
+   for( i=0; i<CF_bins; i++) sp[i] = left.sigavg[i]/uspec_cnt;
+   if( CF_chans == 2)
+      for( i=0; i<CF_bins; i++) sp[CF_bins + i] = right.sigavg[i]/uspec_cnt;
+   shm->spec_frames = uspec_cnt;
+   shm->spec_stamp = tv.tv_sec + 1e-6 * tv.tv_usec;
+
+   __sync_synchronize();
+   shm->spec_seq++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Utility Spectrum                                                         //
+///////////////////////////////////////////////////////////////////////////////
+
 void utility_spectrum( void)
 {
    FILE *f;
    int i;
+   char *tmpname;
 
-   if( !CF_uspec_file) return;     // Spectrum file not wanted.
+   if( !uspec_cnt) return;         // No frames since the last spectrum
 
-   if( (f=fopen( CF_uspec_file, "w+")) == NULL)
-      bailout( "cannot open spectrum file %s", strerror( errno));
+   shm_publish_spectrum();
 
-   if( CF_chans == 1)
-      for( i=0; i<CF_bins; i++) fprintf( f, "%.5e %.5e\n",
-             (i+0.5) * DF, left.sigavg[i]/uspec_max);
-   else
-      for( i=0; i<CF_bins; i++) fprintf( f, "%.5e %.5e %.5e\n",
-             (i+0.5) * DF, left.sigavg[i]/uspec_max,
-                          right.sigavg[i]/uspec_max);
-   fclose( f);
+   if( CF_uspec_file)
+   {
+      // Write to a temporary file and rename it into place, so that
+      // readers never see a partly written spectrum
+      if( (tmpname = malloc( strlen( CF_uspec_file) + 5)) == NULL)
+         bailout( "not enough memory for spectrum file name");
+      sprintf( tmpname, "%s.tmp", CF_uspec_file);
+
+      if( (f=fopen( tmpname, "w")) == NULL)
+         bailout( "cannot open spectrum file %s", strerror( errno));
+
+      if( CF_chans == 1)
+         for( i=0; i<CF_bins; i++) fprintf( f, "%.5e %.5e\n",
+                (i+0.5) * DF, left.sigavg[i]/uspec_cnt);
+      else
+         for( i=0; i<CF_bins; i++) fprintf( f, "%.5e %.5e %.5e\n",
+                (i+0.5) * DF, left.sigavg[i]/uspec_cnt,
+                             right.sigavg[i]/uspec_cnt);
+      fclose( f);
+
+      if( rename( tmpname, CF_uspec_file) < 0)
+         bailout( "cannot rename spectrum file %s", strerror( errno));
+      free( tmpname);
+   }
 
    for( i=0; i<CF_bins; i++) left.sigavg[i] = 0;
    if( CF_chans == 2) for( i=0; i<CF_bins; i++) right.sigavg[i] = 0;
+   uspec_cnt = 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -420,7 +879,7 @@ void setup_input_stream( void)
 
    report( 1, "taking data from [%s]", CF_device);
 
-   if( (capture_handle = open( CF_device, O_RDONLY | O_EXCL)) < 0)
+   if( (capture_handle = open( CF_device, O_RDONLY | O_EXCL | O_NONBLOCK)) < 0)
       bailout( "cannot open [%s]: %s", CF_device, strerror( errno));
 
    if( fstat( capture_handle, &st) < 0)
@@ -485,6 +944,11 @@ void setup_input_stream( void)
    report( 1, "soundcard channels: %d  bits: %d", chans, 8 * CF_bytes);
 }
 
+//
+//  Read whatever is available, up to nread samples (pairs).  Returns zero
+//  if nothing is waiting.
+//
+
 int read_soundcard( char *buf)
 {
    int ne, retry_cnt = 0;
@@ -492,16 +956,11 @@ int read_soundcard( char *buf)
 
    while( (ne = read( capture_handle, buf, nread)) < 0)
    {
+      if( errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+
       if( ++retry_cnt == 5)
          bailout( "audio read failed, %s", strerror( errno));
 
-      if( !ne || errno == ENOENT || errno == 0)
-      {
-         sched_yield();
-         usleep( 10000);
-         continue;
-      }
-
       report( 2, "soundcard read failed: %s, retry %d",
                          strerror( errno), retry_cnt);
    }
@@ -509,6 +968,26 @@ int read_soundcard( char *buf)
    return ne / (CF_chans * CF_bytes);   // Count of sample (pairs) read
 }
 
+//
+//  Descriptors to poll for input.  Polling the device starts recording.
+//
+
+int capture_poll_fds( struct pollfd *pfds, int space)
+{
+   pfds->fd = capture_handle;
+   pfds->events = POLLIN;
+   return 1;
+}
+
+int capture_ready( struct pollfd *pfds, int n)
+{
+   return pfds->revents & (POLLIN | POLLERR);
+}
+
+void start_capture( void)
+{
+}
+
 #endif // OSS
 
 #if ALSA
@@ -520,9 +999,10 @@ void setup_input_stream( void)
 {
    int err;
    snd_pcm_hw_params_t *hw_params;
+   snd_pcm_uframes_t period = CF_period_size, buffer = CF_buffer_size;
 
    if( (err = snd_pcm_open( &capture_handle, CF_device,
-                            SND_PCM_STREAM_CAPTURE, 0)) < 0)
+                            SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK)) < 0)
       bailout( "cannot open audio device %s (%s)\n",
          CF_device, snd_strerror( err));
 
@@ -554,497 +1034,4851 @@ void setup_input_stream( void)
               capture_handle, hw_params, CF_chans)) < 0)
       bailout( "cannot set channel count (%s)\n", snd_strerror (err));
 
+   if( CF_period_size &&
+       (err = snd_pcm_hw_params_set_period_size_near(
+              capture_handle, hw_params, &period, 0)) < 0)
+      bailout( "cannot set period size (%s)\n", snd_strerror (err));
+
+   if( CF_buffer_size &&
+       (err = snd_pcm_hw_params_set_buffer_size_near(
+              capture_handle, hw_params, &buffer)) < 0)
+      bailout( "cannot set buffer size (%s)\n", snd_strerror (err));
+
   if( (err = snd_pcm_hw_params( capture_handle, hw_params)) < 0)
       bailout( "cannot set parameters (%s)\n", snd_strerror (err));
 
+   snd_pcm_hw_params_get_period_size( hw_params, &period, 0);
+   snd_pcm_hw_params_get_buffer_size( hw_params, &buffer);
+   report( 0, "period %lu frames, buffer %lu frames, latency %.1f/%.1f ms",
+              period, buffer, 1e3 * period / CF_sample_rate,
+              1e3 * buffer / CF_sample_rate);
+   if( CF_nread > buffer)
+      report( 0, "warning: nread %d is larger than the buffer", CF_nread);
+
    snd_pcm_hw_params_free( hw_params);
    if ((err = snd_pcm_prepare( capture_handle)) < 0)
       bailout( "cannot prepare soundcard (%s)", snd_strerror (err));
 }
 
+//
+//  Read the next block of samples.  After an overrun or suspend the stream
+//  is recovered and the number of frames discarded is estimated from the
+//  time since the previous read plus what was left in the buffer then.
+//  That is left in capture_lost for the caller to record.  Returns zero
+//  if nothing is waiting.
+//
+
 int read_soundcard( char *buf)
 {
-   int ne, retry_cnt = 0;
+   int ne, err;
+   static double t_last = 0;            // Time of the previous successful read
+   static long avail_last = 0;      // Frames left in the buffer after that read
 
    while( (ne = snd_pcm_readi( capture_handle, buf, CF_nread)) < 0)
    {
-      if( ++retry_cnt == 5)
+      if( ne == -EAGAIN) return 0;
+
+      if( (err = snd_pcm_recover( capture_handle, ne, 1)) < 0)
          bailout( "audio read failed, %s", snd_strerror( ne));
 
-      report( 2, "soundcard read failed: %s, retry %d",
-             snd_strerror( ne), retry_cnt);
-      snd_pcm_prepare( capture_handle);  // Must restart capture
+      if( ne == -EPIPE || ne == -ESTRPIPE)
+      {
+         long lost = 0;
+
+         if( t_last)
+            lost = avail_last + (monotonic_time() - t_last) * CF_sample_rate;
+         t_last = 0;
+
+         overrun_cnt++;
+         __sync_fetch_and_add( &frames_lost, lost);
+         capture_lost += lost;
+         report( 0, "%s: %ld frames lost (%.3f s), %d overruns in total",
+                    ne == -EPIPE ? "overrun" : "suspended",
+                    lost, (double) lost / CF_sample_rate, overrun_cnt);
+      }
+      else
+         report( 2, "soundcard read failed: %s", snd_strerror( ne));
    }
 
+   t_last = monotonic_time();
+   if( (avail_last = snd_pcm_avail_update( capture_handle)) < 0)
+      avail_last = 0;
+
    return ne;   // Number of sample (pairs) read
 }
 
+int capture_poll_fds( struct pollfd *pfds, int space)
+{
+   int n = snd_pcm_poll_descriptors( capture_handle, pfds, space);
+
+   if( n <= 0) bailout( "cannot get soundcard poll descriptors");
+   return n;
+}
+
+int capture_ready( struct pollfd *pfds, int n)
+{
+   unsigned short revents;
+
+   if( snd_pcm_poll_descriptors_revents( capture_handle,
+                                         pfds, n, &revents) < 0)
+      return 1;      // Let read_soundcard() find out what is wrong
+   return revents & (POLLIN | POLLERR);
+}
+
+void start_capture( void)
+{
+   int err;
+
+   if( (err = snd_pcm_start( capture_handle)) < 0)
+      bailout( "cannot start soundcard (%s)", snd_strerror( err));
+}
+
 #endif // ALSA
 
 ///////////////////////////////////////////////////////////////////////////////
-//  Output Functions                                                         //
+//  Pipe Input                                                               //
 ///////////////////////////////////////////////////////////////////////////////
 
-/* Appends formatted string to *d while extending allocation */
-int append_sprintf( char **d, char *format, ...)
+//
+//  With 'device -' samples are read from stdin, and with 'device
+//  pipe:<path>' from a named FIFO (or any file), so that sidc can take
+//  input from arecord, sox or an SDR receiver without a loopback sound
+//  device.  The samples are raw interleaved PCM as set by 'mode', 'rate'
+//  and 'bits': unsigned 8 bit, or signed little endian 16, 24 (packed) or
+//  32 bit.  Records are stamped with the time they are made, so the input
+//  is taken to be real time.
+//
+//  Unlike a soundcard, a pipe loses nothing by waiting.  While the capture
+//  ring is full it is left unread, and the writer is held up by the pipe
+//  filling, instead of the input being dropped.
+//
+//  Reads are non-blocking and go straight into the capture ring, filling
+//  a block as far as what is waiting allows.  A partial frame at the end
+//  of a read is carried into the next block.  At the end of stdin sidc
+//  stops as if signalled; when the writer of a FIFO goes away the FIFO is
+//  opened again to wait for the next, and the time without input is
+//  recorded as a gap.
+//
+
+int pipe_fd = -1;
+char *pipe_path = NULL;                         // FIFO name, NULL for stdin
+int pipe_frame;                                    // Bytes per sample frame
+char pipe_carry[8];                  // Partial frame left from the last read
+int pipe_ncarry = 0;
+double pipe_closed = 0;         // When the FIFO writer went away, 0 if not
+int pipe_eof = 0;                              // Set at the end of stdin
+
+void pipe_open( void)
 {
-   int len;
-   int ret;
-   char *tgt;
-   va_list ap, ap2;
+   int fd;
 
-   va_copy( ap2, ap);
-   va_start( ap, format);
-   len = vsnprintf( NULL, 0, format, ap) + 1;
-   va_end( ap);
-   if (*d)
+   if( (fd = open( pipe_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+      bailout( "cannot open [%s]: %s", pipe_path, strerror( errno));
+
+   if( pipe_fd < 0) pipe_fd = fd;
+   else
    {
-      *d = realloc( *d, strlen( *d) + len);
-      tgt = *d + strlen( *d);
-   } else {
-      tgt = *d = malloc( len);
+      // Keep the descriptor number, which the capture thread is polling
+      if( dup2( fd, pipe_fd) < 0)
+         bailout( "cannot reopen [%s]: %s", pipe_path, strerror( errno));
+      close( fd);
    }
-   if (!*d)
-      bailout( "could not allocate memory, %s", strerror( errno));
-   va_start( ap2, format);
-   ret = vsprintf( tgt, format, ap2);
-   va_end( ap);
-
-   return ret;
 }
 
-int substitute_params( char **d, struct timeval *tv,
-                              char *format, char *band)
+void setup_pipe_input( void)
 {
-   double fsecs = tv->tv_sec + 1e-6 * tv->tv_usec;
-   time_t ud = tv->tv_sec;
-   struct tm *tm = gmtime( &ud);
+   struct stat st;
 
-   while( *format)
+   if( strcmp( CF_device, "-"))
    {
-      if( *format != '%') { append_sprintf( d, "%c", *format++); continue; }
+      pipe_path = CF_device + 5;                        // After "pipe:"
+      pipe_open();
+   }
+   else
+   {
+      pipe_fd = STDIN_FILENO;
+      if( fcntl( pipe_fd, F_SETFL,
+                 fcntl( pipe_fd, F_GETFL) | O_NONBLOCK) < 0)
+         bailout( "cannot set stdin non-blocking: %s", strerror( errno));
+   }
 
-      format++;
-      switch( *format++)
-      {
-         case '%': append_sprintf( d, "%c", *format++); break;
+   if( fstat( pipe_fd, &st) < 0)
+      bailout( "cannot stat input: %s", strerror( errno));
 
-         case 'y': append_sprintf( d, "%02d", tm->tm_year % 100);  break;
-         case 'm': append_sprintf( d, "%02d", tm->tm_mon+1); break;
-         case 'd': append_sprintf( d, "%02d", tm->tm_mday); break;
+#ifdef F_SETPIPE_SZ
+   // A large pipe lets the writer run ahead and makes the reads large
+   if( S_ISFIFO( st.st_mode) &&
+       fcntl( pipe_fd, F_SETPIPE_SZ, 1024 * 1024) < 0)
+      report( 1, "cannot enlarge pipe: %s", strerror( errno));
+#endif
 
-         case 'H': append_sprintf( d, "%02d", tm->tm_hour);  break;
-         case 'M': append_sprintf( d, "%02d", tm->tm_min);  break;
-         case 'S': append_sprintf( d, "%02d", tm->tm_sec);  break;
+   pipe_frame = CF_chans * CF_bytes;
+   report( 0, "taking %d bit %s samples at %d/sec from %s",
+              8 * CF_bytes, CF_chans == 1 ? "mono" : "stereo",
+              CF_sample_rate, pipe_path ? pipe_path : "stdin");
+}
 
-         case 'B': if( !band) bailout( "cannot specify %B in this mode");
-                   append_sprintf( d, "%s", band);   break;
-         case 'U': append_sprintf( d, "%ld", tv->tv_sec); break;
-         case 'u': append_sprintf( d, "%.3f", fsecs);  break;
+//
+//  Read up to nread frames.  Returns zero if nothing is waiting.
+//
 
-         case 'E': append_sprintf( d, "%d", (int)(tv->tv_sec % 86400)); break;
-         case 'e': append_sprintf( d, "%.3f", 1e-6 * tv->tv_usec + 
-                                            (tv->tv_sec % 86400)); break;
-         default: return 0;
+int read_pipe( char *buf)
+{
+   size_t size = CF_nread * pipe_frame, got = pipe_ncarry;
+   ssize_t n = -1;
+   int frames;
+
+   memcpy( buf, pipe_carry, pipe_ncarry);
+
+   while( got < size && (n = read( pipe_fd, buf + got, size - got)) != 0)
+   {
+      if( n > 0) { got += n; continue; }
+      if( errno == EINTR) continue;
+      if( errno == EAGAIN || errno == EWOULDBLOCK) break;
+      bailout( "input read failed: %s", strerror( errno));
+   }
+
+   if( got < size && n == 0)                                   // End of file
+   {
+      if( !pipe_path)
+      {
+         report( 0, "end of input, stopping");
+         pipe_eof = 1;
+         kill( getpid(), SIGTERM);
+      }
+      else
+      {
+         report( 0, "input writer has gone, waiting for another");
+         pipe_closed = monotonic_time();
+         pipe_open();
       }
    }
 
+   frames = got / pipe_frame;
+   pipe_ncarry = got % pipe_frame;
+   memcpy( pipe_carry, buf + frames * pipe_frame, pipe_ncarry);
+
+   if( frames && pipe_path && pipe_closed)
+   {
+      long lost = (monotonic_time() - pipe_closed) * CF_sample_rate;
+
+      report( 0, "input resumed after %.1f seconds", 
+                 (double) lost / CF_sample_rate);
+      __sync_fetch_and_add( &frames_lost, lost);
+      capture_lost += lost;
+      pipe_closed = 0;
+   }
+
+   return frames;
+}
+
+int pipe_poll_fds( struct pollfd *pfds, int space)
+{
+   pfds->fd = pipe_fd;
+   pfds->events = POLLIN;
    return 1;
 }
 
-void output_record_multi( struct timeval *tv)
+int pipe_ready( struct pollfd *pfds, int n)
 {
-   int i, j;
-   struct BAND *b;
-   char *prefix = NULL, *stamp = NULL, *filename = NULL;
+   return !pipe_eof && (pfds->revents & (POLLIN | POLLHUP | POLLERR));
+}
 
-   if( !substitute_params( &prefix, tv, CF_output_files, NULL))
-      bailout( "error in output_files configuration");
+void start_pipe( void)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Input Backends                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  The capture thread reads through one of these, chosen by 'device'
+//
+
+struct INPUT
+{
+   char *name;
+   void (*setup)( void);
+   int (*poll_fds)( struct pollfd *pfds, int space);   // Returns count
+   int (*ready)( struct pollfd *pfds, int n);     // Non-zero if data waiting
+   void (*start)( void);
+   int (*read)( char *buf);         // Returns frames read, zero if none
+   void (*stop)( void);                                   // May be NULL
+   int can_wait;         // Set if the input can be left unread, not lost
+}
+ soundcard_input = { soundsystem, setup_input_stream, capture_poll_fds,
+                     capture_ready, start_capture, read_soundcard },
+ pipe_input = { "pipe", setup_pipe_input, pipe_poll_fds,
+                pipe_ready, start_pipe, read_pipe, NULL, 1 },
+ *input = &soundcard_input;
+
+#if HAVE_JACK
+extern struct INPUT jack_input;
+#endif
+
+void choose_input( void)
+{
+   if( !strcmp( CF_device, "-") || !strncmp( CF_device, "pipe:", 5))
+      input = &pipe_input;
+   else
+   if( !strncmp( CF_device, "jack:", 5))
+#if HAVE_JACK
+      input = &jack_input;
+#else
+      bailout( "device %s: not built with JACK", CF_device);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Record Subscribers                                                       //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Each output record is also offered to clients connected to a Unix
+//  domain socket.  Clients never block the program: every client has a
+//  bounded queue of pending records which is drained with non-blocking
+//  sends, and when a queue is full its oldest unsent record is dropped.
+//  The number of records dropped is reported to the client in-band as
+//  soon as there is room in its queue.
+//
+//  On connection a client is sent a handshake of '#' lines describing
+//  the record layout, ending with '# end'.  Records follow, either as
+//  text lines identical to the data file records, or as binary records
+//  described in sidc_format.h.
+//
+
+struct MSG
+{
+   int refs;                      // Number of client queues holding the message
+   int len;
+   char data[];
+};
+
+struct CLIENT
+{
+   int fd;                                             // -1 if slot is unused
+   struct MSG **queue;                     // Ring of messages waiting to be sent
+   int head, count;
+   int offset;                   // Bytes of the head message already sent
+   unsigned long dropped;      // Records dropped, not yet reported to client
+   unsigned long lost;                     // Total records dropped for client
+}
+ clients[MAXCLIENTS];
+
+int nclients = 0;
 
-   if( bound_strcmp( prefix, out_prefix))
+struct MSG *msg_new( int len)
+{
+   struct MSG *m = malloc( sizeof( struct MSG) + len);
+
+   if( !m) bailout( "not enough memory for record message");
+   m->refs = 0;
+   m->len = len;
+   return m;
+}
+
+void msg_unref( struct MSG *m)
+{
+   if( --m->refs <= 0) free( m);
+}
+
+int rsock_text_clients( void)
+{
+   return nclients && !CF_rsock_binary;
+}
+
+void client_close( struct CLIENT *c, char *why)
+{
+   report( 1, "subscriber %d %s, %lu records dropped",
+              (int)(c - clients), why, c->lost);
+
+   while( c->count)
    {
-      if( out_prefix) free( out_prefix);
-      out_prefix = strdup( prefix);
+      msg_unref( c->queue[c->head]);
+      c->head = (c->head + 1) % CF_rsock_queue;
+      c->count--;
+   }
 
-      append_sprintf( &filename, "%s/%s", CF_datadir, out_prefix);
-      report( 0, "using output file [%s]", filename);
+   close( c->fd);
+   free( c->queue);
+   c->fd = -1;
+   nclients--;
+}
 
-      if( bm_fo) fclose( bm_fo);
-      if( (bm_fo=fopen( filename, "a+")) == NULL)
-         bailout( "cannot open [%s], %s", filename, strerror( errno));
+void client_push( struct CLIENT *c, struct MSG *m)
+{
+   m->refs++;
+   c->queue[(c->head + c->count++) % CF_rsock_queue] = m;
+}
 
-      if( CF_output_header)
-      {
-         // Header record required.  Output a header every time sidc
-         // is started - only way to handle band changes etc
-         struct stat st;
+//
+//  Send as much of the queue as the socket will take without blocking.
+//
 
-         if( stat( filename, &st) < 0) 
-            bailout( "cannot stat output file %s: %s",
-               filename, strerror( errno));
+void client_flush( struct CLIENT *c)
+{
+   while( c->count)
+   {
+      struct MSG *m = c->queue[c->head];
+      int n = send( c->fd, m->data + c->offset, m->len - c->offset,
+                    MSG_NOSIGNAL | MSG_DONTWAIT);
 
-         fputs( "# stamp lpeak rpeak lrms rrms ", bm_fo);
-         for( b = bands, i = 0; i < nbands; i++, b++)
-            fprintf( bm_fo, "%s ", b->ident);
-         fputs( "\n", bm_fo);
+      if( n < 0)
+      {
+         if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+         client_close( c, strerror( errno));
+         return;
       }
 
-      free( filename);
+      if( (c->offset += n) < m->len) continue;
+
+      msg_unref( m);
+      c->head = (c->head + 1) % CF_rsock_queue;
+      c->count--;
+      c->offset = 0;
    }
+}
 
-   substitute_params( &stamp, tv, CF_timestamp, NULL);
+struct MSG *binary_msg( int type, struct timeval *tv, int count, int nvals);
 
-   fprintf( bm_fo, "%s %.3f %.3f %.3f %.3f", stamp, left.peak, right.peak,
-                 sqrt( left.sum_sq/FFTWID), sqrt( right.sum_sq/FFTWID));
+struct MSG *dropped_msg( unsigned long n)
+{
+   struct MSG *m;
 
-   for( b = bands, i = 0; i < nbands; i++, b++)
+   if( CF_rsock_binary)
    {
-      double e = 0;
-      int n1 = b->start/DF;
-      int n2 = b->end/DF;
-      for( j=n1; j<= n2; j++) e += b->side->powspec[j];
-      e /= output_int * (n2 - n1 + 1);
-      if( CF_log_scale) e = CF_offset_db + 10 * log10( e + 1e-9);
-      fputs( " ", bm_fo);
-      fprintf( bm_fo, CF_field_format, e);
+      struct timeval tv;
+
+      gettimeofday( &tv, NULL);
+      m = binary_msg( SIDC_RECORD_DROPPED, &tv, n, 0);
    }
-   fputs( "\n", bm_fo);
-   fflush( bm_fo);
+   else
+   {
+      char temp[40];
 
-   free( prefix);
-   free( stamp);
+      sprintf( temp, "# dropped %lu\n", n);
+      m = msg_new( strlen( temp));
+      memcpy( m->data, temp, m->len);
+   }
+
+   return m;
 }
 
-void output_record_each( struct timeval *tv)
+//
+//  Queue a record for a client, dropping its oldest unsent record if the
+//  queue is full.  A partly sent record cannot be dropped without
+//  corrupting the stream, so the one after it goes instead.
+//
+
+void client_offer( struct CLIENT *c, struct MSG *m)
 {
-   int i, j;
+   if( c->count == CF_rsock_queue)
+   {
+      int victim = c->offset ? (c->head + 1) % CF_rsock_queue : c->head;
+
+      msg_unref( c->queue[victim]);
+      if( c->offset) c->queue[victim] = c->queue[c->head];
+      c->head = (c->head + 1) % CF_rsock_queue;
+      c->count--;
+      c->dropped++;
+      c->lost++;
+   }
+
+   if( c->dropped && c->count + 2 <= CF_rsock_queue)
+   {
+      client_push( c, dropped_msg( c->dropped));
+      c->dropped = 0;
+   }
+
+   client_push( c, m);
+}
+
+struct MSG *handshake_msg( void)
+{
+   int i;
    struct BAND *b;
-   char *prefix = NULL;
+   char *text = NULL;
+   size_t len;
+   struct MSG *m;
+   FILE *f = open_memstream( &text, &len);
 
-   if( !substitute_params( &prefix, tv, CF_output_files, "ID"))
-      bailout( "error in output_files configuration");
+   if( !f) bailout( "cannot open handshake stream: %s", strerror( errno));
 
-   if( bound_strcmp( prefix, out_prefix))
+   fprintf( f, "# sidc %s\n", PACKAGE_VERSION);
+   fprintf( f, "# format %s\n", CF_rsock_binary ? "binary" : "text");
+   fprintf( f, "# rate %d chans %d bins %d df %.6f\n",
+               CF_sample_rate, CF_chans, CF_bins, DF);
+   fprintf( f, "# scale %s offset %.3f interval %d\n",
+               CF_log_scale ? "db" : "linear", CF_offset_db, output_int);
+
+   if( CF_output_policy == OP_SPECTRUM)
    {
-      if( out_prefix) free( out_prefix);
-      out_prefix = strdup( prefix);
-      report( 0, "using output files [%s]", out_prefix);
+      fprintf( f, "# policy SPECTRUM\n");
+      fprintf( f, "# spectrum %d %d\n", cuton, cutoff);
+      if( zoom.n) fprintf( f, "# zoom %.6f %.6f\n", zoom_freq( 0), zoom.df);
+      fprintf( f, "# fields stamp %d*bin\n", cutoff - cuton);
+   }
+   else
+   {
+      if( CF_output_policy == OP_BANDS_MULTI)
+         fprintf( f, "# policy BANDS_MULTI\n# fields stamp lpeak rpeak lrms rrms");
+      else
+         fprintf( f, "# policy BANDS_EACH\n# fields stamp");
+      for( b = bands, i = 0; i < nbands; i++, b++) fprintf( f, " %s", b->ident);
+      if( CF_cross)
+         for( b = bands, i = 0; i < nbands; i++, b++)
+            fprintf( f, " %s_coh %s_phase %s_brg", b->ident, b->ident, b->ident);
+      fputs( "\n", f);
 
       for( b = bands, i = 0; i < nbands; i++, b++)
+         fprintf( f, "# band %s %d %d %s %d %d\n", b->ident, b->start, b->end,
+                     b->side->name, (int)(b->start/DF), (int)(b->end/DF));
+   }
+
+   fputs( "# end\n", f);
+   fclose( f);
+
+   m = msg_new( len);
+   memcpy( m->data, text, len);
+   free( text);
+   return m;
+}
+
+void accept_clients( void)
+{
+   int fd, i;
+
+   while( (fd = accept( rsock, NULL, NULL)) >= 0)
+   {
+      struct CLIENT *c = NULL;
+
+      for( i=0; i<MAXCLIENTS && !c; i++) if( clients[i].fd < 0) c = clients + i;
+      if( !c)
       {
-         char *prefix = NULL, *filename = NULL;
-         if( b->fo) fclose( b->fo);
-         substitute_params( &prefix, tv, CF_output_files, b->ident);
-         append_sprintf( &filename, "%s/%s", CF_datadir, prefix);
-         if( (b->fo=fopen( filename, "a")) == NULL)
-            bailout( "cannot open [%s], %s", filename, strerror( errno));
+         report( 0, "too many subscribers, connection refused");
+         close( fd);
+         continue;
+      }
 
-         if( CF_output_header)
-         {
-            // Header record required.  Output a header every time sidc
-            // is started - only way to handle band changes etc
-            struct stat st;
+      fcntl( fd, F_SETFL, fcntl( fd, F_GETFL) | O_NONBLOCK);
+      memset( c, 0, sizeof( struct CLIENT));
+      c->fd = fd;
+      if( (c->queue = malloc( CF_rsock_queue * sizeof( struct MSG *))) == NULL)
+         bailout( "not enough memory for subscriber queue");
+      nclients++;
+      report( 1, "subscriber %d connected", (int)(c - clients));
 
-            if( stat( filename, &st) < 0)
-               bailout( "cannot stat output file %s: %s",
-                  filename, strerror( errno));
+      client_push( c, handshake_msg());
+      client_flush( c);
+   }
 
-            fputs( "# stamp power\n", b->fo);
-         }
+   if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      report( 0, "cannot accept subscriber: %s", strerror( errno));
+}
 
-         free( prefix);
-         free( filename);
+//
+//  Offer a message to all subscribers.  The caller's reference is dropped.
+//
+
+void publish_msg( struct MSG *m)
+{
+   int i;
+
+   m->refs++;
+   for( i=0; i<MAXCLIENTS; i++)
+      if( clients[i].fd >= 0)
+      {
+         client_offer( clients + i, m);
+         client_flush( clients + i);
       }
+   msg_unref( m);
+}
+
+struct MSG *binary_msg( int type, struct timeval *tv, int count, int nvals)
+{
+   struct MSG *m;
+   struct SIDC_RECORD *r;
+
+   m = msg_new( sizeof( struct SIDC_RECORD) + nvals * sizeof( float));
+   r = (struct SIDC_RECORD *) m->data;
+   memset( r, 0, sizeof( struct SIDC_RECORD));
+   r->magic = SIDC_RECORD_MAGIC;
+   r->type = type;
+   r->count = count;
+   r->stamp = tv->tv_sec + 1e-6 * tv->tv_usec;
+   return m;
+}
+
+struct MSG *text_msg( char *line, int len)
+{
+   struct MSG *m = msg_new( len);
+
+   memcpy( m->data, line, len);
+   return m;
+}
+
+//
+//  Offer a record to all subscribers.  The text form is given by line/len,
+//  the values for the binary form are in rec_vals[0..nvals-1].
+//
+
+void publish_record( struct timeval *tv, char *line, int len, int nvals)
+{
+   int i;
+   struct MSG *m;
+
+   if( rsock < 0 || !nclients) return;
+
+   if( CF_rsock_binary)
+   {
+      float *v;
+
+      m = binary_msg( SIDC_RECORD_DATA, tv, nvals, nvals);
+      v = (float *)(m->data + sizeof( struct SIDC_RECORD));
+      for( i=0; i<nvals; i++) v[i] = rec_vals[i];
    }
+   else m = text_msg( line, len);
 
-   for( b = bands, i = 0; i < nbands; i++, b++)
+   publish_msg( m);
+}
+
+//
+//  Tell subscribers about a gap in the input, given the text marker line
+//  and the number of frames lost.
+//
+
+void publish_gap( struct timeval *tv, char *line, int len, long lost)
+{
+   if( rsock < 0 || !nclients) return;
+
+   publish_msg( CF_rsock_binary ? binary_msg( SIDC_RECORD_GAP, tv, lost, 0)
+                                : text_msg( line, len));
+}
+
+//
+//  Descriptors to poll for subscribers: the listening socket, and every
+//  client, waiting for room to send if anything is queued.
+//
+
+int client_poll_fds( struct pollfd *pfds)
+{
+   int i, n = 0;
+
+   if( rsock < 0) return 0;
+
+   pfds[n].fd = rsock;
+   pfds[n++].events = POLLIN;
+   for( i=0; i<MAXCLIENTS; i++)
+      if( clients[i].fd >= 0)
+      {
+         pfds[n].fd = clients[i].fd;
+         pfds[n++].events = clients[i].count ? POLLOUT : 0;
+      }
+
+   return n;
+}
+
+void service_clients( struct pollfd *pfds, int n)
+{
+   int i, j;
+
+   for( i=1; i<n; i++)
+      for( j=0; j<MAXCLIENTS; j++)
+         if( clients[j].fd == pfds[i].fd)
+         {
+            if( pfds[i].revents & (POLLHUP | POLLERR))
+               client_close( clients + j, "disconnected");
+            else
+            if( pfds[i].revents & POLLOUT) client_flush( clients + j);
+            break;
+         }
+
+   if( n && pfds[0].revents & POLLIN) accept_clients();
+}
+
+void setup_record_socket( void)
+{
+   int i;
+   struct sockaddr_un sa;
+
+   for( i=0; i<MAXCLIENTS; i++) clients[i].fd = -1;
+
+   if( strlen( CF_rsock_path) >= sizeof( sa.sun_path))
+      bailout( "record socket path too long [%s]", CF_rsock_path);
+
+   memset( &sa, 0, sizeof( sa));
+   sa.sun_family = AF_UNIX;
+   strcpy( sa.sun_path, CF_rsock_path);
+   unlink( CF_rsock_path);
+
+   if( (rsock = socket( AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+       bind( rsock, (struct sockaddr *) &sa, sizeof( sa)) < 0 ||
+       listen( rsock, MAXCLIENTS) < 0)
+      bailout( "cannot create record socket [%s]: %s",
+                CF_rsock_path, strerror( errno));
+
+   fcntl( rsock, F_SETFL, fcntl( rsock, F_GETFL) | O_NONBLOCK);
+   report( 1, "record socket [%s], %s records, queue %d",
+              CF_rsock_path, CF_rsock_binary ? "binary" : "text",
+              CF_rsock_queue);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Profiling                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Built with --enable-profiling, the time taken by each stage of the
+//  work is measured and a summary of percentiles is logged with every
+//  statistics report.  Optionally the individual timings are saved and
+//  written, when sidc stops, as a Chrome trace for chrome://tracing or
+//  Perfetto.  Otherwise PROF_START and PROF_STOP compile to nothing.
+//
+//  Times are taken from the TSC on x86, calibrated at startup, and from
+//  CLOCK_MONOTONIC elsewhere.  The transform stages may be timed by the
+//  fft workers as well as the dsp thread, so slots in the sample rings
+//  are claimed atomically.
+//
+//  Windowing is done sample by sample as the input is unpacked, so it is
+//  included in the unpack stage.  Unpack excludes the frames processed
+//  during the block, which are timed as a whole by the frame stage.
+//
+
+#define PROF_READ 0                       // Soundcard read, capture thread
+#define PROF_UNPACK 1                      // Unpack and window a block
+#define PROF_FFT 2                                   // fftw_execute()
+#define PROF_POWER 3                  // Power spectrum accumulation
+#define PROF_LOS 4                               // Loss of signal check
+#define PROF_FRAME 5                      // Everything done for a frame
+#define PROF_FORMAT 6                 // Output record formatting, queueing
+#define PROF_WRITE 7                          // Data file writes, writer
+#define PROF_NSTAGES 8
+
+#if PROFILING
+
+#define PROF_SAMPLES 8192                      // Timings kept for each stage
+
+struct PROF_STAGE
+{
+   char *name;
+   char *thread;
+   volatile unsigned long n;                   // Number of timings so far
+   unsigned long reported;                  // Value of n at the last report
+   uint32_t ticks[PROF_SAMPLES];                // Ring of the latest timings
+}
+ prof[PROF_NSTAGES] = {
+   { "read", "capture" }, { "unpack", "dsp" }, { "fft", "dsp" },
+   { "power", "dsp" }, { "los", "dsp" }, { "frame", "dsp" },
+   { "format", "dsp" }, { "write", "writer" } };
+
+struct PROF_EVENT
+{
+   uint64_t start;
+   uint32_t ticks;
+   uint32_t stage;
+};
+
+char *CF_prof_trace = NULL;                  // Chrome trace file, if wanted
+long CF_prof_events = 1000000;                // Max events in the trace
+struct PROF_EVENT *prof_events;
+volatile long prof_nevents = 0;
+double prof_tick_ns = 1;                           // Nanoseconds per tick
+uint64_t prof_t0;
+
+static inline uint64_t prof_now( void)
+{
+#if defined( __x86_64__) || defined( __i386__)
+   return __builtin_ia32_rdtsc();
+#else
+   struct timespec ts;
+
+   clock_gettime( CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+void prof_add( int stage, uint64_t t0)
+{
+   uint64_t d = prof_now() - t0;
+   struct PROF_STAGE *s = prof + stage;
+
+   if( d > UINT32_MAX) d = UINT32_MAX;
+   s->ticks[__sync_fetch_and_add( &s->n, 1) % PROF_SAMPLES] = d;
+
+   if( prof_events && prof_nevents < CF_prof_events)
    {
-      double e = 0;
-      int n1 = b->start/DF;
-      int n2 = b->end/DF;
-      char *stamp = NULL;
+      long i = __sync_fetch_and_add( &prof_nevents, 1);
 
-      substitute_params( &stamp, tv, CF_timestamp, b->ident);
+      if( i < CF_prof_events)
+      {
+         prof_events[i].start = t0;
+         prof_events[i].ticks = d;
+         prof_events[i].stage = stage;
+      }
+   }
+}
 
-      for( j=n1; j<= n2; j++) e += b->side->powspec[j];
-      e /= output_int * (n2 - n1 + 1);
-      if( CF_log_scale) e = CF_offset_db + 10 * log10( e + 1e-9);
-      fprintf( b->fo, "%s ", stamp);
-      fprintf( b->fo, CF_field_format, e);
-      fputs( "\n", b->fo);
-      fflush( b->fo);
+#define PROF_START( v)        uint64_t v = prof_now()
+#define PROF_STOP( stage, v)  prof_add( stage, v)
+
+void setup_profiling( void)
+{
+#if defined( __x86_64__) || defined( __i386__)
+   double t1 = monotonic_time(), t2;
+   uint64_t c1 = prof_now(), c2;
+
+   usleep( 50000);
+   t2 = monotonic_time();
+   c2 = prof_now();
+   prof_tick_ns = 1e9 * (t2 - t1) / (c2 - c1);
+   report( 1, "profiling: TSC at %.3f GHz", 1 / prof_tick_ns);
+#else
+   report( 1, "profiling: using CLOCK_MONOTONIC");
+#endif
+
+   prof_t0 = prof_now();
+   if( CF_prof_trace &&
+       (prof_events = malloc( CF_prof_events * sizeof( struct PROF_EVENT))) ==
+          NULL) bailout( "not enough memory for profile trace");
+}
+
+int prof_cmp( const void *a, const void *b)
+{
+   uint32_t x = *(uint32_t *) a, y = *(uint32_t *) b;
+
+   return x < y ? -1 : x > y;
+}
+
+//
+//  Log percentiles of the timings made since the last report
+//
+
+void prof_report( void)
+{
+   static uint32_t t[PROF_SAMPLES];
+   int i, k;
+   double frame_us = 1e6 * FFTWID / CF_sample_rate;
+
+   for( i = 0; i < PROF_NSTAGES; i++)
+   {
+      struct PROF_STAGE *s = prof + i;
+      unsigned long n = s->n, cnt = n - s->reported, m = cnt;
+      double us = prof_tick_ns / 1000;
+
+      if( !m) continue;
+      if( m > PROF_SAMPLES) m = PROF_SAMPLES;
+      for( k = 0; k < m; k++) t[k] = s->ticks[(n - m + k) % PROF_SAMPLES];
+      qsort( t, m, sizeof( uint32_t), prof_cmp);
+      s->reported = n;
+
+      report( 0, "profile %-6s n=%-6lu p50 %8.1f p90 %8.1f p99 %8.1f "
+                 "max %8.1f us", s->name, cnt, us * t[m/2],
+                 us * t[m*9/10], us * t[m*99/100], us * t[m-1]);
+      if( i == PROF_FRAME)
+         report( 0, "profile frame p99 is %.1f%% of the %.0f us frame time",
+                    100 * us * t[m*99/100] / frame_us, frame_us);
+   }
+}
+
+void prof_write_trace( void)
+{
+   FILE *f;
+   long i, n = MIN( prof_nevents, CF_prof_events);
+
+   if( !prof_events) return;
+   if( (f = fopen( CF_prof_trace, "w")) == NULL)
+   {
+      report( 0, "cannot open [%s], %s", CF_prof_trace, strerror( errno));
+      return;
+   }
+
+   fprintf( f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+   for( i = 0; i < PROF_NSTAGES; i++)
+      fprintf( f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+                  "\"tid\": \"%s\", \"args\": {\"name\": \"%s\"}},\n",
+                  prof[i].thread, prof[i].thread);
+   for( i = 0; i < n; i++)
+   {
+      struct PROF_EVENT *e = prof_events + i;
+
+      fprintf( f, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                  "\"tid\": \"%s\", \"ts\": %.3f, \"dur\": %.3f}%s\n",
+                  prof[e->stage].name, prof[e->stage].thread,
+                  (e->start - prof_t0) * prof_tick_ns / 1000,
+                  e->ticks * prof_tick_ns / 1000, i < n - 1 ? "," : "");
+   }
+   fprintf( f, "]}\n");
+   fclose( f);
+
+   report( 0, "profile trace: %ld events written to [%s]", n, CF_prof_trace);
+}
+
+#else
+
+#define PROF_START( v)
+#define PROF_STOP( stage, v)
+
+#endif // PROFILING
+
+///////////////////////////////////////////////////////////////////////////////
+//  Threads                                                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  The capture thread only reads the soundcard into the capture ring.  The
+//  main loop runs on the dsp thread and does all the signal processing and
+//  record formatting.  The writer thread does all the data file output, so
+//  a slow disk never holds up the dsp thread.  Likewise the alert thread
+//  sends the alerts and the raw thread writes raw capture files.
+//
+//  Each thread can be pinned to a set of CPUs and given its own
+//  scheduling policy and priority with the 'thread' config option.
+//  Otherwise threads inherit the process settings made by 'sched'.
+//
+
+#define TH_CAPTURE 0
+#define TH_DSP 1
+#define TH_WRITER 2
+#define TH_FFT 3
+#define TH_ALERT 4
+#define TH_RAW 5
+#define NTHREADS 6
+
+struct THREAD_CF
+{
+   char *name;
+   int ncpus;                        // Number of CPUs in the set, 0 = any
+   cpu_set_t cpus;
+   int policy;                  // Scheduling policy, -1 to inherit
+   int priority;
+}
+ thread_cf[NTHREADS] = {
+   { "capture", 0, { { 0 } }, -1, 0 },
+   { "dsp", 0, { { 0 } }, -1, 0 },
+   { "writer", 0, { { 0 } }, -1, 0 },
+   { "fft", 0, { { 0 } }, -1, 0 },
+   { "alert", 0, { { 0 } }, -1, 0 },
+   { "raw", 0, { { 0 } }, -1, 0 } };
+
+#define STACK_PREFAULT (64 * 1024)     // Bytes of stack touched by each thread
+
+//
+//  Parse a CPU list such as 0-3,6 into a set.  Returns the number of CPUs
+//  or -1 if the list is malformed.
+//
+
+int parse_cpus( char *list, cpu_set_t *set)
+{
+   CPU_ZERO( set);
+
+   while( *list)
+   {
+      char *e;
+      int a = strtol( list, &e, 10), b = a;
+
+      if( e == list || a < 0) return -1;
+      if( *e == '-')
+      {
+         list = e + 1;
+         b = strtol( list, &e, 10);
+         if( e == list || b < a) return -1;
+      }
+
+      for( ; a <= b && a < CPU_SETSIZE; a++) CPU_SET( a, set);
+
+      if( *e == ',') e++;
+      else
+      if( *e) return -1;
+      list = e;
+   }
+
+   return CPU_COUNT( set);
+}
+
+//
+//  Touch the stack of the calling thread so that the pages are present,
+//  and locked if memory locking is on, before any real time work starts.
+//
+
+void prefault_stack( void)
+{
+   volatile char stack[STACK_PREFAULT];
+
+   memset( (char *) stack, 0, sizeof( stack));
+}
+
+//
+//  Apply the configured affinity and scheduling to the calling thread.
+//
+
+void setup_thread( int role)
+{
+   int err;
+   struct THREAD_CF *t = thread_cf + role;
+
+   if( t->ncpus &&
+       (err = pthread_setaffinity_np( pthread_self(),
+                                      sizeof( cpu_set_t), &t->cpus)) != 0)
+      report( -1, "cannot set CPU affinity of %s thread: %s",
+                  t->name, strerror( err));
+
+   if( t->policy >= 0)
+   {
+      struct sched_param pa;
+
+      pa.sched_priority = t->priority;
+      if( (err = pthread_setschedparam( pthread_self(),
+                                        t->policy, &pa)) != 0)
+         report( -1, "cannot set scheduling of %s thread: %s",
+                     t->name, strerror( err));
+      else
+         report( 1, "%s thread: policy %d priority %d",
+                    t->name, t->policy, t->priority);
+   }
+
+   if( CF_lock_memory) prefault_stack();
+}
+
+//
+//  Writer thread.  Data file output is queued as (file, text) pairs;
+//  the writer takes ownership of the text and frees it once written.  A
+//  NULL text closes the file.  If the queue fills up the dsp thread waits,
+//  so data is never discarded.
+//
+//  Jobs for a time index carry it too: with a NULL text the writer notes
+//  the size of the newly opened data file as the index's base, and the
+//  text of later jobs is an index entry whose offset is relative to that.
+//
+
+#define WQ_SIZE 4096                             // Max writes waiting
+
+struct WRITE
+{
+   FILE *fo;
+   char *text;
+   size_t len;
+   struct INDEX *ix;
+};
+
+struct WRITE wq[WQ_SIZE];
+int wq_head = 0, wq_count = 0;
+int wq_stop = 0;
+pthread_mutex_t wq_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wq_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t wq_room = PTHREAD_COND_INITIALIZER;
+pthread_t writer_tid;
+
+void queue_job( FILE *fo, char *text, size_t len, struct INDEX *ix)
+{
+   pthread_mutex_lock( &wq_lock);
+   while( wq_count == WQ_SIZE) pthread_cond_wait( &wq_room, &wq_lock);
+
+   wq[(wq_head + wq_count) % WQ_SIZE].fo = fo;
+   wq[(wq_head + wq_count) % WQ_SIZE].text = text;
+   wq[(wq_head + wq_count) % WQ_SIZE].len = len;
+   wq[(wq_head + wq_count) % WQ_SIZE].ix = ix;
+   wq_count++;
+
+   pthread_cond_signal( &wq_ready);
+   pthread_mutex_unlock( &wq_lock);
+}
+
+void queue_write( FILE *fo, char *text, size_t len)
+{
+   queue_job( fo, text, len, NULL);
+}
+
+void queue_close( FILE *fo)
+{
+   queue_write( fo, NULL, 0);
+}
+
+//
+//  Queue a copy of a formatted string for writing
+//
+
+void queue_printf( FILE *fo, char *format, ...)
+{
+   va_list ap;
+   char *text;
+   int len;
+
+   va_start( ap, format);
+   len = vasprintf( &text, format, ap);
+   va_end( ap);
+   if( len < 0) bailout( "not enough memory for output");
+
+   queue_write( fo, text, len);
+}
+
+//
+//  Everything queued before for the data file has been written, so its
+//  size is where the index's offsets start
+//
+
+void index_base( struct INDEX *ix, FILE *fo)
+{
+   struct stat st;
+
+   if( fstat( fileno( fo), &st) < 0)
+   {
+      report( 0, "cannot stat output file: %s", strerror( errno));
+      st.st_size = 0;
+   }
+   ix->base = st.st_size;
+}
+
+void *writer_thread( void *arg)
+{
+   struct WRITE w;
+
+   setup_thread( TH_WRITER);
+
+   pthread_mutex_lock( &wq_lock);
+   while( 1)
+   {
+      while( !wq_count && !wq_stop) pthread_cond_wait( &wq_ready, &wq_lock);
+      if( !wq_count) break;
+
+      w = wq[wq_head];
+      wq_head = (wq_head + 1) % WQ_SIZE;
+      wq_count--;
+      pthread_cond_signal( &wq_room);
+      pthread_mutex_unlock( &wq_lock);
+
+      if( !w.text && w.ix) index_base( w.ix, w.fo);
+      else
+      if( !w.text) fclose( w.fo);
+      else
+      {
+         if( w.ix) ((struct SIDC_INDEX_ENTRY *) w.text)->offset += w.ix->base;
+
+         PROF_START( t0);
+         if( fwrite( w.text, 1, w.len, w.fo) != w.len || fflush( w.fo))
+            report( 0, "data file write failed: %s", strerror( errno));
+         PROF_STOP( PROF_WRITE, t0);
+         free( w.text);
+      }
+
+      pthread_mutex_lock( &wq_lock);
+   }
+   pthread_mutex_unlock( &wq_lock);
+
+   return NULL;
+}
+
+void start_writer( void)
+{
+   int err;
+
+   if( (err = pthread_create( &writer_tid, NULL, writer_thread, NULL)) != 0)
+      bailout( "cannot create writer thread: %s", strerror( err));
+}
+
+//
+//  Wait for everything queued so far to be written, then stop the writer.
+//
+
+void stop_writer( void)
+{
+   pthread_mutex_lock( &wq_lock);
+   wq_stop = 1;
+   pthread_cond_signal( &wq_ready);
+   pthread_mutex_unlock( &wq_lock);
+
+   pthread_join( writer_tid, NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Alerts                                                                   //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  The alert thread hands each queued alert to the configured sinks: the
+//  mail command, the alert_hook script and the alert_file.
+//
+//  Queueing never waits.  An alert already waiting is counted rather than
+//  queued again, and when the queue is full an alert is only logged.  Each
+//  distinct alert is sent at most once in alert_hold seconds, and at most
+//  alert_max alerts go in that time.  An alert held back is sent, with the
+//  number of times it was raised, once it is allowed.  So a flapping loss
+//  of signal costs two messages per alert_hold, not two per frame.
+//
+
+#define AQ_SIZE 32                                     // Max alerts waiting
+#define MAXRECENT 32                   // Number of distinct alerts remembered
+
+struct ALERT
+{
+   char *text;
+   time_t time;                               // When first raised
+   int count;                                 // Number of times raised
+};
+
+struct ALERT aq[AQ_SIZE];
+int aq_head = 0, aq_count = 0;
+int aq_stop = 0;
+long alerts_lost = 0;                    // Alerts only logged, queue full
+pthread_mutex_t aq_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t aq_ready = PTHREAD_COND_INITIALIZER;
+pthread_t alert_tid;
+
+//
+//  What the alert thread has sent, and what it is holding back
+//
+
+struct RECENT
+{
+   char *text;                                 // NULL if the slot is free
+   double sent;                          // monotonic_time() when last sent
+   struct ALERT held;              // Raised since then, not yet sent
+}
+ recent[MAXRECENT];
+
+double *sent_ring;          // Times of the last alert_max sends, oldest first
+int sent_head = 0;
+
+void queue_alert( char *text)
+{
+   int i;
+
+   pthread_mutex_lock( &aq_lock);
+
+   for( i = 0; i < aq_count; i++)
+   {
+      struct ALERT *a = aq + (aq_head + i) % AQ_SIZE;
+
+      if( !strcmp( a->text, text))
+      {
+         a->count++;
+         free( text);
+         text = NULL;
+         break;
+      }
+   }
+
+   if( text && aq_count == AQ_SIZE)
+   {
+      alerts_lost++;
+      free( text);
+   }
+   else
+   if( text)
+   {
+      struct ALERT *a = aq + (aq_head + aq_count++) % AQ_SIZE;
+
+      a->text = text;
+      a->time = time( NULL);
+      a->count = 1;
+      pthread_cond_signal( &aq_ready);
+   }
+
+   pthread_mutex_unlock( &aq_lock);
+}
+
+//
+//  The sinks
+//
+
+void alert_mail( char *msg)
+{
+   FILE *f;
+   char *cmd;
+
+   if( asprintf( &cmd, "mail -s 'sidc alert' '%s'", CF_mailaddr) < 0) return;
+
+   if( (f=popen( cmd, "w")) == NULL)
+      report( 0, "cannot exec [%s]: %s", cmd, strerror( errno));
+   else
+   {
+      fprintf( f, "sidc: %s\n", msg);
+      pclose( f);
+   }
+
+   free( cmd);
+}
+
+//
+//  The hook runs under /bin/sh with the alert in the environment:
+//  SIDC_ALERT the text, SIDC_ALERT_TIME when it was first raised (unix
+//  seconds) and SIDC_ALERT_COUNT the number of times it was raised.
+//
+
+extern char **environ;
+
+void alert_hook( char *text, time_t t, int count)
+{
+   int i, n, status, err;
+   pid_t pid;
+   char **env, *text_s, time_s[40], count_s[40];
+   char *argv[] = { "sh", "-c", CF_alert_hook, NULL };
+   posix_spawnattr_t attr;
+   sigset_t none;
+
+   for( n = 0; environ[n]; n++);
+   if( (env = calloc( n + 4, sizeof( char *))) == NULL ||
+       asprintf( &text_s, "SIDC_ALERT=%s", text) < 0)
+   {
+      free( env);
+      return;
+   }
+   sprintf( time_s, "SIDC_ALERT_TIME=%ld", (long) t);
+   sprintf( count_s, "SIDC_ALERT_COUNT=%d", count);
+
+   for( i = n = 0; environ[i]; i++)
+      if( strncmp( environ[i], "SIDC_ALERT", 10)) env[n++] = environ[i];
+   env[n++] = text_s;
+   env[n++] = time_s;
+   env[n++] = count_s;
+
+   // The child should not inherit our blocked signals
+   sigemptyset( &none);
+   posix_spawnattr_init( &attr);
+   posix_spawnattr_setsigmask( &attr, &none);
+   posix_spawnattr_setflags( &attr, POSIX_SPAWN_SETSIGMASK);
+
+   if( (err = posix_spawn( &pid, "/bin/sh", NULL, &attr, argv, env)) != 0)
+      report( 0, "cannot run alert_hook: %s", strerror( err));
+   else
+   if( waitpid( pid, &status, 0) == pid &&
+       (!WIFEXITED( status) || WEXITSTATUS( status)))
+      report( 0, "alert_hook failed, status 0x%x", status);
+
+   posix_spawnattr_destroy( &attr);
+   free( text_s);
+   free( env);
+}
+
+void alert_file( char *msg, time_t t)
+{
+   FILE *f;
+   struct tm tm;
+
+   if( (f = fopen( CF_alert_file, "a")) == NULL)
+   {
+      report( 0, "cannot open alert_file %s: %s",
+                 CF_alert_file, strerror( errno));
+      return;
+   }
+
+   gmtime_r( &t, &tm);
+   fprintf( f, "%04d/%02d/%02d %02d:%02d:%02d %s\n",
+               tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
+               tm.tm_hour, tm.tm_min, tm.tm_sec, msg);
+   fclose( f);
+}
+
+//
+//  Send an alert to every sink.  Takes ownership of the text.
+//
+
+void send_alert( char *text, time_t t, int count)
+{
+   char *msg;
+
+   if( count <= 1 || asprintf( &msg, "%s (raised %d times)", text, count) < 0)
+      msg = strdup( text);
+
+   if( msg)
+   {
+      if( CF_mailaddr) alert_mail( msg);
+      if( CF_alert_file) alert_file( msg, t);
+      free( msg);
+   }
+   if( CF_alert_hook) alert_hook( text, t, count);
+
+   free( text);
+}
+
+//
+//  Note a dequeued alert in the recent table, to be sent when allowed
+//
+
+void hold_alert( struct ALERT *a)
+{
+   int i;
+   struct RECENT *r = NULL, *old = NULL;
+
+   for( i = 0; i < MAXRECENT && !r; i++)
+      if( recent[i].text && !strcmp( recent[i].text, a->text)) r = recent + i;
+
+   if( r)
+   {
+      if( !r->held.count) r->held.time = a->time;
+      r->held.count += a->count;
+      free( a->text);
+      return;
+   }
+
+   // A new alert takes a free slot, else that of the one sent longest ago
+   for( i = 0; i < MAXRECENT && !r; i++)
+   {
+      if( !recent[i].text) r = recent + i;
+      else
+      if( !recent[i].held.count &&
+          (!old || recent[i].sent < old->sent)) old = recent + i;
+   }
+   if( !r) r = old;
+
+   if( !r)
+   {
+      alerts_lost++;
+      free( a->text);
+      return;
+   }
+
+   free( r->text);
+   r->text = a->text;
+   r->sent = -1e30;
+   r->held = *a;
+   r->held.text = NULL;
+}
+
+//
+//  Send, oldest first, the held alerts now allowed, or all of them if
+//  forced.  Returns the number still held.
+//
+
+int release_alerts( int force)
+{
+   int i, nheld;
+
+   while( 1)
+   {
+      double now = monotonic_time();
+      int rate_ok = force || sent_ring[sent_head] <= now - CF_alert_hold;
+      struct RECENT *next = NULL;
+
+      for( i = nheld = 0; i < MAXRECENT; i++)
+      {
+         struct RECENT *r = recent + i;
+
+         if( !r->held.count) continue;
+         nheld++;
+         if( !rate_ok || (!force && r->sent > now - CF_alert_hold)) continue;
+         if( !next || r->held.time < next->held.time) next = r;
+      }
+
+      if( !next) return nheld;
+
+      send_alert( strdup( next->text), next->held.time, next->held.count);
+      next->sent = now;
+      next->held.count = 0;
+      sent_ring[sent_head] = now;
+      sent_head = (sent_head + 1) % CF_alert_max;
+   }
+}
+
+void *alert_thread( void *arg)
+{
+   struct ALERT a;
+   int nheld = 0;
+
+   setup_thread( TH_ALERT);
+
+   pthread_mutex_lock( &aq_lock);
+   while( 1)
+   {
+      if( !aq_count && !aq_stop)
+      {
+         if( nheld)
+         {
+            // Look again each second for held alerts now allowed
+            struct timespec ts;
+
+            clock_gettime( CLOCK_REALTIME, &ts);
+            ts.tv_sec++;
+            pthread_cond_timedwait( &aq_ready, &aq_lock, &ts);
+         }
+         else pthread_cond_wait( &aq_ready, &aq_lock);
+      }
+      if( !aq_count && aq_stop) break;
+
+      if( aq_count)
+      {
+         a = aq[aq_head];
+         aq_head = (aq_head + 1) % AQ_SIZE;
+         aq_count--;
+      }
+      else a.text = NULL;
+      pthread_mutex_unlock( &aq_lock);
+
+      if( a.text) hold_alert( &a);
+      nheld = release_alerts( 0);
+
+      pthread_mutex_lock( &aq_lock);
+   }
+   pthread_mutex_unlock( &aq_lock);
+
+   release_alerts( 1);                 // Send whatever is held back, on exit
+   return NULL;
+}
+
+void start_alerts( void)
+{
+   int i, err;
+
+   if( !CF_mailaddr && !CF_alert_hook && !CF_alert_file) return;
+
+   if( (sent_ring = malloc( CF_alert_max * sizeof( double))) == NULL)
+      bailout( "not enough memory for alerts");
+   for( i = 0; i < CF_alert_max; i++) sent_ring[i] = -1e30;
+
+   if( (err = pthread_create( &alert_tid, NULL, alert_thread, NULL)) != 0)
+      bailout( "cannot create alert thread: %s", strerror( err));
+}
+
+//
+//  Send everything queued or held back, then stop the alert thread.
+//  Alerts after this are only logged.
+//
+
+void stop_alerts( void)
+{
+   int i;
+
+   if( !sent_ring) return;
+
+   pthread_mutex_lock( &aq_lock);
+   alert_on = 0;
+   aq_stop = 1;
+   pthread_cond_signal( &aq_ready);
+   pthread_mutex_unlock( &aq_lock);
+
+   pthread_join( alert_tid, NULL);
+
+   if( alerts_lost) report( 0, "%ld alerts were only logged", alerts_lost);
+   for( i = 0; i < MAXRECENT; i++) free( recent[i].text);
+   free( sent_ring);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Time Index                                                               //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  With index_block set, each data file has a sidecar <file>.idx with an
+//  entry for every index_block records, giving their time span, byte range
+//  and the range of every value (see sidc_format.h).  Readers load the
+//  small index, binary search it for a time, and skip blocks whose values
+//  cannot matter.
+//
+//  Everything written to a data file goes through here so that the offset
+//  of each record is known without asking the writer thread.
+//
+
+//
+//  Start indexing a newly opened data file
+//
+
+void index_open( struct INDEX *ix, FILE *fo, char *filename, int nvals)
+{
+   char *name;
+
+   if( !CF_index_block) return;
+
+   // Earlier writes to the same file may still be queued, so the writer
+   // finds its size once they are done
+   queue_job( fo, NULL, 0, ix);
+   ix->offset = 0;
+   ix->count = 0;
+
+   if( nvals != ix->nvals || !ix->min)
+   {
+      ix->min = realloc( ix->min, nvals * sizeof( float));
+      ix->max = realloc( ix->max, nvals * sizeof( float));
+      if( !ix->min || !ix->max) bailout( "not enough memory for index");
+      ix->nvals = nvals;
+   }
+
+   if( (name = malloc( strlen( filename) + 5)) == NULL)
+      bailout( "not enough memory for index");
+   sprintf( name, "%s.idx", filename);
+   if( (ix->fo = fopen( name, "a")) == NULL)
+      bailout( "cannot open [%s], %s", name, strerror( errno));
+   free( name);
+}
+
+void index_flush( struct INDEX *ix)
+{
+   struct SIDC_INDEX_ENTRY *e;
+   int n = ix->nvals * sizeof( float);
+   int len = sizeof( struct SIDC_INDEX_ENTRY) + 2 * n;
+
+   if( !ix->fo || !ix->count) return;
+
+   if( (e = malloc( len)) == NULL) bailout( "not enough memory for index");
+   e->magic = SIDC_INDEX_MAGIC;
+   e->nvals = ix->nvals;
+   e->count = ix->count;
+   e->reserved = 0;
+   e->first = ix->first;
+   e->last = ix->last;
+   e->offset = ix->start;
+   e->length = ix->offset - ix->start;
+   memcpy( (char *)(e + 1), ix->min, n);
+   memcpy( (char *)(e + 1) + n, ix->max, n);
+   queue_job( ix->fo, (char *) e, len, ix);
+
+   ix->count = 0;
+}
+
+//
+//  Write non-record text, such as headers and gap markers
+//
+
+void data_write( struct INDEX *ix, FILE *fo, char *text, size_t len)
+{
+   ix->offset += len;
+   queue_write( fo, text, len);
+}
+
+//
+//  Write a record holding the given values
+//
+
+void data_record( struct INDEX *ix, FILE *fo, struct timeval *tv,
+                  double *vals, char *text, size_t len)
+{
+   int i;
+   double t = tv->tv_sec + 1e-6 * tv->tv_usec;
+
+   if( ix->fo)
+   {
+      if( !ix->count)
+      {
+         ix->start = ix->offset;
+         ix->first = t;
+         for( i = 0; i < ix->nvals; i++) ix->min[i] = ix->max[i] = vals[i];
+      }
+
+      for( i = 0; i < ix->nvals; i++)
+      {
+         if( isnan( ix->min[i]) || vals[i] < ix->min[i]) ix->min[i] = vals[i];
+         if( isnan( ix->max[i]) || vals[i] > ix->max[i]) ix->max[i] = vals[i];
+      }
+      ix->last = t;
+      ix->count++;
+   }
+
+   data_write( ix, fo, text, len);
+   if( ix->count == CF_index_block) index_flush( ix);
+}
+
+void data_close( struct INDEX *ix, FILE *fo)
+{
+   if( ix->fo)
+   {
+      index_flush( ix);
+      queue_close( ix->fo);
+      ix->fo = NULL;
+   }
+   queue_close( fo);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Output Functions                                                         //
+///////////////////////////////////////////////////////////////////////////////
+
+/* Appends formatted string to *d while extending allocation */
+int append_sprintf( char **d, char *format, ...)
+{
+   int len;
+   int ret;
+   char *tgt;
+   va_list ap, ap2;
+
+   va_copy( ap2, ap);
+   va_start( ap, format);
+   len = vsnprintf( NULL, 0, format, ap) + 1;
+   va_end( ap);
+   if (*d)
+   {
+      *d = realloc( *d, strlen( *d) + len);
+      tgt = *d + strlen( *d);
+   } else {
+      tgt = *d = malloc( len);
+   }
+   if (!*d)
+      bailout( "could not allocate memory, %s", strerror( errno));
+   va_start( ap2, format);
+   ret = vsprintf( tgt, format, ap2);
+   va_end( ap);
+
+   return ret;
+}
+
+int substitute_params( char **d, struct timeval *tv,
+                              char *format, char *band)
+{
+   double fsecs = tv->tv_sec + 1e-6 * tv->tv_usec;
+   time_t ud = tv->tv_sec;
+   struct tm *tm = gmtime( &ud);
+
+   while( *format)
+   {
+      if( *format != '%') { append_sprintf( d, "%c", *format++); continue; }
+
+      format++;
+      switch( *format++)
+      {
+         case '%': append_sprintf( d, "%c", *format++); break;
+
+         case 'y': append_sprintf( d, "%02d", tm->tm_year % 100);  break;
+         case 'm': append_sprintf( d, "%02d", tm->tm_mon+1); break;
+         case 'd': append_sprintf( d, "%02d", tm->tm_mday); break;
+
+         case 'H': append_sprintf( d, "%02d", tm->tm_hour);  break;
+         case 'M': append_sprintf( d, "%02d", tm->tm_min);  break;
+         case 'S': append_sprintf( d, "%02d", tm->tm_sec);  break;
+
+         case 'B': if( !band) bailout( "cannot specify %B in this mode");
+                   append_sprintf( d, "%s", band);   break;
+         case 'U': append_sprintf( d, "%ld", tv->tv_sec); break;
+         case 'u': append_sprintf( d, "%.3f", fsecs);  break;
+
+         case 'E': append_sprintf( d, "%d", (int)(tv->tv_sec % 86400)); break;
+         case 'e': append_sprintf( d, "%.3f", 1e-6 * tv->tv_usec + 
+                                            (tv->tv_sec % 86400)); break;
+         default: return 0;
+      }
+   }
+
+   return 1;
+}
+
+//
+//  Average power in a band over an output's interval, scaled as configured
+//
+
+double band_power( struct OUTPUT *o, struct BAND *b)
+{
+   int j;
+   double e = 0;
+   double *p = o->pow[b->side == &right];
+   int n1 = b->start/DF;
+   int n2 = b->end/DF;
+
+   if( o->hist) e = hist_percentile( o->hist + (b - bands) * NHIST, o->param);
+   else
+   if( o->bval) e = o->bval[b - bands];
+   else
+   {
+      for( j=n1; j<= n2; j++) e += p[j];
+      e /= o->summed * (n2 - n1 + 1);
+   }
+
+   if( CF_log_scale) e = CF_offset_db + 10 * log10( e + 1e-9);
+   return e;
+}
+
+//
+//  Cross-spectral measures of a band over the output interval, for a pair
+//  of crossed loops on the left and right inputs.  From the band's cross
+//  spectrum Sxy = sum L.conj(R) and the two auto spectra Sxx and Syy:
+//
+//     coherence  |Sxy|^2/(Sxx.Syy), 0..1, near 1 for a single clean signal
+//     phase      arg Sxy in degrees, near 0 or 180 for a plane wave
+//     bearing    direction of arrival in degrees, 0..180, measured from the
+//                maximum of the left loop towards that of the right loop.
+//                Loops cannot tell the front from the back, so the bearing
+//                has a 180 degree ambiguity.
+//
+//  The bearing is the major axis of the polarisation ellipse,
+//  0.5 atan2( 2 Re Sxy, Sxx - Syy).
+//
+//  Sxx and Syy are summed alongside Sxy, so that frames in which the cross
+//  spectrum was shed count in none of them.  If it was shed for the whole
+//  interval the three values are NaN.
+//
+
+void cross_values( struct BAND *b, double *v)
+{
+   if( !cross_frames)
+   {
+      v[0] = v[1] = v[2] = NAN;
+      return;
+   }
+
+   v[0] = (b->xre * b->xre + b->xim * b->xim)/(b->sxx * b->syy + 1e-30);
+   v[1] = atan2( b->xim, b->xre) * 180/M_PI;
+   v[2] = 0.5 * atan2( 2 * b->xre, b->sxx - b->syy) * 180/M_PI;
+   if( v[2] < 0) v[2] += 180;
+}
+
+void print_cross( FILE *f, double *v)
+{
+   fprintf( f, " %.3f %.1f %.1f", v[0], v[1], v[2]);
+}
+
+//
+//  Records are formatted into memory with open_memstream() so that the
+//  same text can go to the data file and to any subscribers.
+//
+
+FILE *open_record( char **line, size_t *len)
+{
+   FILE *f;
+
+   if( (f = open_memstream( line, len)) == NULL)
+      bailout( "cannot open record stream: %s", strerror( errno));
+   return f;
+}
+
+//
+//  Make a binary record for a data file or subscriber: the header and
+//  then the values as single precision.
+//
+
+char *binary_record( int type, struct timeval *tv, int count,
+                     double *vals, int nvals, size_t *len)
+{
+   int i;
+   struct SIDC_RECORD *r;
+   float *v;
+
+   *len = sizeof( struct SIDC_RECORD) + nvals * sizeof( float);
+   if( (r = malloc( *len)) == NULL)
+      bailout( "not enough memory for output");
+
+   r->magic = SIDC_RECORD_MAGIC;
+   r->type = type;
+   r->count = count;
+   r->reserved = 0;
+   r->stamp = tv->tv_sec + 1e-6 * tv->tv_usec;
+
+   v = (float *)(r + 1);
+   for( i=0; i<nvals; i++) v[i] = vals[i];
+   return (char *) r;
+}
+
+//
+//  Make a HEADING record: the header and then the heading line, padded
+//  with NULs to a whole number of values
+//
+
+char *binary_heading( struct timeval *tv, char *heading, size_t *len)
+{
+   size_t n = strlen( heading), pad = (n + 3) & ~(size_t) 3;
+   char *r = binary_record( SIDC_RECORD_HEADING, tv, pad, NULL, 0, len);
+
+   if( (r = realloc( r, *len + pad)) == NULL)
+      bailout( "not enough memory for output");
+   memset( r + *len, 0, pad);
+   memcpy( r + *len, heading, n);
+   *len += pad;
+   return r;
+}
+
+//
+//  Open a data file of an output and start its index.  The heading line,
+//  if any, is written to text files when output_header is set, and always
+//  to binary files as a HEADING record, since they have no other way to
+//  name their values.
+//
+
+FILE *open_data_file( struct OUTPUT *o, struct INDEX *ix, char *prefix,
+                      int nvals, char *heading)
+{
+   FILE *fo;
+   char *filename = NULL;
+
+   append_sprintf( &filename, "%s/%s", CF_datadir, prefix);
+   if( (fo = fopen( filename, "a")) == NULL)
+      bailout( "cannot open [%s], %s", filename, strerror( errno));
+   index_open( ix, fo, filename, nvals);
+
+   if( heading && o->binary)
+   {
+      struct timeval tv;
+      size_t len;
+      char *r;
+
+      gettimeofday( &tv, NULL);
+      r = binary_heading( &tv, heading, &len);
+      data_write( ix, fo, r, len);
+      free( heading);
+   }
+   else
+   if( heading && CF_output_header)
+      data_write( ix, fo, heading, strlen( heading));
+   else
+      free( heading);
+
+   free( filename);
+   return fo;
+}
+
+//
+//  Write a record to a data file of an output: the formatted text, or
+//  for a binary output the values.  Takes ownership of the text.
+//
+
+void write_record( struct OUTPUT *o, FILE *fo, struct INDEX *ix,
+                   struct timeval *tv, double *vals, int nvals,
+                   char *line, size_t len)
+{
+   if( o->binary)
+   {
+      free( line);
+      line = binary_record( SIDC_RECORD_DATA, tv, nvals, vals, nvals, &len);
+   }
+
+   data_record( ix, fo, tv, vals, line, len);
+}
+
+void output_record_multi( struct OUTPUT *o, struct timeval *tv)
+{
+   int i;
+   int main_out = o == outputs;
+   int nvals = 4 + nbands + (main_out ? ncross : 0);
+   struct BAND *b;
+   char *prefix = NULL, *stamp = NULL, *line = NULL;
+   size_t len;
+   FILE *f;
+
+   if( !substitute_params( &prefix, tv, o->files, NULL))
+      bailout( "error in output_files configuration");
+
+   if( bound_strcmp( prefix, o->prefix))
+   {
+      if( o->prefix) free( o->prefix);
+      o->prefix = strdup( prefix);
+      report( 0, "using output file [%s/%s]", CF_datadir, o->prefix);
+
+      // Output a header every time sidc is started - only way to handle
+      // band changes etc
+      f = open_record( &line, &len);
+      fputs( "# stamp lpeak rpeak lrms rrms ", f);
+      for( b = bands, i = 0; i < nbands; i++, b++)
+         fprintf( f, "%s ", b->ident);
+      if( main_out && CF_cross)
+         for( b = bands, i = 0; i < nbands; i++, b++)
+            fprintf( f, "%s_coh %s_phase %s_brg ",
+                        b->ident, b->ident, b->ident);
+      fputs( "\n", f);
+      fclose( f);
+
+      if( o->fo) data_close( &o->ix, o->fo);
+      o->fo = open_data_file( o, &o->ix, o->prefix, nvals, line);
+      line = NULL;
+   }
+
+   substitute_params( &stamp, tv, CF_timestamp, NULL);
+
+   rec_vals[0] = o->peak[0];
+   rec_vals[1] = o->peak[1];
+   rec_vals[2] = sqrt( o->sum_sq[0]/FFTWID);
+   rec_vals[3] = sqrt( o->sum_sq[1]/FFTWID);
+
+   f = open_record( &line, &len);
+   fprintf( f, "%s %.3f %.3f %.3f %.3f", stamp,
+               rec_vals[0], rec_vals[1], rec_vals[2], rec_vals[3]);
+
+   for( b = bands, i = 0; i < nbands; i++, b++)
+   {
+      double e = rec_vals[4 + i] = band_power( o, b);
+      fputs( " ", f);
+      fprintf( f, CF_field_format, e);
+      if( main_out && CF_flare_file) flare_update( b, tv, e);
+   }
+
+   if( main_out && CF_cross)
+      for( b = bands, i = 0; i < nbands; i++, b++)
+      {
+         double *v = rec_vals + 4 + nbands + 3 * i;
+         cross_values( b, v);
+         print_cross( f, v);
+      }
+
+   fputs( "\n", f);
+   fclose( f);
+
+   if( main_out) publish_record( tv, line, len, nvals);
+   write_record( o, o->fo, &o->ix, tv, rec_vals, nvals, line, len);
+
+   free( prefix);
+   free( stamp);
+}
+
+void output_record_each( struct OUTPUT *o, struct timeval *tv)
+{
+   int i;
+   int cross = o == outputs && CF_cross;
+   struct BAND *b;
+   char *prefix = NULL, *line = NULL;
+   size_t len = 0;
+   FILE *f = NULL;
+
+   if( !substitute_params( &prefix, tv, o->files, "ID"))
+      bailout( "error in output_files configuration");
+
+   if( bound_strcmp( prefix, o->prefix))
+   {
+      if( o->prefix) free( o->prefix);
+      o->prefix = strdup( prefix);
+      report( 0, "using output files [%s]", o->prefix);
+
+      for( b = bands, i = 0; i < nbands; i++, b++)
+      {
+         char *prefix = NULL;
+
+         if( o->bfo[i]) data_close( &o->bix[i], o->bfo[i]);
+         substitute_params( &prefix, tv, o->files, b->ident);
+         o->bfo[i] = open_data_file( o, &o->bix[i], prefix, cross ? 4 : 1,
+                        strdup( cross ? "# stamp power coh phase brg\n"
+                                      : "# stamp power\n"));
+         free( prefix);
+      }
+   }
+
+   //
+   //  Subscribers get all the bands in a single record.  New subscribers
+   //  are only accepted by the dsp thread's poll loop, so if there are no
+   //  text subscribers now there will be none when it is published.
+   //
+
+   if( o == outputs && rsock_text_clients())
+   {
+      char *stamp = NULL;
+
+      substitute_params( &stamp, tv, CF_timestamp, "");
+      f = open_record( &line, &len);
+      fputs( stamp, f);
+      free( stamp);
+   }
+
+   for( b = bands, i = 0; i < nbands; i++, b++)
+   {
+      double e = rec_vals[i] = band_power( o, b);
+      double v[4];                           // This band's values for its index
+      char *stamp = NULL, *bline = NULL;
+      size_t blen;
+      FILE *bf = open_record( &bline, &blen);
+
+      substitute_params( &stamp, tv, CF_timestamp, b->ident);
+
+      fprintf( bf, "%s ", stamp);
+      fprintf( bf, CF_field_format, e);
+      v[0] = e;
+      if( cross)
+      {
+         cross_values( b, v + 1);
+         memcpy( rec_vals + nbands + 3 * i, v + 1, 3 * sizeof( double));
+         print_cross( bf, v + 1);
+      }
+      fputs( "\n", bf);
+      fclose( bf);
+      write_record( o, o->bfo[i], &o->bix[i], tv, v, cross ? 4 : 1,
+                    bline, blen);
+
+      if( f)
+      {
+         fputs( " ", f);
+         fprintf( f, CF_field_format, e);
+      }
+
+      if( o == outputs && CF_flare_file) flare_update( b, tv, e);
+      free( stamp);
+   }
+
+   if( f)
+   {
+      if( cross)
+         for( i = 0; i < nbands; i++) print_cross( f, rec_vals + nbands + 3 * i);
+      fputs( "\n", f);
+      fclose( f);
+   }
+   if( o == outputs) publish_record( tv, line, len, nbands + ncross);
+
+   free( line);
+   free( prefix);
+}
+
+void output_spectrum_record( struct OUTPUT *o, struct timeval *tv)
+{
+   int i;
+   char *stamp = NULL, *prefix = NULL, *line = NULL;
+   size_t len;
+   FILE *f;
+
+   if( !substitute_params( &prefix, tv, o->files, NULL))
+      bailout( "error in output_files configuration");
+
+   if( bound_strcmp( prefix, o->prefix))
+   {
+      if( o->prefix) free( o->prefix);
+      o->prefix = strdup( prefix);
+      report( 0, "using output file [%s/%s]", CF_datadir, o->prefix);
+
+      // Output a header every time sidc is started - only way to handle
+      // band changes etc
+      f = open_record( &line, &len);
+      fputs( "# FREQ ", f);
+      for( i = cuton; i < cutoff; i++)
+         if( output_zoomed( o)) fprintf( f, "%.3f ", zoom_freq( i));
+         else fprintf( f, "%.2f ", (i+0.5) * DF);
+      fputs( "\n", f);
+      fclose( f);
+
+      if( o->fo) data_close( &o->ix, o->fo);
+      o->fo = open_data_file( o, &o->ix, o->prefix, cutoff - cuton, line);
+      line = NULL;
+   }
+
+   substitute_params( &stamp, tv, CF_timestamp, NULL);
+   f = open_record( &line, &len);
+   fputs( stamp, f);
+
+   for( i=cuton; i<cutoff; i++)
+   {
+      double e;
+
+      if( output_zoomed( o))
+      {
+         e = o->zpow[i - cuton];
+         if( o->bin_mode == AV_MEAN) e /= o->zsummed;
+      }
+      else
+      {
+         e = o->pow[0][i];
+         if( o->bin_mode == AV_MEAN) e /= o->summed;
+      }
+      if( CF_log_scale) e = CF_offset_db + 10 * log10( e + 1e-9);
+      rec_vals[i - cuton] = e;
+      fputs( " ", f);
+      fprintf( f, CF_field_format, e); 
+   }
+
+   fputs( "\n", f);
+   fclose( f);
+
+   if( o == outputs) publish_record( tv, line, len, cutoff - cuton);
+   write_record( o, o->fo, &o->ix, tv, rec_vals, cutoff - cuton, line, len);
+
+   free( prefix);
+   free( stamp);
+}
+
+//
+//  Mark a gap in the input with a comment record in the data files, so
+//  that the time series shows honestly where samples were lost.  The
+//  partly filled FT frame spans the gap and is discarded.
+//
+
+void write_note( struct OUTPUT *o, FILE *fo, struct INDEX *ix,
+                 struct timeval *tv, int type, long count,
+                 char *line, size_t len)
+{
+   if( !fo) return;
+
+   if( o->binary)
+      line = binary_record( type, tv, count, NULL, 0, &len);
+   else
+      line = strdup( line);
+
+   data_write( ix, fo, line, len);
+}
+
+//
+//  Write a line, or for binary outputs a record with no values, to every
+//  open data file
+//
+
+void output_note( struct timeval *tv, int type, long count,
+                  char *line, size_t len)
+{
+   int i;
+   struct OUTPUT *o;
+
+   for( o = outputs; o < outputs + noutputs; o++)
+      if( o->policy == OP_BANDS_EACH)
+         for( i = 0; i < nbands; i++)
+            write_note( o, o->bfo[i], &o->bix[i], tv, type, count, line, len);
+      else
+         write_note( o, o->fo, &o->ix, tv, type, count, line, len);
+}
+
+void output_gap( long lost)
+{
+   struct timeval tv;
+   char *stamp = NULL, *line = NULL;
+   size_t len;
+   FILE *f;
+
+   grab_cnt = 0;
+   zoom.fill = 0;
+   pfb_reset();
+
+   gettimeofday( &tv, NULL);
+   substitute_params( &stamp, &tv, CF_timestamp, "");
+   f = open_record( &line, &len);
+   fprintf( f, "# gap %s %ld %.3f\n", stamp, lost,
+               (double) lost / CF_sample_rate);
+   fclose( f);
+
+   output_note( &tv, SIDC_RECORD_GAP, lost, line, len);
+   publish_gap( &tv, line, len, lost);
+
+   free( line);
+   free( stamp);
+}
+
+//
+//  Clear down the spectrum, band and peak/rms accumulators for the next
+//  interval.  An EMA carries on.
+//
+
+void clear_sums( struct OUTPUT *o)
+{
+   int i, c;
+   double v = o->average == AV_MIN ? HUGE_VAL : 0;
+
+   if( o->bin_mode != AV_EMA)
+      for( c = 0; c < CF_chans; c++)
+         for( i=1; i<CF_bins; i++)
+            o->pow[c][i] = o->bin_mode == AV_MIN ? HUGE_VAL : 0;
+
+   if( o->zpow && o->bin_mode != AV_EMA)
+      for( i = 0; i < cutoff - cuton; i++) o->zpow[i] = v;
+
+   if( o->bval && o->average != AV_EMA)
+      for( i = 0; i < nbands; i++) o->bval[i] = v;
+   if( o->hist) memset( o->hist, 0, nbands * NHIST * sizeof( unsigned));
+
+   o->peak[0] = o->sum_sq[0] = 0;
+   o->peak[1] = o->sum_sq[1] = 0;
+   o->frame_cnt = 0;
+   o->summed = 0;
+   o->zsummed = 0;
+}
+
+void output_record( struct OUTPUT *o)
+{
+   int i;
+   struct timeval tv;
+
+   if( o == outputs)
+   {
+      if( CF_chans == 2)
+         report( 2, "peak/rms left=%.3f/%.3f right=%.3f/%.3f",
+                 o->peak[0], sqrt( o->sum_sq[0]/(FFTWID * o->interval)),
+                 o->peak[1], sqrt( o->sum_sq[1]/(FFTWID * o->interval)));
+      else
+         report( 2, "peak/rms %.3f/%.3f",
+                 o->peak[0], sqrt( o->sum_sq[0]/FFTWID));
+   }
+
+   gettimeofday( &tv, NULL);
+
+   if( o->policy == OP_SPECTRUM)
+   {
+      output_spectrum_record( o, &tv);
+      if( o == outputs && nrollups) rollup_record( &tv, cutoff - cuton);
+   }
+   else
+   if( o->policy == OP_BANDS_MULTI)
+   {
+      output_record_multi( o, &tv);
+      if( o == outputs && nrollups) rollup_record( &tv, 4 + nbands + ncross);
+   }
+   else
+   if( o->policy == OP_BANDS_EACH)
+   {
+      output_record_each( o, &tv);
+      if( o == outputs && nrollups) rollup_record( &tv, nbands + ncross);
+   }
+
+   clear_sums( o);
+
+   if( o == outputs)
+   {
+      records_total++;
+      for( i=0; i<nbands; i++)
+         bands[i].xre = bands[i].xim = bands[i].sxx = bands[i].syy = 0;
+      cross_frames = 0;
+   }
+}
+
+//
+//  Close all the data files.  They are opened again, under the name
+//  current at the time, when the next record is output.
+//
+
+void close_output_files( void)
+{
+   int i;
+   struct OUTPUT *o;
+
+   for( o = outputs; o < outputs + noutputs; o++)
+   {
+      if( o->fo) data_close( &o->ix, o->fo);
+      o->fo = NULL;
+
+      for( i = 0; o->bfo && i < nbands; i++)
+      {
+         if( o->bfo[i]) data_close( &o->bix[i], o->bfo[i]);
+         o->bfo[i] = NULL;
+      }
+
+      if( o->prefix) free( o->prefix);
+      o->prefix = NULL;
+   }
+
+   if( ev_fo) queue_close( ev_fo);
+   ev_fo = NULL;
+   if( ev_prefix) free( ev_prefix);
+   ev_prefix = NULL;
+
+   for( i = 0; i < nrollups; i++)
+   {
+      if( rollups[i].fo) queue_close( rollups[i].fo);
+      rollups[i].fo = NULL;
+      if( rollups[i].prefix) free( rollups[i].prefix);
+      rollups[i].prefix = NULL;
+   }
+}
+
+//
+//  Close the data files as soon as an output_files name changes, rather
+//  than leaving the old ones open until the next record is due.
+//
+
+void check_rollover( void)
+{
+   int i;
+   struct timeval tv;
+   struct OUTPUT *o;
+
+   gettimeofday( &tv, NULL);
+
+   // Write out any rollup bucket whose period has ended
+   for( i = 0; i < nrollups; i++)
+      if( rollups[i].bucket >= 0 &&
+          (tv.tv_sec + 1e-6 * tv.tv_usec) / rollups[i].secs >=
+             rollups[i].bucket + 1) rollup_flush( &rollups[i]);
+
+   for( o = outputs; o < outputs + noutputs; o++)
+   {
+      char *prefix = NULL;
+      int changed;
+
+      if( !o->prefix) continue;
+
+      substitute_params( &prefix, &tv, o->files,
+                         o->policy == OP_BANDS_EACH ? "ID" : NULL);
+      changed = bound_strcmp( prefix, o->prefix);
+      free( prefix);
+
+      if( changed)
+      {
+         report( 1, "closing output files [%s]", o->prefix);
+         close_output_files();
+         return;
+      }
+   }
+}
+
+//
+//  Fill in the main output from the output_* options and convert every
+//  output's interval from seconds to frames.
+//
+
+void setup_outputs( void)
+{
+   struct OUTPUT *o;
+
+   outputs[0].policy = CF_output_policy;
+   outputs[0].secs = CF_output_interval;
+   outputs[0].files = CF_output_files;
+   outputs[0].binary = CF_output_binary;
+
+   outputs[0].average = CF_output_average;
+   outputs[0].param = CF_output_avparam;
+
+   for( o = outputs; o < outputs + noutputs; o++)
+   {
+      o->interval = rint( o->secs * CF_sample_rate / FFTWID);
+      if( o->interval == 0) o->interval = 1;
+
+      if( o->policy == OP_SPECTRUM && o->average == AV_PERCENTILE)
+         bailout( "percentile averaging needs a BANDS output policy");
+      o->bin_mode = o->policy == OP_SPECTRUM ? o->average : AV_MEAN;
+      if( o->average == AV_EMA)
+         o->alpha = 1 - exp( -FFTWID / (o->param * CF_sample_rate));
+
+      if( o->policy == OP_BANDS_EACH &&
+          ((o->bfo = calloc( nbands, sizeof( FILE *))) == NULL ||
+           (o->bix = calloc( nbands, sizeof( struct INDEX))) == NULL))
+         bailout( "not enough memory for outputs");
+
+      report( 2, "output %d: interval %d frames, files %s", 
+                 (int)(o - outputs), o->interval, o->files);
+   }
+
+   output_int = outputs[0].interval;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Flare Detection                                                          //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Each band's power is followed as it is output, in dB, to spot sudden
+//  ionospheric disturbances as they happen.  The work per record is
+//  constant:
+//
+//  - The baseline is an exponentially weighted mean with time constant
+//    flare_tau.  Its variance is an EWMA of the residuals clipped at
+//    FLARE_CLIP deviations, so that spikes and the onset of an event
+//    barely move either.  Both are frozen during an event.
+//
+//  - Two one-sided CUSUMs of the standardised residual, less an allowance
+//    of k deviations, detect a sustained rise or fall.  An event starts
+//    when one exceeds h; its start time is when that sum last left zero.
+//
+//  - The event ends once the residual has stayed within k deviations for
+//    flare_end seconds.  An event lasting FLARE_SHIFT time constants is
+//    taken to be a change of level rather than a flare and the baseline
+//    is learnt afresh.
+//
+//  Events go to the events file as start, peak and end records, and to
+//  the alert path.
+//
+
+#define FLARE_CLIP 3.0               // Residual clip, standard deviations
+#define FLARE_MIN_SD 0.01                   // Floor on the deviation, dB
+#define FLARE_SHIFT 8                    // Longest event, time constants
+
+double flare_alpha;                        // EWMA weight of each record
+long flare_warmup;                 // Records to learn the first baseline
+int flare_end_cnt;              // Quiet records needed to end an event
+
+double tv_diff( struct timeval *a, struct timeval *b)
+{
+   return a->tv_sec - b->tv_sec + 1e-6 * (a->tv_usec - b->tv_usec);
+}
+
+void setup_flare( void)
+{
+   double secs = output_int * (double) FFTWID / CF_sample_rate;
+
+   flare_alpha = MIN( 1.0, secs / CF_flare_tau);
+   flare_warmup = ceil( 1 / flare_alpha);
+   flare_end_cnt = ceil( CF_flare_end / secs);
+
+   report( 1, "flare detection: tau %.0fs k %.2f h %.1f end %.0fs, "
+              "warmup %ld records", CF_flare_tau, CF_flare_k, CF_flare_h,
+              CF_flare_end, flare_warmup);
+}
+
+//
+//  Write an events record: stamp, band, event, power and a value which
+//  is the deviation for start and peak, or the duration for end.
+//
+
+void flare_record( struct BAND *b, struct timeval *tv,
+                   char *event, double e, char *vformat, double v)
+{
+   char *prefix = NULL, *stamp = NULL, *line = NULL;
+   size_t len;
+   FILE *f;
+
+   if( !substitute_params( &prefix, tv, CF_flare_file, NULL))
+      bailout( "error in flare_detect file name");
+
+   if( bound_strcmp( prefix, ev_prefix))
+   {
+      char *filename = NULL;
+
+      if( ev_prefix) free( ev_prefix);
+      ev_prefix = strdup( prefix);
+      append_sprintf( &filename, "%s/%s", CF_datadir, ev_prefix);
+      report( 0, "using events file [%s]", filename);
+
+      if( ev_fo) queue_close( ev_fo);
+      if( (ev_fo = fopen( filename, "a")) == NULL)
+         bailout( "cannot open [%s], %s", filename, strerror( errno));
+
+      if( CF_output_header)
+         queue_printf( ev_fo, "# stamp band event power sigma|secs\n");
+
+      free( filename);
+   }
+
+   substitute_params( &stamp, tv, CF_timestamp, b->ident);
+   f = open_record( &line, &len);
+   fprintf( f, "%s %s %s ", stamp, b->ident, event);
+   fprintf( f, CF_field_format, e);
+   fprintf( f, vformat, v);
+   fputs( "\n", f);
+   fclose( f);
+   queue_write( ev_fo, line, len);
+
+   free( prefix);
+   free( stamp);
+}
+
+void flare_end( struct BAND *b, struct timeval *tv, double e)
+{
+   struct FLARE *f = &b->flare;
+   double secs = tv_diff( tv, &f->start_tv);
+
+   flare_record( b, &f->peak_tv, "peak", f->peak_e, " %.1f", f->peak_z);
+   flare_record( b, tv, "end", e, " %.0f", secs);
+   alert( "flare on %s ended after %.1f minutes, peak %.1f sigma",
+          b->ident, secs / 60, f->peak_z);
+
+   f->state = 0;
+   f->hi = f->lo = 0;
+}
+
+void flare_update( struct BAND *b, struct timeval *tv, double e)
+{
+   struct FLARE *f = &b->flare;
+   double x = CF_log_scale ? e : 10 * log10( e + 1e-9);
+   double r = x - f->mean, sd, z;
+
+   //
+   //  Learn the first baseline as a plain running mean and variance
+   //
+
+   if( ++f->n <= flare_warmup)
+   {
+      f->mean += r / f->n;
+      f->var += (r * (x - f->mean) - f->var) / f->n;
+      return;
+   }
+
+   sd = sqrt( f->var);
+   if( sd < FLARE_MIN_SD) sd = FLARE_MIN_SD;
+   z = r / sd;
+
+   if( !f->state)
+   {
+      double c = FLARE_CLIP * sd;
+      double rc = r > c ? c : r < -c ? -c : r;
+
+      f->mean += flare_alpha * rc;
+      f->var += flare_alpha * (rc * rc - f->var);
+
+      if( !f->hi) f->hi_tv = *tv;
+      if( !f->lo) f->lo_tv = *tv;
+      f->hi = MAX( 0, f->hi + z - CF_flare_k);
+      f->lo = MAX( 0, f->lo - z - CF_flare_k);
+
+      if( f->hi > CF_flare_h || f->lo > CF_flare_h)
+      {
+         f->state = f->hi > CF_flare_h ? 1 : -1;
+         f->start_tv = f->state > 0 ? f->hi_tv : f->lo_tv;
+         f->peak_tv = *tv;
+         f->peak_z = z;
+         f->peak_e = e;
+         f->quiet = 0;
+
+         flare_record( b, &f->start_tv, "start", e, " %.1f", z);
+         if( CF_raw_flare) raw_trigger( "flare");
+         alert( "flare %s on %s: %.1f sigma",
+                f->state > 0 ? "rising" : "falling", b->ident, z);
+      }
+      return;
+   }
+
+   if( z * f->state > f->peak_z * f->state)
+   {
+      f->peak_tv = *tv;
+      f->peak_z = z;
+      f->peak_e = e;
+   }
+
+   if( z * f->state < CF_flare_k)
+   {
+      if( !f->quiet++) f->quiet_tv = *tv;
+      if( f->quiet >= flare_end_cnt) flare_end( b, &f->quiet_tv, e);
+   }
+   else f->quiet = 0;
+
+   if( f->state && tv_diff( tv, &f->start_tv) > FLARE_SHIFT * CF_flare_tau)
+   {
+      report( 0, "flare on %s: change of level, new baseline", b->ident);
+      flare_end( b, tv, e);
+      f->n = 0;
+      f->mean = f->var = 0;
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Rollups                                                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Each rollup tier summarises the values of the output records over
+//  buckets of a fixed length, aligned to the epoch so that, for example,
+//  hourly buckets start on the hour.  As each record is output its values
+//  are added to the current bucket of every tier; when a bucket's time is
+//  up its count, mean, min and max are written as one binary summary (see
+//  sidc_format.h) to the tier's file.  In SPECTRUM policy adjacent bins
+//  can be averaged in groups first, to keep the summaries small.  NaN
+//  values, the cross values of a record in which all were shed, are left
+//  out of the mean, min and max.
+//
+//  With field_scale db, the powers in dB are averaged as power and the
+//  mean converted back to dB, both over a group and over a bucket.  The
+//  levels and cross values are averaged as they are.
+//
+
+void setup_rollups( int nvals, int db1, int db2)
+{
+   int i;
+   struct ROLLUP *r;
+
+   for( i = 0, r = rollups; i < nrollups; i++, r++)
+   {
+      if( CF_output_policy != OP_SPECTRUM) r->group = 1;
+      r->nvals = (nvals + r->group - 1) / r->group;
+      r->db1 = CF_log_scale ? db1 : 0;
+      r->db2 = CF_log_scale ? db2 : 0;
+      r->bucket = -1;
+      r->n = malloc( r->nvals * sizeof( int));
+      r->sum = malloc( r->nvals * sizeof( double));
+      r->min = malloc( r->nvals * sizeof( float));
+      r->max = malloc( r->nvals * sizeof( float));
+      if( !r->n || !r->sum || !r->min || !r->max)
+         bailout( "not enough memory for rollups");
+
+      report( 1, "rollup %.0fs [%s] %d values", r->secs, r->file, r->nvals);
+   }
+}
+
+// Whether summary value j is of powers in dB
+static inline int rollup_db( struct ROLLUP *r, int j)
+{
+   return j * r->group >= r->db1 && j * r->group < r->db2;
+}
+
+void rollup_flush( struct ROLLUP *r)
+{
+   int i, len = sizeof( struct SIDC_ROLLUP) + 3 * r->nvals * sizeof( float);
+   struct SIDC_ROLLUP *s;
+   float *v;
+   char *prefix = NULL;
+   struct timeval tv;
+
+   if( r->bucket < 0) return;
+
+   tv.tv_sec = r->bucket * r->secs;
+   tv.tv_usec = 1e6 * (r->bucket * r->secs - tv.tv_sec);
+
+   if( !substitute_params( &prefix, &tv, r->file, NULL))
+      bailout( "error in rollup file name");
+
+   if( bound_strcmp( prefix, r->prefix))
+   {
+      char *filename = NULL;
+
+      if( r->prefix) free( r->prefix);
+      r->prefix = strdup( prefix);
+      append_sprintf( &filename, "%s/%s", CF_datadir, r->prefix);
+      report( 0, "using rollup file [%s]", filename);
+
+      if( r->fo) queue_close( r->fo);
+      if( (r->fo = fopen( filename, "a")) == NULL)
+         bailout( "cannot open [%s], %s", filename, strerror( errno));
+      free( filename);
+   }
+
+   if( (s = malloc( len)) == NULL) bailout( "not enough memory for rollups");
+   s->magic = SIDC_ROLLUP_MAGIC;
+   s->nvals = r->nvals;
+   s->count = r->count;
+   s->group = r->group;
+   s->start = tv.tv_sec + 1e-6 * tv.tv_usec;
+   s->secs = r->secs;
+
+   for( i = 0, v = (float *)(s + 1); i < r->nvals; i++, v += 3)
+   {
+      v[0] = r->n[i] ? r->sum[i] / r->n[i] : NAN;
+      if( rollup_db( r, i)) v[0] = 10 * log10( v[0]);
+      v[1] = r->min[i];
+      v[2] = r->max[i];
+   }
+   queue_write( r->fo, (char *) s, len);
+
+   r->bucket = -1;
+   free( prefix);
+}
+
+void rollup_record( struct timeval *tv, int nvals)
+{
+   int i, j;
+   struct ROLLUP *r;
+   double t = tv->tv_sec + 1e-6 * tv->tv_usec;
+
+   for( i = 0, r = rollups; i < nrollups; i++, r++)
+   {
+      long bucket = floor( t / r->secs);
+
+      if( bucket != r->bucket)
+      {
+         rollup_flush( r);
+         r->bucket = bucket;
+         r->count = 0;
+      }
+
+      for( j = 0; j < r->nvals; j++)
+      {
+         int k, k1 = j * r->group, k2 = MIN( k1 + r->group, nvals);
+         int db = rollup_db( r, j);
+         double e, p = 0;
+
+         for( k = k1; k < k2; k++)
+            p += db ? pow( 10, rec_vals[k] / 10) : rec_vals[k];
+         p /= k2 - k1;
+         e = db ? 10 * log10( p) : p;
+
+         if( !r->count)
+         {
+            r->n[j] = 0;
+            r->sum[j] = 0;
+            r->min[j] = r->max[j] = NAN;
+         }
+
+         if( isnan( e)) continue;
+         if( !r->n[j]++) r->min[j] = r->max[j] = e;
+
+         r->sum[j] += p;
+         if( e < r->min[j]) r->min[j] = e;
+         if( e > r->max[j]) r->max[j] = e;
+      }
+      r->count++;
+   }
+}
+
+//
+//  Write out the partly filled buckets, when stopping
+//
+
+void flush_rollups( void)
+{
+   int i;
+
+   for( i = 0; i < nrollups; i++) rollup_flush( &rollups[i]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  DSP Memory                                                               //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  All the DSP buffers come from a single arena, mapped once at startup
+//  and optionally backed by huge pages.  Every buffer is aligned to a
+//  cache line, which is also enough for any SIMD unit FFTW may use, and
+//  each channel's buffers are contiguous and start on a fresh page, so
+//  channels worked on by different threads never share a cache line.
+//
+
+#define CACHE_LINE 64
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+struct ARENA
+{
+   char *base;
+   size_t size;
+   size_t used;
+}
+ arena;
+
+#define ROUND_UP( n, a)    (((n) + (a) - 1) / (a) * (a))
+
+//
+//  Space needed by the buffers of one channel, allowing for alignment
+//
+
+size_t channel_memory( void)
+{
+   return ROUND_UP( FFTWID * sizeof( double), CACHE_LINE) +          // fft_inbuf
+          ROUND_UP( CF_pfb_taps * FFTWID * sizeof( double), CACHE_LINE) +
+          ROUND_UP( (CF_bins + 1) * sizeof( fftw_complex), CACHE_LINE) + // data
+          2 * ROUND_UP( CF_bins * sizeof( double), CACHE_LINE);  // powspec, sigavg
+}
+
+//
+//  Space needed by the outputs' own accumulators
+//
+
+size_t output_memory( void)
+{
+   int i;
+   size_t n = (noutputs - 1) * CF_chans *
+                 ROUND_UP( CF_bins * sizeof( double), CACHE_LINE);
+
+   for( i = 0; i < noutputs; i++)
+      if( outputs[i].policy != OP_SPECTRUM &&
+          outputs[i].average == AV_PERCENTILE)
+         n += ROUND_UP( nbands * NHIST * sizeof( unsigned), CACHE_LINE);
+      else
+      if( outputs[i].policy != OP_SPECTRUM && outputs[i].average != AV_MEAN)
+         n += ROUND_UP( nbands * sizeof( double), CACHE_LINE);
+
+   return n;
+}
+
+size_t dsp_memory( void)
+{
+   long page = sysconf( _SC_PAGESIZE);
+   size_t n = ROUND_UP( FFTWID * sizeof( double), page) +         // Window
+              ROUND_UP( CF_pfb_taps * FFTWID * sizeof( double), page) +
+              CF_chans * ROUND_UP( channel_memory(), page) +
+              ROUND_UP( output_memory(), page) +
+              ROUND_UP( zoom_memory(), page);
+
+#if FIXED_POINT
+   if( CF_fixed)
+      n += ROUND_UP( fixed_memory(), page) +
+           CF_chans * ROUND_UP( fixed_channel_memory(), page);
+#endif
+   return n;
+}
+
+void *map_arena( size_t size, int flags)
+{
+   void *p = mmap( NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+
+   return p == MAP_FAILED ? NULL : p;
+}
+
+void setup_arena( void)
+{
+   size_t size = dsp_memory();
+   char *type = "normal";
+
+   arena.base = NULL;
+
+   if( CF_huge_pages == HP_EXPLICIT)
+   {
+      arena.size = ROUND_UP( size, HUGE_PAGE);
+      if( (arena.base = map_arena( arena.size, MAP_HUGETLB)) != NULL)
+         type = "explicit huge";
+      else
+         report( 0, "cannot map huge pages for DSP buffers: %s",
+                    strerror( errno));
+   }
+
+   if( !arena.base && CF_huge_pages != HP_NONE)
+   {
+      // Over-allocate so that the arena can start on a huge page boundary
+      size_t align = HUGE_PAGE;
+      char *p;
+
+      arena.size = ROUND_UP( size, HUGE_PAGE);
+      if( (p = map_arena( arena.size + align, 0)) == NULL)
+         bailout( "cannot map DSP buffers: %s", strerror( errno));
+
+      arena.base = (char *) ROUND_UP( (uintptr_t) p, align);
+      if( madvise( arena.base, arena.size, MADV_HUGEPAGE) < 0)
+         report( 0, "cannot use transparent huge pages: %s", strerror( errno));
+      else
+         type = "transparent huge";
+   }
+
+   if( !arena.base)
+   {
+      arena.size = size;
+      if( (arena.base = map_arena( arena.size, 0)) == NULL)
+         bailout( "cannot map DSP buffers: %s", strerror( errno));
+   }
+
+   // Touch every page now so that none is faulted in during capture
+   memset( arena.base, 0, arena.size);
+   arena.used = 0;
+
+   report( 1, "DSP buffers: %ld bytes on %s pages", (long) size, type);
+}
+
+void *arena_alloc( size_t n, size_t align)
+{
+   void *p;
+
+   arena.used = ROUND_UP( arena.used, align);
+   if( arena.used + n > arena.size) bailout( "DSP arena exhausted");
+
+   p = arena.base + arena.used;
+   arena.used += n;
+   return p;
+}
+
+//
+//  The main output sums into the channels' powspec; the others have their
+//  own sums.  BANDS outputs which do not average have per band state too.
+//  Called once the arena is set up.
+//
+
+void setup_output_buffers( void)
+{
+   struct OUTPUT *o;
+
+   outputs[0].pow[0] = left.powspec;
+   outputs[0].pow[1] = right.powspec;
+
+   for( o = outputs; o < outputs + noutputs; o++)
+   {
+      if( o > outputs)
+      {
+         o->pow[0] = arena_alloc( CF_bins * sizeof( double), CACHE_LINE);
+         if( CF_chans == 2)
+            o->pow[1] = arena_alloc( CF_bins * sizeof( double), CACHE_LINE);
+      }
+
+      if( o->policy != OP_SPECTRUM && o->average == AV_PERCENTILE)
+         o->hist = arena_alloc( nbands * NHIST * sizeof( unsigned),
+                                CACHE_LINE);
+      else
+      if( o->policy != OP_SPECTRUM && o->average != AV_MEAN)
+         o->bval = arena_alloc( nbands * sizeof( double), CACHE_LINE);
+      if( o->hist || o->bval) band_stats = 1;
+
+      if( output_zoomed( o))
+         o->zpow = arena_alloc( (cutoff - cuton) * sizeof( double),
+                                CACHE_LINE);
+
+      clear_sums( o);
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Fixed Point DSP                                                          //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Built with --enable-fixed-point, sidc can do the sample path in integer
+//  arithmetic for CPUs whose floating point is slow.  Samples are kept as
+//  Q31, windowed by a Q31 window to Q30, and transformed by a radix-2 FFT
+//  which halves at every stage so that nothing can overflow.  The real
+//  frame of FFTWID samples is transformed as FFTWID/2 complex points and
+//  the halves are then separated.  The power of each bin is formed in 64
+//  bits and only converted to floating point as it is added to the output
+//  sums, which keep their usual averaging.
+//
+//  A transform value X here is the true transform times 2^30 / FFTWID.
+//
+
+#if FIXED_POINT
+
+int32_t *fx_win;                                         // Window, Q31
+int32_t *fx_tw;       // Twiddles of the complex FFT, (cos, -sin) pairs, Q31
+int32_t *fx_tws;        // Twiddles for separating the real transform, Q31
+int *fx_rev;                                    // Bit reversal permutation
+double fx_scale;                        // Converts fx_pow to true power
+
+static inline int32_t q31( double v)
+{
+   return v >= 1 ? INT32_MAX : v <= -1 ? INT32_MIN : lrint( v * 2147483648.0);
+}
+
+size_t fixed_memory( void)
+{
+   int m = CF_bins;
+
+   return ROUND_UP( FFTWID * sizeof( int32_t), CACHE_LINE) +        // fx_win
+          ROUND_UP( m * sizeof( int32_t), CACHE_LINE) +              // fx_tw
+          ROUND_UP( 2 * m * sizeof( int32_t), CACHE_LINE) +         // fx_tws
+          ROUND_UP( m * sizeof( int), CACHE_LINE);                  // fx_rev
+}
+
+size_t fixed_channel_memory( void)
+{
+   return ROUND_UP( FFTWID * sizeof( int32_t), CACHE_LINE) +         // fx_in
+          ROUND_UP( CF_bins * sizeof( uint64_t), CACHE_LINE);       // fx_pow
+}
+
+void setup_fixed_point( void)
+{
+   int i, j, bits, m = CF_bins;
+
+   if( m & (m - 1)) bailout( "dsp_path fixed needs bins a power of two");
+
+   fx_win = arena_alloc( FFTWID * sizeof( int32_t), CACHE_LINE);
+   fx_tw = arena_alloc( m * sizeof( int32_t), CACHE_LINE);
+   fx_tws = arena_alloc( 2 * m * sizeof( int32_t), CACHE_LINE);
+   fx_rev = arena_alloc( m * sizeof( int), CACHE_LINE);
+
+   for( i = 0; i < FFTWID; i++) fx_win[i] = q31( hamwin[i]);
+
+   for( i = 0; i < m/2; i++)
+   {
+      fx_tw[2*i] = q31( cos( 2 * M_PI * i / m));
+      fx_tw[2*i+1] = q31( -sin( 2 * M_PI * i / m));
+   }
+
+   for( i = 0; i < m; i++)
+   {
+      fx_tws[2*i] = q31( cos( 2 * M_PI * i / FFTWID));
+      fx_tws[2*i+1] = q31( -sin( 2 * M_PI * i / FFTWID));
+   }
+
+   for( bits = 0; (1 << bits) < m; bits++);
+   for( i = 0; i < m; i++)
+   {
+      int r = 0;
+      for( j = 0; j < bits; j++) if( i & (1 << j)) r |= 1 << (bits - 1 - j);
+      fx_rev[i] = r;
+   }
+
+   fx_scale = pow( FFTWID / 1073741824.0, 2);
+   report( 1, "fixed-point DSP path");
+}
+
+void initialise_fixed_channel( struct CHAN *c)
+{
+   c->fx_in = arena_alloc( FFTWID * sizeof( int32_t), CACHE_LINE);
+   c->fx_pow = arena_alloc( CF_bins * sizeof( uint64_t), CACHE_LINE);
+}
+
+//
+//  Product of Q31 twiddle and value, rounded
+//
+
+static inline int64_t fx_mul( int64_t a, int32_t w)
+{
+   return (a * w + (1LL << 30)) >> 31;
+}
+
+//
+//  Transform the channel's windowed frame in place and leave the power of
+//  each bin in fx_pow.  With cross_spectrum the bins also go to fft_data,
+//  scaled as FFTW would leave them.
+//
+
+void fixed_fft( struct CHAN *c)
+{
+   int i, j, len, m = CF_bins;
+   int32_t *z = c->fx_in;
+   double xs = FFTWID / 1073741824.0;
+
+   for( i = 0; i < m; i++)
+   {
+      j = fx_rev[i];
+      if( j > i)
+      {
+         int32_t t = z[2*i]; z[2*i] = z[2*j]; z[2*j] = t;
+         t = z[2*i+1]; z[2*i+1] = z[2*j+1]; z[2*j+1] = t;
+      }
+   }
+
+   for( len = 2; len <= m; len <<= 1)
+   {
+      int half = len / 2, step = m / len;
+
+      for( i = 0; i < m; i += len)
+         for( j = 0; j < half; j++)
+         {
+            int32_t *a = z + 2 * (i + j), *b = a + 2 * half;
+            int32_t wr = fx_tw[2*j*step], wi = fx_tw[2*j*step+1];
+            int64_t tr, ti;                                      // W b
+
+            tr = ((int64_t) b[0] * wr - (int64_t) b[1] * wi + (1LL << 30)) >> 31;
+            ti = ((int64_t) b[0] * wi + (int64_t) b[1] * wr + (1LL << 30)) >> 31;
+
+            b[0] = (a[0] - tr + 1) >> 1;
+            b[1] = (a[1] - ti + 1) >> 1;
+            a[0] = (a[0] + tr + 1) >> 1;
+            a[1] = (a[1] + ti + 1) >> 1;
+         }
+   }
+
+   //  Separate the transforms of the even and odd samples, Fe and Fo, and
+   //  combine them: X[k] = Fe[k] + W^k Fo[k]
+   for( i = 0; i < m; i++)
+   {
+      int k = i ? m - i : 0;
+      int64_t zr = z[2*i], zi = z[2*i+1];
+      int64_t cr = z[2*k], ci = -(int64_t) z[2*k+1];
+      int64_t er = zr + cr, ei = zi + ci;                            // 2 Fe
+      int64_t dr = zi - ci, di = cr - zr;                            // 2 Fo
+      int64_t xr = (er + fx_mul( dr, fx_tws[2*i]) -
+                         fx_mul( di, fx_tws[2*i+1]) + 2) >> 2;
+      int64_t xi = (ei + fx_mul( dr, fx_tws[2*i+1]) +
+                         fx_mul( di, fx_tws[2*i]) + 2) >> 2;
+
+      c->fx_pow[i] = (uint64_t)(xr * xr) + (uint64_t)(xi * xi);
+      if( CF_cross)
+      {
+         c->fft_data[i][0] = xr * xs;
+         c->fft_data[i][1] = xi * xs;
+      }
+   }
+}
+
+//
+//  Peak and sum of squares of the frame, as the floating point path has
+//  them
+//
+
+void fixed_levels( struct CHAN *c)
+{
+   c->peak = c->fx_peak / 2147483648.0;
+   c->sum_sq = c->fx_sum_sq / 274877906944.0;                          // 2^38
+   c->fx_peak = 0;
+   c->fx_sum_sq = 0;
+}
+
+#endif // FIXED_POINT
+
+///////////////////////////////////////////////////////////////////////////////
+//  Zoom FFT                                                                 //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  With spectrum_zoom, SPECTRUM outputs don't take their bins from the
+//  full band transform.  The left input is shifted down so that the middle
+//  of spectrum_range is at zero, low pass filtered to the range and
+//  decimated, and a complex transform of that gives bins of the requested
+//  width across the range alone.  Shift and filter are done in one: the
+//  filter taps are shifted up to the centre frequency instead, and applied
+//  only at the samples kept, each of which is then shifted down by its
+//  phase.  The work per input sample is 2 * ZOOM_TAPS multiplies.
+//
+//  The frame has the same window as the full band transform, and bin
+//  powers are scaled by the decimation squared, to read the same as a full
+//  band transform with the same bin width would.  sidc -t checks that.
+//
+
+//
+//  Centre frequency of zoom bin k, counting from the lowest
+//
+
+double zoom_freq( int k)
+{
+   return zoom.fc + (k - zoom.n / 2) * zoom.df;
+}
+
+//
+//  Smallest size >= n with no prime factor over 7, which FFTW does fast
+//
+
+int smooth_size( int n)
+{
+   for( ; ; n++)
+   {
+      int m = n;
+
+      while( m % 2 == 0) m /= 2;
+      while( m % 3 == 0) m /= 3;
+      while( m % 5 == 0) m /= 5;
+      while( m % 7 == 0) m /= 7;
+      if( m == 1) return n;
+   }
+}
+
+//
+//  Choose the decimation and transform size, and the zoom bins which cover
+//  spectrum_range, as cuton to cutoff.  Called once DF is known.
+//
+
+void setup_zoom_range( void)
+{
+   double span = CF_range2 - CF_range1, rate;
+   int i;
+
+   if( span <= 0) bailout( "spectrum_range is empty");
+
+   zoom.fc = (CF_range1 + CF_range2) / 2.0;
+   zoom.decim = CF_sample_rate / (span * ZOOM_MARGIN);
+   if( zoom.decim < 2)
+      bailout( "spectrum_range too wide to zoom, use bins instead");
+
+   rate = (double) CF_sample_rate / zoom.decim;
+   zoom.n = smooth_size( ceil( rate / CF_zoom_df));
+   zoom.df = rate / zoom.n;
+   zoom.ntaps = ZOOM_TAPS * zoom.decim;
+   zoom.scale = (double) zoom.decim * zoom.decim;
+
+   cuton = ceil( (CF_range1 - zoom.fc) / zoom.df + zoom.n / 2);
+   cutoff = ceil( (CF_range2 - zoom.fc) / zoom.df + zoom.n / 2);
+
+   for( i = 0; i < noutputs; i++)
+   {
+      struct OUTPUT *o = outputs + i;
+
+      if( o->policy != OP_SPECTRUM) continue;
+      if( (double) o->interval * FFTWID < (double) zoom.n * zoom.decim)
+         bailout( "output %d: interval shorter than a zoom frame, %.1f secs",
+                  i, (double) zoom.n * zoom.decim / CF_sample_rate);
+      if( o->average == AV_EMA)
+         o->zalpha = 1 - exp( -(double) zoom.n * zoom.decim /
+                                (o->param * CF_sample_rate));
+   }
+
+   report( 1, "zoom: decimate %d, %d point transform, df=%f, %.1f secs",
+              zoom.decim, zoom.n, zoom.df,
+              (double) zoom.n * zoom.decim / CF_sample_rate);
+}
+
+size_t zoom_memory( void)
+{
+   int i;
+   size_t n;
+
+   if( !zoom.n) return 0;
+
+   n = 4 * ROUND_UP( zoom.ntaps * sizeof( double), CACHE_LINE) +
+       ROUND_UP( zoom.n * sizeof( double), CACHE_LINE) +
+       ROUND_UP( zoom.n * sizeof( fftw_complex), CACHE_LINE);
+
+   for( i = 0; i < noutputs; i++)
+      if( output_zoomed( outputs + i))
+         n += ROUND_UP( (cutoff - cuton) * sizeof( double), CACHE_LINE);
+   return n;
+}
+
+//
+//  The filter is a windowed sinc, cut off half way between the edge of the
+//  range and the edge of the first alias, with a Blackman window for about
+//  70dB rejection of everything which would fold into the range
+//
+
+void setup_zoom( void)
+{
+   int i, L;
+   double w = 2 * M_PI * zoom.fc / CF_sample_rate;     // Radians per sample
+   double cut = 0.5 / zoom.decim, sum = 0, *h;
+
+   if( !zoom.n) return;
+
+   L = zoom.ntaps;
+   zoom.tre = arena_alloc( L * sizeof( double), sysconf( _SC_PAGESIZE));
+   zoom.tim = arena_alloc( L * sizeof( double), CACHE_LINE);
+   zoom.hist = arena_alloc( 2 * L * sizeof( double), CACHE_LINE);
+   zoom.win = arena_alloc( zoom.n * sizeof( double), CACHE_LINE);
+   zoom.buf = arena_alloc( zoom.n * sizeof( fftw_complex), CACHE_LINE);
+
+   if( (h = malloc( L * sizeof( double))) == NULL)
+      bailout( "not enough memory for zoom filter");
+   for( i = 0; i < L; i++)
+   {
+      double x = i - (L - 1) / 2.0;
+      double a = 2 * M_PI * i / (L - 1);
+
+      h[i] = (x == 0 ? 2 * cut : sin( 2 * M_PI * cut * x) / (M_PI * x)) *
+             (0.42 - 0.5 * cos( a) + 0.08 * cos( 2 * a));
+      sum += h[i];
+   }
+
+   // Unit gain at the centre frequency; tap k applies to the sample k
+   // before the newest, and is stored at L - 1 - k to match hist
+   for( i = 0; i < L; i++)
+   {
+      zoom.tre[L - 1 - i] = h[i] / sum * cos( w * i);
+      zoom.tim[L - 1 - i] = h[i] / sum * sin( w * i);
+   }
+   free( h);
+
+   for( i = 0; i < zoom.n; i++) zoom.win[i] = window( i, zoom.n);
+
+   zoom.dtheta = fmod( w * zoom.decim, 2 * M_PI);
+   zoom.phase = zoom.decim;
+   zoom.plan = fftw_plan_dft_1d( zoom.n, zoom.buf, zoom.buf, FFTW_FORWARD,
+                                 FFTW_ESTIMATE);
+}
+
+//
+//  Transform a complete frame and add its power to the zoomed outputs
+//
+
+void zoom_frame( void)
+{
+   int i, j, k, n;
+   double *acc[MAXOUTPUTS];
+   int mode[MAXOUTPUTS];
+   double alpha[MAXOUTPUTS];
+   struct OUTPUT *o;
+
+   zoom.fill = 0;
+   zoom.frames++;
+   fftw_execute( zoom.plan);
+
+   for( n = 0, o = outputs; o < outputs + noutputs; o++)
+      if( output_zoomed( o))
+      {
+         acc[n] = o->zpow;
+         mode[n] = o->bin_mode;
+         alpha[n++] = MAX( o->zalpha, 1.0 / zoom.frames);
+         o->zsummed++;
+      }
+
+   for( i = cuton; i < cutoff; i++)
+   {
+      double f;
+
+      j = (i + zoom.n - zoom.n / 2) % zoom.n;
+      f = (zoom.buf[j][0] * zoom.buf[j][0] +
+           zoom.buf[j][1] * zoom.buf[j][1]) * zoom.scale;
+      for( k = 0; k < n; k++)
+         accumulate( acc[k] + i - cuton, f, mode[k], alpha[k]);
+   }
+}
+
+//
+//  Compute the next decimated sample
+//
+
+void zoom_output( void)
+{
+   int i;
+   double re = 0, im = 0, c, s, w;
+   double *x = zoom.hist + zoom.hpos;
+
+   zoom.phase = zoom.decim;
+   c = cos( zoom.theta);
+   s = sin( zoom.theta);
+   zoom.theta = fmod( zoom.theta + zoom.dtheta, 2 * M_PI);
+
+   // Nothing to do while SPECTRUM outputs are shed, but the frame so far
+   // no longer follows on
+   if( shed & SHED_SPECTRUM)
+   {
+      zoom.fill = 0;
+      return;
+   }
+
+   for( i = 0; i < zoom.ntaps; i++)
+   {
+      re += zoom.tre[i] * x[i];
+      im += zoom.tim[i] * x[i];
+   }
+
+   w = zoom.win[zoom.fill];
+   zoom.buf[zoom.fill][0] = w * (re * c + im * s);
+   zoom.buf[zoom.fill][1] = w * (im * c - re * s);
+   if( ++zoom.fill == zoom.n) zoom_frame();
+}
+
+static inline void zoom_sample( double f)
+{
+   zoom.hist[zoom.hpos] = zoom.hist[zoom.hpos + zoom.ntaps] = f;
+   if( ++zoom.hpos == zoom.ntaps) zoom.hpos = 0;
+   if( --zoom.phase == 0) zoom_output();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Signal Processing                                                        //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  Set if an output's spectrum is not being accumulated, to shed load
+//
+
+static inline int output_shed( struct OUTPUT *o)
+{
+   return (shed & SHED_SPECTRUM) && o->policy == OP_SPECTRUM;
+}
+
+//
+//  EMA smoothing factor for the current frame.  Until the time constant
+//  has passed, the average is of all the frames so far, so that it does
+//  not start from zero.
+//
+
+static inline double ema_alpha( struct OUTPUT *o)
+{
+   return MAX( o->alpha, 1.0 / MAX( o->nframes, 1));
+}
+
+static inline void accumulate( double *a, double f, int mode, double alpha)
+{
+   switch( mode)
+   {
+      case AV_MEAN: *a += f; break;
+      case AV_EMA: *a += alpha * (f - *a); break;
+      case AV_MAX: if( f > *a) *a = f; break;
+      case AV_MIN: if( f < *a) *a = f; break;
+   }
+}
+
+//
+//  Histograms hold each band's frame power in dB, in HIST_STEP buckets
+//  from HIST_LO.  A percentile is interpolated within its bucket.
+//
+
+static inline int hist_bucket( double p)
+{
+   int k = (10 * log10( p + 1e-30) - HIST_LO) / HIST_STEP;
+
+   return k < 0 ? 0 : k >= NHIST ? NHIST - 1 : k;
+}
+
+double hist_percentile( unsigned *h, double pct)
+{
+   int k;
+   double n = 0, target, db;
+
+   for( k = 0; k < NHIST; k++) n += h[k];
+   if( !n) return 0;
+
+   target = n * pct / 100;
+   for( k = 0, n = 0; k < NHIST - 1 && n + h[k] < target; k++) n += h[k];
+
+   db = HIST_LO + HIST_STEP * (k + (h[k] ? (target - n) / h[k] : 0));
+   return pow( 10, db / 10);
+}
+
+//
+//  With filter_bank set, each frame's transform is of a polyphase filter
+//  bank rather than of one windowed frame.  The last pfb_taps frames of
+//  input are weighted by a prototype low pass filter pfb_taps frames long,
+//  and summed frame by frame into the transform input.  Each bin is then
+//  that filter shifted to the bin, flat over most of the bin and falling
+//  steeply outside it, where the window alone gives a rounded top and
+//  leaks well into the neighbouring bins.  The cost is pfb_taps multiplies
+//  per sample.  Frames still don't overlap, so the bank is critically
+//  sampled, and the first pfb_taps - 1 after a gap are partly of silence.
+//
+//  The prototype is a Hamming windowed sinc whose passband is widened a
+//  little so that adjacent bins cross at about -3dB, and it is scaled so
+//  that a tone at the centre of a bin reads as it does with the window.
+//
+
+void setup_filter_bank( void)
+{
+   int i, L = CF_pfb_taps * FFTWID;
+   double wd = 1 + 0.8 / CF_pfb_taps, sum = 0, wsum = 0;
+
+   if( !CF_pfb_taps) return;
+
+   pfb_coef = arena_alloc( L * sizeof( double), sysconf( _SC_PAGESIZE));
+
+   for( i = 0; i < L; i++)
+   {
+      double x = (i - (L - 1) / 2.0) / FFTWID * wd;
+
+      pfb_coef[i] = (x == 0 ? 1 : sin( M_PI * x) / (M_PI * x)) *
+                    (0.54 - 0.46 * cos( 2 * M_PI * i / (L - 1)));
+      sum += pfb_coef[i];
+   }
+
+   for( i = 0; i < FFTWID; i++) wsum += hamwin[i];
+   for( i = 0; i < L; i++) pfb_coef[i] *= wsum / sum;
+
+   report( 1, "filter bank: %d taps per bin", CF_pfb_taps);
+}
+
+//
+//  Form the transform input from the frames in pfb_hist, the oldest
+//  being the one after pfb_block
+//
+
+void pfb_fold( struct CHAN *c)
+{
+   int i, j, b;
+   double *in = c->fft_inbuf;
+
+   for( j = 0; j < CF_pfb_taps; j++)
+   {
+      double *h = pfb_coef + j * FFTWID;
+      double *x;
+
+      b = (pfb_block + 1 + j) % CF_pfb_taps;
+      x = c->pfb_hist + b * FFTWID;
+
+      if( !j) for( i = 0; i < FFTWID; i++) in[i] = h[i] * x[i];
+      else for( i = 0; i < FFTWID; i++) in[i] += h[i] * x[i];
+   }
+}
+
+//
+//  Forget the input before a gap
+//
+
+void pfb_reset( void)
+{
+   size_t n = CF_pfb_taps * FFTWID * sizeof( double);
+
+   if( !CF_pfb_taps) return;
+
+   pfb_block = 0;
+   memset( left.pfb_hist, 0, n);
+   if( CF_chans == 2) memset( right.pfb_hist, 0, n);
+}
+
+//
+//  Squared amplitude of a bin of the channel's transform
+//
+
+static inline double bin_power( struct CHAN *c, int i)
+{
+   double t1, t2;
+
+#if FIXED_POINT
+   if( CF_fixed) return c->fx_pow[i] * fx_scale;
+#endif
+   t1 = c->fft_data[i][0];
+   t2 = c->fft_data[i][1];
+   return t1*t1 + t2*t2;
+}
+
+//
+//  For BANDS outputs which do not average, update each band of this
+//  channel with its power in this frame
+//
+
+static inline void accumulate_bands( struct CHAN *c)
+{
+   int i, j;
+   struct BAND *b;
+   struct OUTPUT *o;
+
+   for( b = bands, i = 0; i < nbands; i++, b++)
+   {
+      int n1 = b->start/DF;
+      int n2 = b->end/DF;
+      double p = 0;
+
+      if( b->side != c) continue;
+
+      for( j=n1; j<= n2; j++) p += bin_power( c, j);
+      p /= n2 - n1 + 1;
+
+      for( o = outputs; o < outputs + noutputs; o++)
+         if( o->hist) o->hist[i * NHIST + hist_bucket( p)]++;
+         else
+         if( o->bval) accumulate( o->bval + i, p, o->average, ema_alpha( o));
+   }
+}
+
+void process_fft( struct CHAN *c)
+{
+   int i, k, n;
+   int uspec = !(shed & SHED_USPEC);
+   float *wf = uspec ? shm_row( c == &right) : NULL;  // Waterfall row, if any
+   double *sa = uspec ? c->sigavg : NULL;
+   double *acc[MAXOUTPUTS];                // This channel's output accumulators
+   int mode[MAXOUTPUTS];
+   double alpha[MAXOUTPUTS];
+   PROF_START( t0);
+
+   for( n = k = 0; k < noutputs; k++)
+      if( !output_shed( outputs + k) && !output_zoomed( outputs + k))
+      {
+         acc[n] = outputs[k].pow[c == &right];
+         mode[n] = outputs[k].bin_mode;
+         alpha[n++] = ema_alpha( outputs + k);
+      }
+
+#if FIXED_POINT
+   if( CF_fixed) fixed_fft( c);
+   else
+#endif
+   {
+      if( CF_pfb_taps) pfb_fold( c);
+      fftw_execute( c->ffp);   // Do the FFT
+   }
+   PROF_STOP( PROF_FFT, t0);
+
+   //
+   //  Obtain squared amplitude of each bin.
+   //
+
+   PROF_START( t1);
+   for( k = 0; k < n; k++) acc[k][0] = 0;              // Zero the DC component
+   if( wf) wf[0] = 0;
+   for( i=1; i<CF_bins; i++)
+   {
+      double f = bin_power( c, i);
+      for( k = 0; k < n; k++)                              // Output records
+         accumulate( acc[k] + i, f, mode[k], alpha[k]);
+      if( sa) sa[i] += f;                   // Accumulator for utility spectrum
+      if( wf) wf[i] = f;                         // This frame, for the waterfall
+   }
+   if( band_stats) accumulate_bands( c);
+   PROF_STOP( PROF_POWER, t1);
+
+   PROF_START( t2);
+   check_los( c);
+   PROF_STOP( PROF_LOS, t2);
+}
+
+//
+//  With fft_workers set, the transforms of a frame's channels run at the
+//  same time: each worker takes one channel after the first, which the
+//  dsp thread does itself.  This is worthwhile when a transform takes a
+//  good part of the frame time.  Each worker runs as an 'fft' thread.
+//
+
+struct FFT_WORKER
+{
+   pthread_t tid;
+   struct CHAN *c;                           // Channel this worker handles
+   sem_t go, done;
+}
+ fft_workers[1];                        // Room for all but the first channel
+
+int fft_stop = 0;
+
+void *fft_worker( void *arg)
+{
+   struct FFT_WORKER *w = arg;
+
+   setup_thread( TH_FFT);
+
+   while( 1)
+   {
+      while( sem_wait( &w->go) < 0 && errno == EINTR);
+      if( fft_stop) break;
+      process_fft( w->c);
+      sem_post( &w->done);
+   }
+
+   return NULL;
+}
+
+void start_fft_workers( void)
+{
+   int i, err;
+
+   for( i = 0; i < CF_fft_workers; i++)
+   {
+      struct FFT_WORKER *w = fft_workers + i;
+
+      w->c = &right;
+      sem_init( &w->go, 0, 0);
+      sem_init( &w->done, 0, 0);
+      if( (err = pthread_create( &w->tid, NULL, fft_worker, w)) != 0)
+         bailout( "cannot create fft worker: %s", strerror( err));
+   }
+}
+
+void stop_fft_workers( void)
+{
+   int i;
+
+   fft_stop = 1;
+   for( i = 0; i < CF_fft_workers; i++)
+   {
+      sem_post( &fft_workers[i].go);
+      pthread_join( fft_workers[i].tid, NULL);
+   }
+}
+
+static inline void process_channels( void)
+{
+   int i;
+
+   for( i = 0; i < CF_fft_workers; i++) sem_post( &fft_workers[i].go);
+
+   process_fft( &left);
+   if( CF_chans == 2 && !CF_fft_workers) process_fft( &right);
+
+   for( i = 0; i < CF_fft_workers; i++)
+      while( sem_wait( &fft_workers[i].done) < 0 && errno == EINTR);
+}
+
+//
+//  With cross_spectrum, sum L.conj(R) and the two powers over each band's
+//  bins.  The phase that process_fft() discards is still in fft_data.
+//
+
+static inline void accumulate_cross( void)
+{
+   int i, j;
+   struct BAND *b;
+
+   for( b = bands, i = 0; i < nbands; i++, b++)
+   {
+      int n1 = b->start/DF;
+      int n2 = b->end/DF;
+
+      for( j=n1; j<= n2; j++)
+      {
+         double lr = left.fft_data[j][0], li = left.fft_data[j][1];
+         double rr = right.fft_data[j][0], ri = right.fft_data[j][1];
+
+         b->xre += lr*rr + li*ri;
+         b->xim += li*rr - lr*ri;
+         b->sxx += lr*lr + li*li;
+         b->syy += rr*rr + ri*ri;
+      }
+   }
+   cross_frames++;
+}
+
+//
+//  Let FFTW split each transform between several threads.  Must be done
+//  before any plan is made.
+//
+
+void setup_fft_threads( void)
+{
+   if( CF_fft_threads <= 1) return;
+
+#if HAVE_FFTW_THREADS
+   if( !fftw_init_threads()) bailout( "cannot initialise FFTW threads");
+   fftw_plan_with_nthreads( CF_fft_threads);
+   report( 1, "FFTW using %d threads per transform", CF_fft_threads);
+#else
+   bailout( "fft_threads needs the FFTW threads library");
+#endif
+}
+
+//
+//  Coefficient i of an n point window.  The full band and zoom transforms
+//  both use it, so that their levels agree.
+//
+
+static inline double window( int i, int n)
+{
+   return sin( i * M_PI / n);
+}
+
+void setup_hamming_window( void)
+{
+   int i;
+
+   hamwin = arena_alloc( sizeof( double) * FFTWID, sysconf( _SC_PAGESIZE));
+
+   for( i=0; i<FFTWID; i++) hamwin[i] = window( i, FFTWID);
+}
+
+static inline void insert_sample( struct CHAN *c, double f)
+{
+   c->sum_sq += f * f;
+   if( f > c->peak) c->peak = f;
+   if( f < -c->peak) c->peak = -f;
+
+   if( CF_pfb_taps) c->pfb_hist[pfb_block * FFTWID + grab_cnt] = f;
+   else c->fft_inbuf[grab_cnt] = f * hamwin[grab_cnt];
+   if( zoom.n && c == &left) zoom_sample( f);
+}
+
+#if FIXED_POINT
+
+static inline void insert_sample_fixed( struct CHAN *c, int32_t s)
+{
+   uint32_t a = s < 0 ? -(uint32_t) s : s;
+   int32_t t = s >> 12;
+
+   c->fx_sum_sq += (int64_t) t * t;
+   if( a > c->fx_peak) c->fx_peak = a;
+
+   c->fx_in[grab_cnt] = ((int64_t) s * fx_win[grab_cnt] + (1LL << 31)) >> 32;
+   if( zoom.n && c == &left) zoom_sample( s / 2147483648.0);
+}
+
+#endif // FIXED_POINT
+
+#if PROFILING
+uint64_t prof_frame_ticks;               // Time in frames during this block
+#endif
+
+//
+//  Add the peak and power of the frame just completed to every output's
+//  sums, ready for the next frame
+//
+
+static inline void fold_levels( void)
+{
+   struct OUTPUT *o;
+
+#if FIXED_POINT
+   if( CF_fixed)
+   {
+      fixed_levels( &left);
+      if( CF_chans == 2) fixed_levels( &right);
+   }
+#endif
+
+   if( CF_raw_peak && (left.peak > CF_raw_peak || right.peak > CF_raw_peak))
+      raw_trigger( "peak level");
+
+   for( o = outputs; o < outputs + noutputs; o++)
+   {
+      o->nframes++;
+      if( left.peak > o->peak[0]) o->peak[0] = left.peak;
+      if( right.peak > o->peak[1]) o->peak[1] = right.peak;
+      o->sum_sq[0] += left.sum_sq;
+      o->sum_sq[1] += right.sum_sq;
+   }
+
+   left.peak = left.sum_sq = 0;
+   right.peak = right.sum_sq = 0;
+}
+
+static inline void maybe_do_fft( void)
+{
+   struct OUTPUT *o;
+
+   if( ++grab_cnt < FFTWID) return;
+   grab_cnt = 0;
+
+   PROF_START( t0);
+
+   fold_levels();
+
+   if( !(shed & SHED_SKIP) || !(frames_total & 1))
+   {
+      int uspec = !(shed & SHED_USPEC);
+
+      if( uspec) shm_begin_row();
+      process_channels();
+      if( CF_cross && !(shed & SHED_CROSS)) accumulate_cross();
+      if( uspec) shm_end_row();
+
+      if( uspec) uspec_cnt++;
+      for( o = outputs; o < outputs + noutputs; o++)
+         if( !output_shed( o)) o->summed++;
+   }
+
+   frames_total++;
+   if( CF_pfb_taps && ++pfb_block == CF_pfb_taps) pfb_block = 0;
+
+   for( o = outputs; o < outputs + noutputs; o++)
+      if( ++o->frame_cnt == o->interval)
+      {
+         PROF_START( t1);
+         if( output_zoomed( o) ? o->zsummed : o->summed) output_record( o);
+         else clear_sums( o);             // Every frame was shed or skipped
+         PROF_STOP( PROF_FORMAT, t1);
+      }
+
+   PROF_STOP( PROF_FRAME, t0);
+#if PROFILING
+   prof_frame_ticks += prof_now() - t0;
+#endif
+}
+
+//
+//  A packed little endian 24 bit sample, as Q31
+//
+
+static inline int32_t s24( unsigned char *p)
+{
+   return (int32_t)((uint32_t) p[0] << 8 | (uint32_t) p[1] << 16 |
+                    (uint32_t) p[2] << 24);
+}
+
+#if FIXED_POINT
+
+//
+//  Unpack for the fixed-point path, to Q31
+//
+
+#define FIXED_LOOP( get)                                                   \
+   for( i=0; i<q; i++)                                                     \
+   {                                                                       \
+      insert_sample_fixed( &left, get);                                    \
+      if( CF_chans == 2) insert_sample_fixed( &right, get);                \
+      maybe_do_fft();                                                      \
+   }
+
+void unpack_fixed( char *buff, int q)
+{
+   int i;
+
+   if( CF_bytes == 1)
+   {
+      unsigned char *dp = (unsigned char *) buff;
+      FIXED_LOOP( (*dp++ - 128) * 16777216)
+   }
+   else
+   if( CF_bytes == 2)
+   {
+      short *dp = (short *) buff;
+      FIXED_LOOP( *dp++ * 65536)
+   }
+   else
+   if( CF_bytes == 3)
+   {
+      unsigned char *dp = (unsigned char *) buff;
+      FIXED_LOOP( (dp += 3, s24( dp - 3)))
+   }
+   else
+   if( CF_bytes == 4)
+   {
+      int32_t *dp = (int32_t *) buff;
+      FIXED_LOOP( *dp++)
+   }
+}
+
+#endif // FIXED_POINT
+
+//
+//  Unpack a block of q samples (pairs) from the soundcard and feed them
+//  through the FFT.
+//
+
+void process_block( char *buff, int q)
+{
+   int i;
+   double f;
+#if PROFILING
+   uint64_t t0 = prof_now();
+
+   prof_frame_ticks = 0;
+#endif
+
+   //  Unpack the input buffer and scale to -1..+1 for further processing.
+#if FIXED_POINT
+   if( CF_fixed) unpack_fixed( buff, q);
+   else
+#endif
+   if( CF_bytes == 1)
+   {
+      unsigned char *dp = (unsigned char *) buff;
+
+      if( CF_chans == 1)
+         for( i=0; i<q; i++)
+         {
+            f = *dp++;
+            insert_sample( &left, (f - 128)/128);
+            maybe_do_fft();
+         }
+      else  // CF_chans == 2
+         for( i=0; i<q; i++)
+         {
+            f = *dp++;
+            insert_sample( &left, (f - 128)/128);
+
+            f = *dp++;
+            insert_sample( &right, (f - 128)/128);
+            maybe_do_fft();
+         }
+   }
+   else
+   if( CF_bytes == 2)
+   {
+      short *dp = (short *) buff;
+
+      if( CF_chans == 1)
+         for( i=0; i<q; i++)
+         {
+            f = *dp++;
+            insert_sample( &left, f/32768);
+            maybe_do_fft();
+         }
+      else  // CF_chans == 2
+         for( i=0; i<q; i++)
+         {
+            f = *dp++;
+            insert_sample( &left, f/32768);
+
+            f = *dp++;
+            insert_sample( &right, f/32768);
+            maybe_do_fft();
+         }
+   }
+   else
+   if( CF_bytes == 3)
+   {
+      unsigned char *dp = (unsigned char *) buff;
+
+      if( CF_chans == 1)
+         for( i=0; i<q; i++)
+         {
+            f = s24( dp);  dp += 3;
+            insert_sample( &left, f/2147483648UL);
+            maybe_do_fft();
+         }
+      else  // CF_chans == 2
+         for( i=0; i<q; i++)
+         {
+            f = s24( dp);  dp += 3;
+            insert_sample( &left, f/2147483648UL);
+
+            f = s24( dp);  dp += 3;
+            insert_sample( &right, f/2147483648UL);
+            maybe_do_fft();
+         }
+   }
+   else
+   if( CF_bytes == 4)
+   {
+      int *dp = (int *) buff;
+
+      if( CF_chans == 1)
+         for( i=0; i<q; i++)
+         {
+            f = *dp++;
+            insert_sample( &left, f/2147483648UL);
+            maybe_do_fft();
+         }
+      else  // CF_chans == 2
+         for( i=0; i<q; i++)
+         {
+            f = *dp++;
+            insert_sample( &left, f/2147483648UL);
+
+            f = *dp++;
+            insert_sample( &right, f/2147483648UL);
+            maybe_do_fft();
+         }
+   }
+
+#if PROFILING
+   // Unpack is the block time less the frames done along the way
+   prof_add( PROF_UNPACK, t0 + prof_frame_ticks);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Capture Thread                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  The capture thread reads the soundcard into a ring of blocks and wakes
+//  the dsp thread through an eventfd.  It does nothing else, so it can
+//  keep the soundcard drained even if processing stalls for a while.  If
+//  the ring fills up, blocks are read and thrown away, and the frames lost
+//  are recorded as a gap like a soundcard overrun.  A pipe is instead left
+//  unread, the capture thread waiting on a second eventfd which the dsp
+//  thread signals as it frees each block.
+//
+
+#define MAXCAPFDS 8                  // Max soundcard descriptors to poll
+
+struct BLOCK
+{
+   char *data;
+   int frames;                        // Number of sample (pairs) in block
+   long lost;                // Frames lost immediately before this block
+};
+
+int CF_ring_blocks = 256;              // Max blocks waiting for the dsp thread
+int ring_size;          // Blocks in the ring, with those kept for raw capture
+struct BLOCK *ring;
+volatile unsigned ring_head = 0;            // Next block to fill, capture side
+volatile unsigned ring_tail = 0;            // Next block to process, dsp side
+int ring_efd = -1;                      // Signalled when a block is added
+int room_efd = -1;       // Signalled when a block is freed, for can_wait input
+int raw_efd = -1;        // Signalled when a block is added, if raw_waiting
+volatile int raw_waiting = 0;    // Set while raw capture waits for a block
+int raw_pre_blocks = 0, raw_post_blocks = 0;  // raw_capture times, blocks
+volatile int capturing = 1;              // Cleared to stop the capture thread
+pthread_t capture_tid;
+
+void setup_capture_ring( void)
+{
+   int i;
+   int size = CF_nread * CF_chans * CF_bytes;
+
+   // Processed blocks stay in the ring long enough to be raw captured
+   ring_size = CF_ring_blocks;
+   if( CF_raw_file) ring_size += raw_pre_blocks + 1;
+
+   if( (ring = calloc( ring_size + 1, sizeof( struct BLOCK))) == NULL)
+      bailout( "not enough memory for capture ring");
+
+   // One extra block for reading into when the ring is full.  All blocks
+   // are written now so that no page fault can happen during capture.
+   for( i=0; i <= ring_size; i++)
+   {
+      if( (ring[i].data = malloc( size)) == NULL)
+         bailout( "not enough memory for capture ring");
+      memset( ring[i].data, 0, size);
+   }
+
+   if( (ring_efd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+       (input->can_wait &&
+        (room_efd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) ||
+       (CF_raw_file &&
+        (raw_efd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0))
+      bailout( "cannot create eventfd: %s", strerror( errno));
+
+   report( 2, "capture ring: %d blocks, %.3f seconds", ring_size,
+              (double) ring_size * CF_nread / CF_sample_rate);
+}
+
+void *capture_thread( void *arg)
+{
+   int ncap, q;
+   long dropped = 0;                  // Frames thrown away with the ring full
+   uint64_t one = 1;
+   struct pollfd pfds[MAXCAPFDS];
+
+   setup_thread( TH_CAPTURE);
+
+   ncap = input->poll_fds( pfds, MAXCAPFDS);
+   input->start();
+
+   while( capturing)
+   {
+      struct BLOCK *b;
+
+      // Leave a pipe unread until the dsp thread makes room
+      if( input->can_wait && ring_head - ring_tail == CF_ring_blocks)
+      {
+         struct pollfd rfd = { .fd = room_efd, .events = POLLIN };
+         uint64_t n;
+
+         if( poll( &rfd, 1, 100) > 0 &&
+             read( room_efd, &n, sizeof( n)) < 0 && errno != EAGAIN)
+            report( 0, "eventfd read failed: %s", strerror( errno));
+         continue;
+      }
+
+      // Time out now and then to notice when we are asked to stop
+      if( poll( pfds, ncap, 100) <= 0 || !input->ready( pfds, ncap)) continue;
+
+      if( ring_head - ring_tail == CF_ring_blocks)
+      {
+         if( (q = input->read( ring[ring_size].data)) > 0)
+         {
+            if( !dropped) report( 0, "capture ring full, dropping input");
+            dropped += q;
+            __sync_fetch_and_add( &frames_lost, q);
+         }
+         continue;
+      }
+
+      b = ring + ring_head % ring_size;
+      PROF_START( t0);
+      q = input->read( b->data);
+      PROF_STOP( PROF_READ, t0);
+      if( q <= 0) continue;
+
+      b->frames = q;
+      b->lost = capture_lost + dropped;
+      capture_lost = dropped = 0;
+
+      __sync_synchronize();
+      ring_head++;
+      if( write( ring_efd, &one, sizeof( one)) < 0)
+         report( 0, "eventfd write failed: %s", strerror( errno));
+      __sync_synchronize();
+      if( raw_waiting && write( raw_efd, &one, sizeof( one)) < 0)
+         report( 0, "eventfd write failed: %s", strerror( errno));
+   }
+
+   if( input->stop) input->stop();
+   return NULL;
+}
+
+void start_capture_thread( void)
+{
+   int err;
+
+   if( (err = pthread_create( &capture_tid, NULL, capture_thread, NULL)) != 0)
+      bailout( "cannot create capture thread: %s", strerror( err));
+}
+
+void stop_capture_thread( void)
+{
+   capturing = 0;
+   pthread_join( capture_tid, NULL);
+}
+
+//
+//  Process everything waiting in the capture ring
+//
+
+void drain_capture_ring( void)
+{
+   uint64_t n, one = 1;
+
+   if( read( ring_efd, &n, sizeof( n)) < 0 && errno != EAGAIN)
+      report( 0, "eventfd read failed: %s", strerror( errno));
+
+   while( ring_tail != ring_head)
+   {
+      struct BLOCK *b = ring + ring_tail % ring_size;
+      double t = monotonic_time();
+
+      __sync_synchronize();
+      if( b->lost) output_gap( b->lost);
+      process_block( b->data, b->frames);
+      load_measure( monotonic_time() - t, b->frames);
+
+      __sync_synchronize();
+      ring_tail++;
+      if( room_efd >= 0 && write( room_efd, &one, sizeof( one)) < 0)
+         report( 0, "eventfd write failed: %s", strerror( errno));
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  JACK Input                                                               //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  With 'device jack:<name>', sidc is a JACK client called <name> (sidc if
+//  none) with an input port for each channel, so it can share the
+//  soundcard with other software.  PipeWire serves JACK clients too.  The
+//  sample rate is the server's, and 'jack_connect' names the ports to
+//  connect to ours.
+//
+//  The process callback only converts the period to 32 bit integers,
+//  interleaving the channels, and puts it in the capture ring.  It never
+//  waits: with the ring full the period is dropped and counted as lost.
+//  The capture thread has nothing to poll and just idles.
+//
+
+#if HAVE_JACK
+
+jack_client_t *jack_client;
+jack_port_t *jack_ports[2];
+char *CF_jack_src[2] = { NULL, NULL };     // Ports to connect, left and right
+long jack_dropped = 0;                // Frames dropped since the last block
+
+static inline int32_t jack_sample( float v)
+{
+   return v >= 1 ? INT32_MAX : v <= -1 ? INT32_MIN : lrintf( v * 2147483648.0f);
+}
+
+int jack_process( jack_nframes_t nframes, void *arg)
+{
+   uint64_t one = 1;
+   float *in[2];
+   int c, i, done;
+
+   for( c = 0; c < CF_chans; c++)
+      in[c] = jack_port_get_buffer( jack_ports[c], nframes);
+
+   for( done = 0; done < nframes; done += i)
+   {
+      int n = MIN( nframes - done, CF_nread);
+      struct BLOCK *b;
+      int32_t *p;
+
+      if( ring_head - ring_tail == CF_ring_blocks)
+      {
+         jack_dropped += n;
+         __sync_fetch_and_add( &frames_lost, n);
+         i = n;
+         continue;
+      }
+
+      b = ring + ring_head % ring_size;
+      p = (int32_t *) b->data;
+      for( i = 0; i < n; i++)
+         for( c = 0; c < CF_chans; c++)
+            *p++ = jack_sample( in[c][done + i]);
+
+      b->frames = n;
+      b->lost = jack_dropped;
+      jack_dropped = 0;
+
+      __sync_synchronize();
+      ring_head++;
+      if( write( ring_efd, &one, sizeof( one)) < 0)
+         ;                          // Cannot happen, and cannot report here
+      __sync_synchronize();
+      if( raw_waiting && write( raw_efd, &one, sizeof( one)) < 0)
+         ;
+   }
+
+   return 0;
+}
+
+int jack_xrun( void *arg)
+{
+   overrun_cnt++;
+   report( 0, "JACK xrun, %d in total", overrun_cnt);
+   return 0;
+}
+
+void jack_shutdown( void *arg)
+{
+   report( 0, "JACK server has gone, stopping");
+   kill( getpid(), SIGTERM);
+}
+
+void setup_jack_input( void)
+{
+   int c;
+   jack_status_t status;
+   char *name = CF_device[5] ? CF_device + 5 : "sidc";
+   unsigned rate;
+
+   if( (jack_client = jack_client_open( name, JackNoStartServer,
+                                        &status)) == NULL)
+      bailout( "cannot connect to JACK server, status 0x%x", status);
+
+   rate = jack_get_sample_rate( jack_client);
+   if( rate != CF_sample_rate)
+      report( 0, "using the JACK sample rate %u, not %u", rate,
+                 CF_sample_rate);
+   CF_sample_rate = rate;
+
+   // Blocks of 32 bit samples, big enough for a whole period
+   CF_bytes = 4;
+   CF_nread = MAX( CF_nread, jack_get_buffer_size( jack_client));
+
+   for( c = 0; c < CF_chans; c++)
+      if( (jack_ports[c] = jack_port_register( jack_client,
+                            c ? "right" : "left", JACK_DEFAULT_AUDIO_TYPE,
+                            JackPortIsInput, 0)) == NULL)
+         bailout( "cannot register JACK port");
+
+   jack_set_process_callback( jack_client, jack_process, NULL);
+   jack_set_xrun_callback( jack_client, jack_xrun, NULL);
+   jack_on_shutdown( jack_client, jack_shutdown, NULL);
+
+   report( 0, "JACK client [%s], %d Hz, period %u frames",
+              jack_get_client_name( jack_client), CF_sample_rate,
+              jack_get_buffer_size( jack_client));
+}
+
+int jack_poll_fds( struct pollfd *pfds, int space)
+{
+   return 0;
+}
+
+int jack_ready( struct pollfd *pfds, int n)
+{
+   return 0;
+}
+
+//
+//  Activate once the capture ring exists, then make the connections
+//
+
+void start_jack( void)
+{
+   int c, err;
+
+   if( (err = jack_activate( jack_client)) != 0)
+      bailout( "cannot activate JACK client: %d", err);
+
+   for( c = 0; c < CF_chans; c++)
+      if( CF_jack_src[c] &&
+          (err = jack_connect( jack_client, CF_jack_src[c],
+                               jack_port_name( jack_ports[c]))) != 0 &&
+          err != EEXIST)
+         report( 0, "cannot connect JACK port %s: %d", CF_jack_src[c], err);
+}
+
+void stop_jack( void)
+{
+   jack_deactivate( jack_client);
+   jack_client_close( jack_client);
+}
+
+int read_jack( char *buf)
+{
+   return 0;
+}
+
+struct INPUT jack_input = { "JACK", setup_jack_input, jack_poll_fds,
+                            jack_ready, start_jack, read_jack, stop_jack };
+
+#endif // HAVE_JACK
+
+///////////////////////////////////////////////////////////////////////////////
+//  Load Shedding                                                            //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  The dsp thread times its work on each block against the real time the
+//  block covers.  With load_shed set, if over SHED_WINDOW seconds of input
+//  the work took more than shed_high of the real time, or the capture ring
+//  is more than half full, the next of the configured steps is taken.
+//  When the load has stayed below shed_low for SHED_QUIET windows, the
+//  last step taken is undone.  Each change is logged and marked in the
+//  data files, so that degraded records can be told apart.
+//
+
+#define SHED_WINDOW 2.0          // Seconds of input in each load measurement
+#define SHED_QUIET 5        // Windows of light load before a step is undone
+
+double load_busy = 0, load_input = 0;       // This window so far, seconds
+double load_last = 0;       // Load in the last window, fraction of real time
+int load_quiet = 0;              // Consecutive windows below shed_low
+
+char *shed_name( int step)
+{
+   switch( step)
+   {
+      case SHED_USPEC: return "utility spectrum";
+      case SHED_SPECTRUM: return "spectrum outputs";
+      case SHED_CROSS: return "cross spectrum";
+      case SHED_SKIP: return "alternate frames";
+   }
+   return "?";
+}
+
+void shed_change( int level)
+{
+   int i;
+   struct timeval tv;
+   char *stamp = NULL, *line = NULL;
+   size_t len;
+   FILE *f;
+
+   report( 0, "load %.0f%% of real time, %s %s, shed level %d",
+              100 * load_last, level > shed_level ? "dropping" : "restoring",
+              shed_name( shed_steps[MIN( level, shed_level)]), level);
+
+   shed_level = level;
+   for( shed = i = 0; i < level; i++) shed |= shed_steps[i];
+
+   gettimeofday( &tv, NULL);
+   substitute_params( &stamp, &tv, CF_timestamp, "");
+   f = open_record( &line, &len);
+   fprintf( f, "# shed %s %d %.0f\n", stamp, level, 100 * load_last);
+   fclose( f);
+
+   output_note( &tv, SIDC_RECORD_SHED, level, line, len);
+
+   free( line);
+   free( stamp);
+}
+
+void load_measure( double busy, int frames)
+{
+   int backlog;
+
+   load_busy += busy;
+   load_input += (double) frames / CF_sample_rate;
+   if( load_input < SHED_WINDOW) return;
+
+   load_last = load_busy / load_input;
+   load_busy = load_input = 0;
+   if( !nshed_steps) return;
+
+   // A pipe fed faster than real time keeps the ring full without sidc
+   // falling behind, so only the load counts
+   backlog = !input->can_wait && ring_head - ring_tail > CF_ring_blocks / 2;
+   if( load_last > CF_shed_high || backlog)
+   {
+      load_quiet = 0;
+      if( shed_level < nshed_steps) shed_change( shed_level + 1);
+   }
+   else
+   if( load_last < CF_shed_low)
+   {
+      if( shed_level && ++load_quiet >= SHED_QUIET)
+      {
+         load_quiet = 0;
+         shed_change( shed_level - 1);
+      }
+   }
+   else load_quiet = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Raw Capture                                                              //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  With raw_capture set, the capture ring is made longer so that blocks
+//  stay in it for raw_pre seconds after they are processed.  On a trigger
+//  the raw thread writes a WAV file from raw_pre seconds before to
+//  raw_post seconds after, straight from the ring blocks, so the samples
+//  are never copied.  A trigger during a capture extends it.
+//
+//  The capture thread is never held up.  If the raw thread falls so far
+//  behind that the block it is writing is reused, the file is cut short.
+//  When it catches up it waits on raw_efd, which the capture side signals
+//  as it adds a block for as long as raw_waiting is set.
+//
+
+pthread_mutex_t raw_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t raw_ready = PTHREAD_COND_INITIALIZER;
+unsigned raw_start, raw_end;             // Blocks to write, first and last + 1
+int raw_pending = 0;                          // Set when a trigger is waiting
+int raw_active = 0;                              // Set while writing a file
+int raw_stop = 0;
+struct timeval raw_tv;                                // Time of the trigger
+char *raw_why;                                            // Cause of it
+pthread_t raw_tid;
+
+void setup_raw_capture( void)
+{
+   if( !CF_raw_file) return;
+
+   raw_pre_blocks = ceil( CF_raw_pre * CF_sample_rate / CF_nread);
+   raw_post_blocks = ceil( CF_raw_post * CF_sample_rate / CF_nread);
+   report( 1, "raw capture: %d blocks before, %d after",
+              raw_pre_blocks, raw_post_blocks);
+}
+
+//
+//  Called on the dsp thread, or an fft thread, while processing the
+//  block at ring_tail
+//
+
+void raw_trigger( char *why)
+{
+   unsigned t = ring_tail;
+
+   if( !CF_raw_file) return;
+
+   pthread_mutex_lock( &raw_lock);
 
-      free( stamp);
+   if( raw_pending || raw_active)
+   {
+      if( (int)(t + raw_post_blocks + 1 - raw_end) > 0)
+         raw_end = t + raw_post_blocks + 1;
+   }
+   else
+   {
+      raw_start = t < raw_pre_blocks ? 0 : t - raw_pre_blocks;
+      raw_end = t + raw_post_blocks + 1;
+      raw_why = why;
+      gettimeofday( &raw_tv, NULL);
+      raw_pending = 1;
+      pthread_cond_signal( &raw_ready);
    }
 
-   free( prefix);
+   pthread_mutex_unlock( &raw_lock);
+}
+
+//
+//  WAV header for the samples as they come from the soundcard
+//
+
+void put_le( unsigned char *p, uint32_t v, int n)
+{
+   while( n--) { *p++ = v & 0xff; v >>= 8; }
 }
 
-void output_spectrum_record( struct timeval *tv)
+void wav_header( unsigned char *h, uint32_t bytes)
 {
-   int i;
-   char *stamp = NULL, *prefix = NULL;
+   int align = CF_chans * CF_bytes;
+
+   memcpy( h, "RIFF", 4);
+   put_le( h + 4, 36 + bytes, 4);
+   memcpy( h + 8, "WAVEfmt ", 8);
+   put_le( h + 16, 16, 4);
+   put_le( h + 20, 1, 2);                                              // PCM
+   put_le( h + 22, CF_chans, 2);
+   put_le( h + 24, CF_sample_rate, 4);
+   put_le( h + 28, CF_sample_rate * align, 4);
+   put_le( h + 32, align, 2);
+   put_le( h + 34, 8 * CF_bytes, 2);
+   memcpy( h + 36, "data", 4);
+   put_le( h + 40, bytes, 4);
+}
 
-   if( !substitute_params( &prefix, tv, CF_output_files, NULL))
-      bailout( "error in output_files configuration");
+void raw_write( unsigned start, struct timeval *tv, char *why)
+{
+   FILE *f;
+   unsigned i, end;
+   unsigned char h[44];
+   uint32_t bytes = 0;
+   long lost = 0;
+   int cut = 0;
+   char *prefix = NULL, *filename = NULL;
+
+   substitute_params( &prefix, tv, CF_raw_file, NULL);
+   append_sprintf( &filename, "%s/%s", CF_datadir, prefix);
+   free( prefix);
 
-   if( bound_strcmp( prefix, out_prefix))
+   if( (f = fopen( filename, "w")) == NULL)
    {
-      char *filename = NULL;
+      report( 0, "cannot open [%s], %s", filename, strerror( errno));
+      free( filename);
+      return;
+   }
+   report( 0, "raw capture [%s], %s", filename, why);
 
-      if( out_prefix) free( out_prefix);
-      out_prefix = strdup( prefix);
-      append_sprintf( &filename, "%s/%s", CF_datadir, out_prefix);
-      report( 0, "using output file [%s]", filename);
+   wav_header( h, 0);
+   fwrite( h, 1, sizeof( h), f);
 
-      if( sf_fo) fclose( sf_fo);
-      if( (sf_fo = fopen( filename, "a+")) == NULL)
-            bailout( "cannot open [%s], %s", filename, strerror( errno));
+   // The oldest block that cannot be overwritten while we write it
+   if( (int)(start - (ring_head - ring_size + 1)) < 0)
+      start = ring_head - ring_size + 1;
 
-      if( CF_output_header)
+   for( i = start; ; i++)
+   {
+      struct BLOCK *b;
+      size_t n;
+
+      pthread_mutex_lock( &raw_lock);
+      end = raw_end;
+      pthread_mutex_unlock( &raw_lock);
+      if( (int)(i - end) >= 0) break;
+
+      // Wait for the block to be captured
+      raw_waiting = 1;
+      __sync_synchronize();
+      while( (int)(ring_head - i) <= 0 && !raw_stop)
       {
-         // Header record required.  Output a header every time sidc
-         // is started - only way to handle band changes etc
-         struct stat st;
-
-         if( stat( filename, &st) < 0) 
-            bailout( "cannot stat output file %s: %s",
-               filename, strerror( errno));
+         struct pollfd pfd = { .fd = raw_efd, .events = POLLIN };
+         uint64_t n;
 
-         fputs( "# FREQ ", sf_fo);
-         for( i = cuton; i < cutoff; i++)
-            fprintf( sf_fo, "%.2f ", (i+0.5) * DF);
-         fputs( "\n", sf_fo);
+         if( poll( &pfd, 1, 100) > 0 &&
+             read( raw_efd, &n, sizeof( n)) < 0 && errno != EAGAIN)
+            report( 0, "eventfd read failed: %s", strerror( errno));
+      }
+      raw_waiting = 0;
+      if( (int)(ring_head - i) <= 0) break;
+      __sync_synchronize();
+
+      b = ring + i % ring_size;
+      n = b->frames * CF_chans * CF_bytes;
+      lost += b->lost;
+      if( fwrite( b->data, 1, n, f) != n)
+      {
+         report( 0, "raw capture write failed: %s", strerror( errno));
+         break;
       }
 
-      free( filename);
+      __sync_synchronize();
+      if( ring_head - i >= ring_size)
+      {
+         cut = 1;                       // Overwritten while we were writing it
+         break;
+      }
+      bytes += n;
    }
 
-   substitute_params( &stamp, tv, CF_timestamp, NULL);
-   fprintf( sf_fo, "%s", stamp);
+   wav_header( h, bytes);
+   if( fseek( f, 0, SEEK_SET) < 0 || fwrite( h, 1, sizeof( h), f) != sizeof( h))
+      report( 0, "cannot write header of [%s]: %s", filename, strerror( errno));
+   fclose( f);
 
-   for( i=cuton; i<cutoff; i++)
+   report( 0, "raw capture [%s]: %.1f seconds%s", filename,
+              (double) bytes / (CF_chans * CF_bytes) / CF_sample_rate,
+              cut ? ", cut short" : "");
+   if( lost) report( 0, "raw capture [%s]: %ld frames lost inside", filename, lost);
+   free( filename);
+}
+
+void *raw_thread( void *arg)
+{
+   unsigned start;
+   struct timeval tv;
+   char *why;
+
+   setup_thread( TH_RAW);
+
+   pthread_mutex_lock( &raw_lock);
+   while( 1)
    {
-      double e = left.powspec[i]/output_int;
-      if( CF_log_scale) e = CF_offset_db + 10 * log10( e + 1e-9);
-      fputs( " ", sf_fo);
-      fprintf( sf_fo, CF_field_format, e); 
+      while( !raw_pending && !raw_stop) pthread_cond_wait( &raw_ready, &raw_lock);
+      if( !raw_pending) break;
+
+      raw_pending = 0;
+      raw_active = 1;
+      start = raw_start;
+      tv = raw_tv;
+      why = raw_why;
+      pthread_mutex_unlock( &raw_lock);
+
+      raw_write( start, &tv, why);
+
+      pthread_mutex_lock( &raw_lock);
+      raw_active = 0;
    }
+   pthread_mutex_unlock( &raw_lock);
 
-   fputs( "\n", sf_fo);
-   fflush( sf_fo);
-   free( prefix);
-   free( stamp);
+   return NULL;
 }
 
-void output_record( void)
+void start_raw_capture( void)
 {
-   int i;
-   struct timeval tv;
+   int err;
 
-   if( CF_chans == 2)
-      report( 2, "peak/rms left=%.3f/%.3f right=%.3f/%.3f",
-              left.peak, sqrt( left.sum_sq/(FFTWID * output_int)),
-              right.peak, sqrt( right.sum_sq/(FFTWID * output_int)));
-   else
-      report( 2, "peak/rms %.3f/%.3f",
-              left.peak, sqrt( left.sum_sq/FFTWID));
+   if( !CF_raw_file) return;
 
-   gettimeofday( &tv, NULL);
+   if( (err = pthread_create( &raw_tid, NULL, raw_thread, NULL)) != 0)
+      bailout( "cannot create raw capture thread: %s", strerror( err));
+}
 
-   if( CF_output_policy == OP_SPECTRUM) output_spectrum_record( &tv);
-   else
-   if( CF_output_policy == OP_BANDS_MULTI) output_record_multi( &tv);
-   else
-   if( CF_output_policy == OP_BANDS_EACH) output_record_each( &tv);
+//
+//  A capture under way stops at the last block captured
+//
 
-   //
-   // Clear down the spectrum and peak/rms accumulators
-   //
+void stop_raw_capture( void)
+{
+   uint64_t one = 1;
 
-   for( i=0; i<CF_bins; i++) left.powspec[i] = right.powspec[i] = 0;
-   left.peak = left.sum_sq = 0;
-   right.peak = right.sum_sq = 0;
-}
+   if( !CF_raw_file) return;
 
+   pthread_mutex_lock( &raw_lock);
+   raw_stop = 1;
+   pthread_cond_signal( &raw_ready);
+   pthread_mutex_unlock( &raw_lock);
+   if( write( raw_efd, &one, sizeof( one)) < 0)
+      report( 0, "eventfd write failed: %s", strerror( errno));
+
+   pthread_join( raw_tid, NULL);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
-//  Signal Processing                                                        //
+//  Main Loop                                                                //
 ///////////////////////////////////////////////////////////////////////////////
 
-void process_fft( struct CHAN *c)
+//
+//  The main loop runs on the dsp thread.  It polls the capture ring, a
+//  signalfd for the signals we act on, timerfds for the periodic jobs and
+//  the record socket.  Signals are blocked from startup in every thread,
+//  so they are only ever handled here.
+//
+
+void handled_signals( sigset_t *set)
 {
-   int i;
+   sigemptyset( set);
+   sigaddset( set, SIGINT);
+   sigaddset( set, SIGTERM);
+   sigaddset( set, SIGQUIT);
+   sigaddset( set, SIGHUP);
+   sigaddset( set, SIGUSR1);
+   sigaddset( set, SIGUSR2);
+}
 
-   fftw_execute( c->ffp);   // Do the FFT
+//
+//  Create a timer which fires every secs seconds.  If align is set, the
+//  timer runs on the wall clock and fires on whole multiples of secs.
+//
 
-   //
-   //  Obtain squared amplitude of each bin.
-   //
+int make_timer( double secs, int align)
+{
+   int fd;
+   struct itimerspec its;
+   int clock = align ? CLOCK_REALTIME : CLOCK_MONOTONIC;
 
-   c->powspec[ 0] = 0.0;  // Zero the DC component
-   for( i=1; i<CF_bins; i++)
+   if( (fd = timerfd_create( clock, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+      bailout( "cannot create timer: %s", strerror( errno));
+
+   its.it_interval.tv_sec = secs;
+   its.it_interval.tv_nsec = (secs - its.it_interval.tv_sec) * 1e9;
+   its.it_value = its.it_interval;
+   if( align)
    {
-      double t1 = c->fft_data[i][0];
-      double t2 = c->fft_data[i][1];
-      double f = t1*t1 + t2*t2;
-      c->powspec[ i] += f;                    // Accumulator for output records
-      c->sigavg[i] += f;                    // Accumulator for utility spectrum
+      struct timespec now;
+
+      clock_gettime( CLOCK_REALTIME, &now);
+      its.it_value.tv_sec = now.tv_sec + (long) secs - now.tv_sec % (long) secs;
+      its.it_value.tv_nsec = 0;
    }
 
-   check_los( c);
+   if( timerfd_settime( fd, align ? TFD_TIMER_ABSTIME : 0, &its, NULL) < 0)
+      bailout( "cannot set timer: %s", strerror( errno));
+   return fd;
 }
 
-void setup_hamming_window( void)
+void clear_timer( int fd)
 {
-   int i;
-
-   if( (hamwin = malloc( sizeof( double) * FFTWID)) == NULL)
-      bailout( "not enough memory for hamming window");
+   uint64_t expirations;
 
-   for( i=0; i<FFTWID; i++) hamwin[i] = sin( i * M_PI/FFTWID);
+   if( read( fd, &expirations, sizeof( expirations)) < 0 && errno != EAGAIN)
+      report( 0, "timer read failed: %s", strerror( errno));
 }
 
-static inline void insert_sample( struct CHAN *c, double f)
+void report_stats( void)
 {
-   c->sum_sq += f * f;
-   if( f > c->peak) c->peak = f;
-   if( f < -c->peak) c->peak = -f;
-
-   c->fft_inbuf[grab_cnt] = f * hamwin[grab_cnt];
+   report( 0, "%ld frames, %ld records, %d overruns, %ld frames lost, "
+              "%d subscribers, load %.0f%%", frames_total, records_total,
+              overrun_cnt, __sync_fetch_and_add( &frames_lost, 0),
+              nclients, 100 * load_last);
+   if( shed_level) report( 0, "shed level %d", shed_level);
+#if PROFILING
+   prof_report();
+#endif
 }
 
-static inline void maybe_do_fft( void)
-{
-   if( ++grab_cnt < FFTWID) return;
-   grab_cnt = 0;
-
-   process_fft( &left);
-   if( CF_chans == 2) process_fft( &right);
+//
+//  SIGHUP closes the data files, for logrotate, and reloads what it can of
+//  the configuration; see reload_config()
+//
 
-   if( ++frame_cnt == output_int)
-   {
-      frame_cnt = 0;
-      output_record();
-   }
+void handle_signal( int sigfd)
+{
+   struct signalfd_siginfo si;
 
-   if( ++uspec_cnt == uspec_max)
-   {
-      uspec_cnt = 0;
-      utility_spectrum();
-   }
+   while( read( sigfd, &si, sizeof( si)) == sizeof( si))
+      switch( si.ssi_signo)
+      {
+         case SIGHUP:
+            report( 0, "got signal %d, reopening output files", si.ssi_signo);
+            close_output_files();
+            reload_config();
+            break;
+
+         case SIGUSR1:
+            report_stats();
+            break;
+
+         case SIGUSR2:
+            if( CF_raw_file) raw_trigger( "signal");
+            else report( 0, "got signal %d, no raw_capture", si.ssi_signo);
+            break;
+
+         default:
+            report( 0, "got signal %d, stopping", si.ssi_signo);
+            running = 0;
+      }
 }
 
 //
-// Main signal processing loop.  Never returns.
+// Main signal processing loop.  Returns when asked to stop by a signal.
 //
 
 void process_signal( void)
 {
-   char *buff = malloc( CF_nread * CF_chans * CF_bytes);
-
-   if( !buff) bailout( "not enough memory for input buffer");
-
-   while( 1)
+   int i, n;
+   sigset_t set;
+   struct pollfd pfds[5 + 1 + MAXCLIENTS];
+
+   setup_thread( TH_DSP);
+
+   handled_signals( &set);
+   if( (pfds[0].fd = signalfd( -1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+      bailout( "cannot create signalfd: %s", strerror( errno));
+
+   pfds[1].fd = CF_uspec_file || CF_shm_name ?
+                   make_timer( CF_uspec_secs, 0) : -1;
+   pfds[2].fd = CF_stats_secs > 0 ? make_timer( CF_stats_secs, 0) : -1;
+   pfds[3].fd = make_timer( 1, 1);           // Check for output file rollover
+   pfds[4].fd = ring_efd;
+   for( i=0; i<5; i++) pfds[i].events = POLLIN;
+
+   start_writer();
+   start_alerts();
+   start_fft_workers();
+   start_raw_capture();
+   start_capture_thread();
+
+   while( running)
    {
-      int i, q;
-      double f;
-
-      q = read_soundcard( buff);
+      n = 5;
+      n += client_poll_fds( pfds + n);
 
-      //  Unpack the input buffer and scale to -1..+1 for further processing.
-      if( CF_bytes == 1)
+      if( poll( pfds, n, -1) < 0)
       {
-         unsigned char *dp = (unsigned char *) buff;
-
-         if( CF_chans == 1)
-            for( i=0; i<q; i++)
-            {
-               f = *dp++;
-               insert_sample( &left, (f - 127)/128);
-               maybe_do_fft();
-            }
-         else  // CF_chans == 2
-            for( i=0; i<q; i++)
-            {
-               f = *dp++;
-               insert_sample( &left, (f - 127)/128);
-
-               f = *dp++;
-               insert_sample( &right, (f - 127)/128);
-               maybe_do_fft();
-            }
+         if( errno == EINTR) continue;
+         bailout( "poll failed: %s", strerror( errno));
       }
-      else
-      if( CF_bytes == 2)
-      {
-         short *dp = (short *) buff;
 
-         if( CF_chans == 1)
-            for( i=0; i<q; i++)
-            {
-               f = *dp++;
-               insert_sample( &left, f/32768);
-               maybe_do_fft();
-            }
-         else  // CF_chans == 2
-            for( i=0; i<q; i++)
-            {
-               f = *dp++;
-               insert_sample( &left, f/32768);
+      if( pfds[4].revents & POLLIN) drain_capture_ring();
 
-               f = *dp++;
-               insert_sample( &right, f/32768);
-               maybe_do_fft();
-            }
-      }
-      else
-      if( CF_bytes == 3)
+      if( pfds[1].revents & POLLIN)
       {
-         char *dp = buff;
-
-         if( CF_chans == 1)
-            for( i=0; i<q; i++)
-            {
-               f = (* (int *) dp) & 0xffffff;  dp += 3;
-               insert_sample( &left, f/8388608);
-               maybe_do_fft();
-            }
-         else  // CF_chans == 2
-            for( i=0; i<q; i++)
-            {
-               f = (* (int *) dp) & 0xffffff;  dp += 3;
-               insert_sample( &left, f/8388608);
+         clear_timer( pfds[1].fd);
+         utility_spectrum();
+      }
 
-               f = (* (int *) dp) & 0xffffff;  dp += 3;
-               insert_sample( &right, f/8388608);
-               maybe_do_fft();
-            }
+      if( pfds[2].revents & POLLIN)
+      {
+         clear_timer( pfds[2].fd);
+         report_stats();
       }
-      else
-      if( CF_bytes == 4)
+
+      if( pfds[3].revents & POLLIN)
       {
-         int *dp = (int *) buff;
+         clear_timer( pfds[3].fd);
+         check_rollover();
+      }
 
-         if( CF_chans == 1)
-            for( i=0; i<q; i++)
-            {
-               f = *dp++;
-               insert_sample( &left, f/2147483648UL);
-               maybe_do_fft();
-            }
-         else  // CF_chans == 2
-            for( i=0; i<q; i++)
-            {
-               f = *dp++;
-               insert_sample( &left, f/2147483648UL);
+      service_clients( pfds + 5, n - 5);
 
-               f = *dp++;
-               insert_sample( &right, f/2147483648UL);
-               maybe_do_fft();
-            }
-      }
+      if( pfds[0].revents & POLLIN) handle_signal( pfds[0].fd);
    }
+
+   stop_capture_thread();
+   stop_raw_capture();
+   stop_fft_workers();
+   for( i=0; i<4; i++) if( pfds[i].fd >= 0) close( pfds[i].fd);
+   flush_rollups();
+   close_output_files();
+   stop_writer();
+   stop_alerts();
+#if PROFILING
+   prof_write_trace();
+#endif
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1066,19 +5900,108 @@ void config_band( char *ident, char *start, char *end, char *side)
    if( !strcasecmp( side, "right")) b->side = &right;
    else
       bailout( "must specify left or right side for band %s", ident);
+}
+
+int config_policy( char *name)
+{
+   if( !strcasecmp( name, "SPECTRUM")) return OP_SPECTRUM;
+   if( !strcasecmp( name, "BANDS_EACH")) return OP_BANDS_EACH;
+   if( !strcasecmp( name, "BANDS_MULTI")) return OP_BANDS_MULTI;
+
+   bailout( "unrecognised output policy [%s]", name);
+   return 0;
+}
+
+int config_format( char *name)
+{
+   if( !strcasecmp( name, "text")) return 0;
+   if( !strcasecmp( name, "binary")) return 1;
+
+   bailout( "expecting text or binary for output format");
+   return 0;
+}
+
+//
+//  Averaging modes are mean, max, min, median, ema:<seconds> and
+//  p:<percentile>
+//
+
+int config_average( char *name, double *param)
+{
+   char *e;
+
+   if( !strcasecmp( name, "mean")) return AV_MEAN;
+   if( !strcasecmp( name, "max")) return AV_MAX;
+   if( !strcasecmp( name, "min")) return AV_MIN;
+   if( !strcasecmp( name, "median"))
+   {
+      *param = 50;
+      return AV_PERCENTILE;
+   }
+
+   if( !strncasecmp( name, "ema:", 4))
+   {
+      *param = strtod( name + 4, &e);
+      if( *e || *param <= 0) bailout( "invalid EMA time constant [%s]", name);
+      return AV_EMA;
+   }
+
+   if( !strncasecmp( name, "p:", 2))
+   {
+      *param = strtod( name + 2, &e);
+      if( *e || *param < 0 || *param > 100)
+         bailout( "invalid percentile [%s]", name);
+      return AV_PERCENTILE;
+   }
+
+   bailout( "unrecognised averaging mode [%s]", name);
+   return 0;
+}
+
+void config_thread( char *name, char *cpus, char *policy, char *priority)
+{
+   int i;
+   struct THREAD_CF *t = NULL;
+
+   for( i=0; i<NTHREADS; i++)
+      if( !strcasecmp( name, thread_cf[i].name)) t = thread_cf + i;
+   if( !t) bailout( "unknown thread [%s]", name);
+
+   if( strcmp( cpus, "-") &&
+       (t->ncpus = parse_cpus( cpus, &t->cpus)) <= 0)
+      bailout( "bad CPU list [%s] for %s thread", cpus, name);
 
-   b->fo = NULL;
+   if( !strcasecmp( policy, "fifo")) t->policy = SCHED_FIFO;
+   else
+   if( !strcasecmp( policy, "rr")) t->policy = SCHED_RR;
+   else
+   if( !strcasecmp( policy, "other")) t->policy = SCHED_OTHER;
+   else
+   if( strcmp( policy, "-"))
+      bailout( "expecting fifo, rr, other or - for %s thread", name);
+
+   t->priority = priority ? atoi( priority) : 0;
+   if( t->policy == SCHED_FIFO || t->policy == SCHED_RR)
+   {
+      if( !priority) t->priority = sched_get_priority_min( t->policy);
+      if( t->priority < sched_get_priority_min( t->policy) ||
+          t->priority > sched_get_priority_max( t->policy))
+         bailout( "priority out of range for %s thread", name);
+   }
 }
 
 void load_config( void)
 {
    int lino = 0, nf;
-   FILE *f;
-   char buff[100], *p, *fields[20];
+   static FILE *f;                  // Static, for a reload that fails
+   static char *buff = NULL;
+   char *p, *fields[MAXFIELDS];
+   size_t size = 0;
 
+   if( f) fclose( f);
    if( (f=fopen( config_file, "r")) == NULL) bailout( "no config file found");
 
-   while( fgets( buff, 99, f))
+   while( getline( &buff, &size, f) >= 0)
    {
       lino++;
 
@@ -1091,24 +6014,34 @@ void load_config( void)
       {
          while( *p && isspace( *p)) p++;
          if( !*p) break;
+         if( nf == MAXFIELDS) bailout( "too many fields, config line %d", lino);
          fields[nf++] = p;
          while( *p && !isspace( *p)) p++;
          if( *p) *p++ = 0;
       }
       if( !nf) continue;
+      if( reloading && !reload_key( fields[0])) continue;
 
       if( nf == 2 && !strcasecmp( fields[0], "output_policy"))
+         CF_output_policy = config_policy( fields[1]);
+      else
+      if( nf == 2 && !strcasecmp( fields[0], "output_format"))
+         CF_output_binary = config_format( fields[1]);
+      else
+      if( nf == 2 && !strcasecmp( fields[0], "output_average"))
+         CF_output_average = config_average( fields[1], &CF_output_avparam);
+      else
+      if( nf >= 4 && nf <= 6 && !strcasecmp( fields[0], "output"))
       {
-         if( !strcasecmp( fields[1], "SPECTRUM"))
-            CF_output_policy = OP_SPECTRUM;
-         else
-         if( !strcasecmp( fields[1], "BANDS_EACH"))
-            CF_output_policy = OP_BANDS_EACH;
-         else
-         if( !strcasecmp( fields[1], "BANDS_MULTI"))
-            CF_output_policy = OP_BANDS_MULTI;
-         else
-            bailout( "unrecognised output policy [%s]", fields[1]);
+         struct OUTPUT *o = outputs + noutputs;
+
+         if( noutputs == MAXOUTPUTS) bailout( "too many outputs");
+         o->policy = config_policy( fields[1]);
+         o->secs = atof( fields[2]);
+         o->files = strdup( fields[3]);
+         if( nf >= 5) o->binary = config_format( fields[4]);
+         if( nf == 6) o->average = config_average( fields[5], &o->param);
+         noutputs++;
       }
       else
       if( nf == 2 && !strcasecmp( fields[0], "output_interval"))
@@ -1122,6 +6055,12 @@ void load_config( void)
          CF_range2 = atoi( fields[2]);
       }
       else
+      if( nf == 2 && !strcasecmp( fields[0], "spectrum_zoom"))
+      {
+         if( (CF_zoom_df = atof( fields[1])) <= 0)
+            bailout( "spectrum_zoom must be a bin width in Hz");
+      }
+      else
       if( nf == 5 && !strcasecmp( fields[0], "band"))
          config_band( fields[1], fields[2], fields[3], fields[4]);
       else
@@ -1191,24 +6130,204 @@ void load_config( void)
             bailout( "expecting yes or no for output_power");
       }
       else
-      if( nf == 2 && !strcasecmp( fields[0], "output_peak"))
+      if( nf == 2 && !strcasecmp( fields[0], "output_peak"))
+      {
+         if( !strcasecmp( fields[1], "yes")) CF_output_peak = 1;
+         else
+         if( !strcasecmp( fields[1], "no")) CF_output_peak = 0;
+         else
+            bailout( "expecting yes or no for output_peak");
+      }
+      else
+      if( nf == 3 && !strcasecmp( fields[0], "utility_spectrum"))
+      {
+         // A file name of '-' sets the interval without writing a file
+         if( strcmp( fields[1], "-")) CF_uspec_file = strdup( fields[1]);
+         CF_uspec_secs = atof( fields[2]);
+      }
+      else
+      if( nf == 3 && !strcasecmp( fields[0], "shm_spectrum"))
+      {
+         CF_shm_name = strdup( fields[1]);
+         CF_shm_rows = atoi( fields[2]);
+         if( CF_shm_name[0] != '/' || CF_shm_rows < 0)
+            bailout( "error in shm_spectrum, config file line %d", lino);
+      }
+      else
+      if( nf == 2 && !strcasecmp( fields[0], "lock_memory"))
+      {
+         if( !strcasecmp( fields[1], "yes")) CF_lock_memory = 1;
+         else
+         if( !strcasecmp( fields[1], "no")) CF_lock_memory = 0;
+         else
+            bailout( "expecting yes or no for lock_memory");
+      }
+      else
+      if( (nf == 3 || nf == 4) && !strcasecmp( fields[0], "rollup"))
+      {
+         struct ROLLUP *r = rollups + nrollups;
+
+         if( nrollups == MAXROLLUPS) bailout( "too many rollups");
+         r->secs = atof( fields[1]);
+         r->file = strdup( fields[2]);
+         r->group = nf == 4 ? atoi( fields[3]) : 1;
+         if( r->secs <= 0 || r->group < 1)
+            bailout( "invalid rollup parameters");
+         nrollups++;
+      }
+      else
+      if( nf == 2 && !strcasecmp( fields[0], "cross_spectrum"))
+      {
+         if( !strcasecmp( fields[1], "yes")) CF_cross = 1;
+         else
+         if( !strcasecmp( fields[1], "no")) CF_cross = 0;
+         else
+            bailout( "expecting yes or no for cross_spectrum");
+      }
+      else
+      if( nf == 2 && !strcasecmp( fields[0], "dsp_path"))
+      {
+#if FIXED_POINT
+         if( !strcasecmp( fields[1], "fixed")) CF_fixed = 1;
+         else
+         if( !strcasecmp( fields[1], "float")) CF_fixed = 0;
+         else
+            bailout( "expecting fixed or float for dsp_path");
+#else
+         if( strcasecmp( fields[1], "float"))
+            bailout( "dsp_path %s: not built with --enable-fixed-point",
+                     fields[1]);
+#endif
+      }
+      else
+      if( (nf == 2 || nf == 3) && !strcasecmp( fields[0], "jack_connect"))
+      {
+#if HAVE_JACK
+         CF_jack_src[0] = strdup( fields[1]);
+         if( nf == 3) CF_jack_src[1] = strdup( fields[2]);
+#else
+         bailout( "jack_connect: not built with JACK");
+#endif
+      }
+      else
+      if( nf >= 3 && !strcasecmp( fields[0], "load_shed"))
+      {
+         int i, j;
+         char *default_steps[MAXSHED] = { "uspec", "spectrum", "cross", "skip"};
+
+         CF_shed_high = atof( fields[1]) / 100;
+         CF_shed_low = atof( fields[2]) / 100;
+         if( CF_shed_high <= 0 || CF_shed_low >= CF_shed_high)
+            bailout( "load_shed needs high > low > 0");
+
+         nshed_steps = 0;
+         for( i = 3; i < nf || (nf == 3 && i < 3 + MAXSHED); i++)
+         {
+            char *step = nf > 3 ? fields[i] : default_steps[i - 3];
+            int v;
+
+            if( !strcasecmp( step, "uspec")) v = SHED_USPEC;
+            else
+            if( !strcasecmp( step, "spectrum")) v = SHED_SPECTRUM;
+            else
+            if( !strcasecmp( step, "cross")) v = SHED_CROSS;
+            else
+            if( !strcasecmp( step, "skip")) v = SHED_SKIP;
+            else
+               bailout( "unknown load_shed step [%s]", step);
+
+            for( j = 0; j < nshed_steps; j++)
+               if( shed_steps[j] == v) bailout( "repeated load_shed step");
+            shed_steps[nshed_steps++] = v;
+         }
+      }
+      else
+      if( nf >= 4 && !strcasecmp( fields[0], "raw_capture"))
+      {
+         int i;
+
+         CF_raw_file = strdup( fields[1]);
+         CF_raw_pre = atof( fields[2]);
+         CF_raw_post = atof( fields[3]);
+         if( CF_raw_pre < 0 || CF_raw_post < 0)
+            bailout( "invalid raw_capture times");
+
+         for( i = 4; i < nf; i++)
+            if( !strcasecmp( fields[i], "los")) CF_raw_los = 1;
+            else
+            if( !strcasecmp( fields[i], "flare")) CF_raw_flare = 1;
+            else
+            if( !strncasecmp( fields[i], "peak:", 5) &&
+                (CF_raw_peak = atof( fields[i] + 5)) > 0) ;
+            else
+               bailout( "unknown raw_capture trigger [%s]", fields[i]);
+      }
+      else
+      if( nf == 2 && !strcasecmp( fields[0], "index_block"))
+      {
+         CF_index_block = atoi( fields[1]);
+         if( CF_index_block < 0) bailout( "invalid index_block");
+      }
+      else
+      if( nf >= 2 && nf <= 6 && !strcasecmp( fields[0], "flare_detect"))
+      {
+         CF_flare_file = strdup( fields[1]);
+         if( nf > 2) CF_flare_tau = atof( fields[2]);
+         if( nf > 3) CF_flare_k = atof( fields[3]);
+         if( nf > 4) CF_flare_h = atof( fields[4]);
+         if( nf > 5) CF_flare_end = atof( fields[5]);
+         if( CF_flare_tau <= 0 || CF_flare_k < 0 || CF_flare_h <= 0 ||
+             CF_flare_end < 0)
+            bailout( "invalid flare_detect parameters");
+      }
+      else
+      if( (nf == 2 || nf == 3) && !strcasecmp( fields[0], "profile_trace"))
+      {
+#if PROFILING
+         CF_prof_trace = strdup( fields[1]);
+         if( nf == 3) CF_prof_events = atol( fields[2]);
+         if( CF_prof_events <= 0) bailout( "invalid profile_trace events");
+#else
+         bailout( "profile_trace needs sidc built with --enable-profiling");
+#endif
+      }
+      else
+      if( nf == 2 && !strcasecmp( fields[0], "fft_threads"))
+      {
+         if( (CF_fft_threads = atoi( fields[1])) < 1)
+            bailout( "fft_threads must be at least 1");
+      }
+      else
+      if( nf == 2 && !strcasecmp( fields[0], "fft_workers"))
+      {
+         if( (CF_fft_workers = atoi( fields[1])) < 0 || CF_fft_workers > 1)
+            bailout( "fft_workers must be 0 or 1");
+      }
+      else
+      if( nf == 2 && !strcasecmp( fields[0], "huge_pages"))
       {
-         if( !strcasecmp( fields[1], "yes")) CF_output_peak = 1;
+         if( !strcasecmp( fields[1], "no")) CF_huge_pages = HP_NONE;
          else
-         if( !strcasecmp( fields[1], "no")) CF_output_peak = 0;
+         if( !strcasecmp( fields[1], "transparent"))
+            CF_huge_pages = HP_TRANSPARENT;
          else
-            bailout( "expecting yes or no for output_peak");
+         if( !strcasecmp( fields[1], "explicit")) CF_huge_pages = HP_EXPLICIT;
+         else
+            bailout( "expecting no, transparent or explicit for huge_pages");
       }
       else
-      if( nf == 3 && !strcasecmp( fields[0], "utility_spectrum"))
+      if( (nf == 4 || nf == 5) && !strcasecmp( fields[0], "thread"))
+         config_thread( fields[1], fields[2], fields[3], nf == 5 ? fields[4] : NULL);
+      else
+      if( nf == 2 && !strcasecmp( fields[0], "capture_ring"))
       {
-         CF_uspec_file = strdup( fields[1]);
-         CF_uspec_secs = atof( fields[2]);
+         CF_ring_blocks = atoi( fields[1]);
+         if( CF_ring_blocks < 2) bailout( "capture_ring must be at least 2");
       }
       else
       if( nf == 2 && !strcasecmp( fields[0], "sched"))
       {
-         if( !strcasecmp( fields[1], "high")) CF_priority = 1;
+         if( !strcasecmp( fields[1], "high")) CF_priority = CF_lock_memory = 1;
          else
          if( !strcasecmp( fields[1], "low")) CF_priority = 0;
          else
@@ -1221,14 +6340,24 @@ void load_config( void)
       if( nf == 2 && !strcasecmp( fields[0], "bins"))
          CF_bins = atoi( fields[1]);
       else
+      if( nf == 2 && !strcasecmp( fields[0], "filter_bank"))
+      {
+         CF_pfb_taps = atoi( fields[1]);
+         if( CF_pfb_taps == 1 || CF_pfb_taps < 0 || CF_pfb_taps > 64)
+            bailout( "filter_bank: expecting 0, or 2 to 64 taps");
+      }
+      else
       if( nf == 2 && !strcasecmp( fields[0], "datadir"))
       {
          struct stat st;
-         strcpy( CF_datadir, fields[1]);
+         CF_datadir = strdup( fields[1]);
          if( stat( CF_datadir, &st) < 0 || !S_ISDIR( st.st_mode))
             bailout( "no data directory, %s", CF_datadir);
       }
       else
+      if( nf == 2 && !strcasecmp( fields[0], "stats_interval"))
+         CF_stats_secs = atof( fields[1]);
+      else
       if( nf == 2 && !strcasecmp( fields[0], "card_delay"))
          CF_card_delay = atoi( fields[1]);
       else
@@ -1238,6 +6367,12 @@ void load_config( void)
       if( nf == 2 && !strcasecmp( fields[0], "nread"))
          CF_nread = atoi( fields[1]);
       else
+      if( nf == 2 && !strcasecmp( fields[0], "period_size"))
+         CF_period_size = atoi( fields[1]);
+      else
+      if( nf == 2 && !strcasecmp( fields[0], "buffer_size"))
+         CF_buffer_size = atoi( fields[1]);
+      else
       if( nf == 2 && !strcasecmp( fields[0], "field_format"))
          CF_field_format = strdup( fields[1]);
       else
@@ -1250,13 +6385,562 @@ void load_config( void)
             bailout( "expecting linear or db for field_scale");
       }
       else
+      if( (nf == 3 || nf == 4) && !strcasecmp( fields[0], "record_socket"))
+      {
+         CF_rsock_path = strdup( fields[1]);
+         if( !strcasecmp( fields[2], "binary")) CF_rsock_binary = 1;
+         else
+         if( !strcasecmp( fields[2], "text")) CF_rsock_binary = 0;
+         else
+            bailout( "expecting text or binary for record_socket");
+         if( nf == 4) CF_rsock_queue = atoi( fields[3]);
+         if( CF_rsock_queue < 2)
+            bailout( "record_socket queue must be at least 2");
+      }
+      else
       if( nf == 2 && !strcasecmp( fields[0], "mail"))
          CF_mailaddr = strdup( fields[1]);
+      else
+      if( nf == 2 && !strcasecmp( fields[0], "alert_hook"))
+         CF_alert_hook = strdup( fields[1]);
+      else
+      if( nf == 2 && !strcasecmp( fields[0], "alert_file"))
+         CF_alert_file = strdup( fields[1]);
+      else
+      if( (nf == 2 || nf == 3) && !strcasecmp( fields[0], "alert_limit"))
+      {
+         CF_alert_hold = atof( fields[1]);
+         if( nf == 3) CF_alert_max = atoi( fields[2]);
+         if( CF_alert_hold < 0 || CF_alert_max < 1)
+            bailout( "invalid alert_limit parameters");
+      }
       else
          bailout( "error in config file, line %d", lino);
    }
 
+   free( buff);
+   buff = NULL;
    fclose( f);
+   f = NULL;
+}
+
+//
+//  SIGHUP reloads the settings which only the dsp thread uses, and which
+//  leave the record layout alone.  Anything else sizes the DSP arena,
+//  fixes the layout, headings, rollups and subscriber handshake, or
+//  belongs to another thread, and takes a restart to change.  A setting
+//  taken out of the file goes back to its default.  If the file has a
+//  mistake, nothing changes.
+//
+
+char *reload_keys[] = { "logfile", "output_files", "output_header",
+                        "field_format", "offset_db", "los", "load_shed" };
+
+#define NRELOAD (sizeof( reload_keys) / sizeof( char *))
+
+struct RELOAD
+{
+   char *logfile, *output_files, *field_format;
+   int output_header, los_timeout;
+   double offset_db, los_thresh, shed_high, shed_low;
+   int shed_steps[MAXSHED], nshed_steps;
+}
+ reload_defaults;
+
+int reload_key( char *key)
+{
+   int i;
+
+   for( i = 0; i < NRELOAD; i++)
+      if( !strcasecmp( key, reload_keys[i])) return 1;
+   return 0;
+}
+
+//
+//  Copy the reloadable settings into r, or out of it
+//
+
+void reload_settings( struct RELOAD *r, int save)
+{
+   #define RELOAD_COPY( a, b) if( save) a = b; else b = a
+
+   RELOAD_COPY( r->logfile, logfile);
+   RELOAD_COPY( r->output_files, CF_output_files);
+   RELOAD_COPY( r->field_format, CF_field_format);
+   RELOAD_COPY( r->output_header, CF_output_header);
+   RELOAD_COPY( r->offset_db, CF_offset_db);
+   RELOAD_COPY( r->los_thresh, CF_los_thresh);
+   RELOAD_COPY( r->los_timeout, CF_los_timeout);
+   RELOAD_COPY( r->shed_high, CF_shed_high);
+   RELOAD_COPY( r->shed_low, CF_shed_low);
+   RELOAD_COPY( r->nshed_steps, nshed_steps);
+   if( save) memcpy( r->shed_steps, shed_steps, sizeof( shed_steps));
+   else memcpy( shed_steps, r->shed_steps, sizeof( shed_steps));
+
+   #undef RELOAD_COPY
+}
+
+void reload_config( void)
+{
+   struct RELOAD old;
+
+   reload_settings( &old, 1);
+   reload_settings( &reload_defaults, 0);
+
+   reloading = 1;
+   if( setjmp( reload_env))
+   {
+      reloading = 0;
+      reload_settings( &old, 0);
+      return;
+   }
+   load_config();
+   reloading = 0;
+
+   outputs[0].files = CF_output_files;
+   if( shed_level) shed_change( 0);           // The steps may have changed
+
+   report( 0, "configuration reloaded: logfile, output_files, output_header, "
+              "field_format, offset_db, los and load_shed; other changes "
+              "need a restart");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Self Test                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+//
+//  sidc -t feeds deterministic signals through every DSP path built in
+//  and checks the spectra, band powers and levels against a reference,
+//  then times each path.  The reference converts the samples exactly,
+//  applies the same window and uses its own FFTW plan, so it shares none
+//  of the unpacking or accumulation code under test.  Exits non-zero if
+//  any check fails.
+//
+//  Every combination of 8, 16, 24 and 32 bit samples, mono and stereo,
+//  is tried with a tone at a bin centre, a tone on a bin edge, noise, and
+//  a tone clipped at full scale.  The right channel carries a weaker tone
+//  in a different bin, so that crossed channels would show.  A zoomed
+//  SPECTRUM output is shed through all that, and its levels are checked
+//  afterwards.
+//
+//  Tolerances, for each path:
+//    bin - largest difference in any bin, as a fraction of the strongest
+//          reference bin.  1e-12 is some thousands of ULPs of that bin;
+//          1e-6 is 60 dB down, where the fixed-point rounding lies.
+//    dB  - largest difference in dB, in any bin no more than ST_FLOOR
+//          below the strongest, and in any band.
+//    level - relative difference of the frame's peak and sum of squares.
+//
+
+#define ST_FLOOR 1e-8            // Bins compared in dB, relative to the peak
+#define ST_TIMING 50                        // Frames to time for each path
+
+struct ST_PATH
+{
+   char *name;
+   int fixed;                                 // Use the fixed-point path
+   int workers;                      // Transform the right on an fft thread
+   double bin, db, level;                                  // Tolerances
+   double max_bin, max_db, max_level;        // Largest differences seen
+   int fails;
+   double us;                                  // Time per stereo frame
+}
+ st_paths[] = {
+   { "float", 0, 0, 1e-12, 1e-6, 1e-12 },
+   { "float/worker", 0, 1, 1e-12, 1e-6, 1e-12 },
+#if FIXED_POINT
+   { "fixed", 1, 0, 1e-6, 0.01, 1e-4 },
+   { "fixed/worker", 1, 1, 1e-6, 0.01, 1e-4 },
+#endif
+};
+
+#define ST_NPATHS (sizeof( st_paths) / sizeof( struct ST_PATH))
+
+char *st_signals[] = { "tone at bin centre", "tone on bin edge", "noise",
+                       "clipped tone" };
+
+uint64_t st_seed;
+
+double st_signal( int sig, int side, int n)
+{
+   double k = CF_bins / 4 + 0.5 * (sig == 1) + 37 * side;
+   double a = side ? 0.25 : 0.5;
+
+   if( sig == 2)
+   {
+      st_seed = st_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      return 2 * a * ((st_seed >> 11) * ldexp( 1, -53) - 0.5);
+   }
+
+   if( sig == 3) a = side ? 1.5 : 3;
+   return a * sin( 2 * M_PI * k * n / FFTWID);
+}
+
+//
+//  Store a sample in the soundcard format, clipped to full scale, and
+//  return the value it represents
+//
+
+double st_store( unsigned char *p, double v)
+{
+   double fs = ldexp( 1, 8 * CF_bytes - 1);
+   long long c = llrint( v * fs);
+
+   if( c > fs - 1) c = fs - 1;
+   if( c < -fs) c = -fs;
+
+   switch( CF_bytes)
+   {
+      case 1: *p = c + 128;                                   break;
+      case 2: { int16_t s = c; memcpy( p, &s, 2); }           break;
+      case 3: p[0] = c; p[1] = c >> 8; p[2] = c >> 16;        break;
+      case 4: { int32_t s = c; memcpy( p, &s, 4); }           break;
+   }
+
+   return c / fs;
+}
+
+//
+//  Fill buf with a frame of the signal, and work out the reference
+//  spectrum and levels of each channel
+//
+
+double *st_in;
+fftw_complex *st_out;
+fftw_plan st_plan;
+double *st_pow[2];
+double st_peak[2], st_sum_sq[2];
+
+void st_frame( int sig, unsigned char *buf)
+{
+   int i, n, c;
+
+   st_seed = 12345;
+   for( c = 0; c < CF_chans; c++) st_peak[c] = st_sum_sq[c] = 0;
+
+   for( n = 0; n < FFTWID; n++)
+      for( c = 0; c < CF_chans; c++)
+      {
+         double v = st_store( buf + (n * CF_chans + c) * CF_bytes,
+                              st_signal( sig, c, n));
+
+         st_sum_sq[c] += v * v;
+         if( fabs( v) > st_peak[c]) st_peak[c] = fabs( v);
+      }
+
+   for( c = 0; c < CF_chans; c++)
+   {
+      for( n = 0; n < FFTWID; n++)
+      {
+         unsigned char *p = buf + (n * CF_chans + c) * CF_bytes;
+         double fs = ldexp( 1, 8 * CF_bytes - 1);
+         long long v;
+
+         switch( CF_bytes)
+         {
+            case 1: v = *p - 128;                                break;
+            case 2: { int16_t s; memcpy( &s, p, 2); v = s; }     break;
+            case 3: v = p[0] | p[1] << 8 | (signed char) p[2] << 16; break;
+            default: { int32_t s; memcpy( &s, p, 4); v = s; }    break;
+         }
+         st_in[n] = v / fs * hamwin[n];
+      }
+
+      fftw_execute( st_plan);
+      st_pow[c][0] = 0;
+      for( i = 1; i < CF_bins; i++)
+         st_pow[c][i] = st_out[i][0] * st_out[i][0] +
+                        st_out[i][1] * st_out[i][1];
+   }
+}
+
+void st_use_path( struct ST_PATH *p)
+{
+#if FIXED_POINT
+   CF_fixed = p->fixed;
+#endif
+   CF_fft_workers = CF_chans == 2 ? p->workers : 0;
+}
+
+//
+//  Run one frame through the path under test
+//
+
+void st_process( unsigned char *buf)
+{
+   int i;
+
+   grab_cnt = 0;
+   for( i = 0; i < noutputs; i++) clear_sums( outputs + i);
+
+   // So that no path can pick up the transform of the one before
+   memset( left.fft_data, 0, (CF_bins + 1) * sizeof( fftw_complex));
+   memset( right.fft_data, 0, (CF_bins + 1) * sizeof( fftw_complex));
+   process_block( (char *) buf, FFTWID);
+}
+
+double st_db( double e)
+{
+   return 10 * log10( e + 1e-30);
+}
+
+void st_fail( struct ST_PATH *p, int sig, char *what, double err)
+{
+   p->fails++;
+   report( 0, "FAIL %s, %d bit %s, %s: %s differs by %g", p->name,
+              8 * CF_bytes, CF_chans == 1 ? "mono" : "stereo",
+              st_signals[sig], what, err);
+}
+
+//
+//  The zoomed output against a full band transform of the same bin width,
+//  which would give a tone at a bin centre as (a/2 sum w)^2, and noise as
+//  a mean bin power of the mean square times sum w^2.  The first zoom
+//  frame of each signal only fills the filter.
+//
+
+#define ST_ZOOM_FRAMES 16               // Zoom frames averaged per signal
+#define ST_ZOOM_TONE 0.05                   // Tolerances, dB, for the tone
+#define ST_ZOOM_NOISE 0.3                 // and for the mean of the noise
+
+int st_zoom( unsigned char *buf)
+{
+   int i, sig, k = zoom.n / 2 + 5, fails = 0;
+   long n, N = (long) zoom.n * zoom.decim;
+   double w = 0, w2 = 0, a = 0.5, err[2] = { 0, 0 };
+   struct OUTPUT *o = outputs + 2;
+
+   for( n = 0; n < N; n++)
+   {
+      w += window( n, N);
+      w2 += window( n, N) * window( n, N);
+   }
+
+   CF_bytes = 4;
+   CF_chans = 1;
+   st_use_path( st_paths);
+   shed = 0;
+   st_seed = 12345;
+
+   for( n = sig = 0; sig < 2; sig++)
+   {
+      long start = zoom.frames;
+      double sum_sq = 0, e = 0;
+      long cnt = 0;
+
+      while( zoom.frames < start + 1 + ST_ZOOM_FRAMES)
+      {
+         for( i = 0; i < FFTWID; i++, n++, cnt++)
+         {
+            double v;
+
+            if( sig)
+            {
+               st_seed = st_seed * 6364136223846793005ULL +
+                         1442695040888963407ULL;
+               v = 2 * a * ((st_seed >> 11) * ldexp( 1, -53) - 0.5);
+            }
+            else v = a * sin( 2 * M_PI * zoom_freq( k) * n / CF_sample_rate);
+
+            v = st_store( buf + i * CF_bytes, v);
+            sum_sq += v * v;
+         }
+
+         process_block( (char *) buf, FFTWID);
+         if( zoom.frames == start + 1 && o->zsummed) clear_sums( o);
+      }
+
+      if( sig)
+      {
+         for( i = 0; i < cutoff - cuton; i++) e += o->zpow[i];
+         e /= cutoff - cuton;
+         err[1] = st_db( e / o->zsummed) - st_db( sum_sq / cnt * w2);
+      }
+      else
+         err[0] = st_db( o->zpow[k - cuton] / o->zsummed) -
+                  st_db( a * a / 4 * w * w);
+      clear_sums( o);
+   }
+
+   if( fabs( err[0]) > ST_ZOOM_TONE || fabs( err[1]) > ST_ZOOM_NOISE)
+      fails++;
+   report( 0, "%-12s %s: tone %+.3f dB, noise %+.3f dB", "zoom",
+              fails ? "FAILED" : "ok", err[0], err[1]);
+   return fails;
+}
+
+void st_check( struct ST_PATH *p, int sig)
+{
+   int c, i;
+   struct OUTPUT *o = outputs;
+
+   for( c = 0; c < CF_chans; c++)
+   {
+      double pmax = 0, e, bin = 0, db = 0;
+      struct BAND *b = bands + 3 * c;
+
+      for( i = 1; i < CF_bins; i++) pmax = MAX( pmax, st_pow[c][i]);
+
+      for( i = 1; i < CF_bins; i++)
+      {
+         double r = st_pow[c][i], v = o->pow[c][i];
+
+         bin = MAX( bin, fabs( v - r) / pmax);
+         if( r >= pmax * ST_FLOOR) db = MAX( db, fabs( st_db( v) - st_db( r)));
+      }
+
+      p->max_bin = MAX( p->max_bin, bin);
+      if( bin > p->bin) st_fail( p, sig, "bin", bin);
+      p->max_db = MAX( p->max_db, db);
+      if( db > p->db) st_fail( p, sig, "bin dB", db);
+
+      //  The mean of each band, from the bin sums, and its largest, from
+      //  the band power of each frame
+      for( i = 0; i < 6; i++)
+      {
+         int j, n1, n2;
+         double r = 0;
+
+         n1 = b[i % 3].start / DF;
+         n2 = b[i % 3].end / DF;
+         for( j = n1; j <= n2; j++) r += st_pow[c][j];
+         r /= n2 - n1 + 1;
+
+         if( r < pmax * ST_FLOOR) continue;
+         e = fabs( band_power( outputs + i / 3, b + i % 3) -
+                   10 * log10( r + 1e-9));
+         if( e > p->max_db) p->max_db = e;
+         if( e > p->db) st_fail( p, sig, i < 3 ? "band dB" : "band max dB", e);
+      }
+
+      e = fabs( o->peak[c] - st_peak[c]) / st_peak[c];
+      if( e > p->max_level) p->max_level = e;
+      if( e > p->level) st_fail( p, sig, "peak", e);
+
+      e = fabs( o->sum_sq[c] - st_sum_sq[c]) / st_sum_sq[c];
+      if( e > p->max_level) p->max_level = e;
+      if( e > p->level) st_fail( p, sig, "sum of squares", e);
+   }
+}
+
+int self_test( void)
+{
+   int i, sig, fails = 0;
+   unsigned char *buf;
+   struct ST_PATH *p;
+
+   background = 0;
+   logfile = NULL;
+
+   CF_chans = 2;
+   CF_output_policy = OP_BANDS_MULTI;
+   CF_output_interval = 3600;
+   CF_log_scale = 1;
+   DF = (double) CF_sample_rate / FFTWID;
+
+   //  Bands around each channel's tone, over a wide range, and away from it
+   for( i = 0; i < 2; i++)
+   {
+      struct BAND *b = bands + 3 * i;
+      int j;
+
+      b[0].start = (CF_bins / 4 + 37 * i - 4) * DF;
+      b[0].end = (CF_bins / 4 + 37 * i + 4) * DF;
+      b[1].start = CF_bins / 16 * DF;
+      b[1].end = CF_bins / 2 * DF;
+      b[2].start = 3 * CF_bins / 4 * DF;
+      b[2].end = (3 * CF_bins / 4 + 20) * DF;
+      for( j = 0; j < 3; j++) b[j].side = i ? &right : &left;
+   }
+   nbands = 6;
+
+   //  A second output holding the largest band power, which is taken from
+   //  each frame's bins rather than from the output's bin sums
+   outputs[1].policy = OP_BANDS_MULTI;
+   outputs[1].secs = CF_output_interval;
+   outputs[1].files = "-";
+   outputs[1].average = AV_MAX;
+
+   //  A zoomed output over a range clear of the tones, at a quarter of
+   //  the full band bin width
+   CF_range1 = rint( (CF_bins / 8 - 16) * DF);
+   CF_range2 = rint( (CF_bins / 8 + 16) * DF);
+   CF_zoom_df = DF / 4;
+   outputs[2].policy = OP_SPECTRUM;
+   outputs[2].secs = CF_output_interval;
+   outputs[2].files = "-";
+   outputs[2].average = AV_MEAN;
+   noutputs = 3;
+
+   setup_outputs();
+   setup_zoom_range();
+   setup_arena();
+   setup_hamming_window();
+   setup_zoom();
+   initialise_channel( &left);
+   initialise_channel( &right);
+#if FIXED_POINT
+   setup_fixed_point();
+   initialise_fixed_channel( &left);
+   initialise_fixed_channel( &right);
+#endif
+   setup_output_buffers();
+   CF_fft_workers = 1;
+   start_fft_workers();
+
+   if( (buf = malloc( FFTWID * 2 * 4)) == NULL ||
+       (st_pow[0] = malloc( CF_bins * sizeof( double))) == NULL ||
+       (st_pow[1] = malloc( CF_bins * sizeof( double))) == NULL ||
+       (st_in = fftw_malloc( FFTWID * sizeof( double))) == NULL ||
+       (st_out = fftw_malloc( (CF_bins + 1) * sizeof( fftw_complex))) == NULL)
+      bailout( "not enough memory for self test");
+   st_plan = fftw_plan_dft_r2c_1d( FFTWID, st_in, st_out, FFTW_ESTIMATE);
+
+   report( 0, "self test: bins %d, rate %d", CF_bins, CF_sample_rate);
+
+   shed = SHED_SPECTRUM;
+   for( CF_bytes = 1; CF_bytes <= 4; CF_bytes++)
+      for( CF_chans = 1; CF_chans <= 2; CF_chans++)
+         for( sig = 0; sig < 4; sig++)
+         {
+            st_frame( sig, buf);
+            for( p = st_paths; p < st_paths + ST_NPATHS; p++)
+            {
+               st_use_path( p);
+               st_process( buf);
+               st_check( p, sig);
+            }
+         }
+
+   //  Time 16 bit stereo noise through each path
+   CF_bytes = 2;
+   CF_chans = 2;
+   st_frame( 2, buf);
+   for( p = st_paths; p < st_paths + ST_NPATHS; p++)
+   {
+      double t;
+
+      st_use_path( p);
+      st_process( buf);
+      t = monotonic_time();
+      for( i = 0; i < ST_TIMING; i++) st_process( buf);
+      p->us = 1e6 * (monotonic_time() - t) / ST_TIMING;
+   }
+
+   for( p = st_paths; p < st_paths + ST_NPATHS; p++)
+   {
+      report( 0, "%-12s %s: bin %.1e dB %.1e level %.1e, "
+                 "%.0f us per frame (%.2fx)", p->name,
+                 p->fails ? "FAILED" : "ok", p->max_bin, p->max_db,
+                 p->max_level, p->us, st_paths[0].us / p->us);
+      fails += p->fails;
+   }
+   fails += st_zoom( buf);
+
+   CF_fft_workers = 1;
+   stop_fft_workers();
+   return fails ? 1 : 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1304,29 +6988,38 @@ void make_daemon( void)
    }
 }
 
+//
+//  Buffers come from the DSP arena, already zeroed and resident.  The
+//  channel's first buffer starts on a page of its own.
+//
+
 void initialise_channel( struct CHAN *c)
 {
-   int i;
+   c->fft_inbuf = arena_alloc( FFTWID * sizeof( double),
+                               sysconf( _SC_PAGESIZE));
+   c->fft_data = arena_alloc( (CF_bins + 1) * sizeof( fftw_complex),
+                              CACHE_LINE);
+   c->powspec = arena_alloc( CF_bins * sizeof( double), CACHE_LINE);
+   c->sigavg = arena_alloc( CF_bins * sizeof( double), CACHE_LINE);
+   if( CF_pfb_taps)
+      c->pfb_hist = arena_alloc( CF_pfb_taps * FFTWID * sizeof( double),
+                                 CACHE_LINE);
 
-   c->fft_inbuf = (double *) malloc( FFTWID * sizeof( double));
-   c->fft_data = fftw_malloc( sizeof( fftw_complex) * FFTWID);
    c->ffp = fftw_plan_dft_r2c_1d( FFTWID, c->fft_inbuf, c->fft_data,
                            FFTW_ESTIMATE | FFTW_DESTROY_INPUT);
-
-   c->powspec = (double *) malloc( CF_bins * sizeof( double));
-   c->sigavg = (double *) malloc( CF_bins * sizeof( double));
-   for( i=0; i<CF_bins; i++) c->sigavg[i] = c->powspec[i] = 0;
 }
 
 void setup_signal_handling( void)
 {
+   sigset_t set;
+
+   // Signals we act on are taken synchronously by the main loop
+   handled_signals( &set);
+   sigprocmask( SIG_BLOCK, &set, NULL);
+
    sa.sa_handler = handle_sigs;
    sigemptyset( &sa.sa_mask);
    sa.sa_flags = 0;
-   sigaction( SIGINT, &sa, NULL);
-   sigaction( SIGTERM, &sa, NULL);
-   sigaction( SIGHUP, &sa, NULL);
-   sigaction( SIGQUIT, &sa, NULL);
    sigaction( SIGFPE, &sa, NULL);
    sigaction( SIGBUS, &sa, NULL);
    sigaction( SIGSEGV, &sa, NULL);
@@ -1346,16 +7039,32 @@ void set_scheduling( void)
    }
 
    report( 0, "using SCHED_FIFO priority %d", min);
+}
+
+//
+//  Lock all present and future memory.  The heap is kept from shrinking or
+//  using separate mappings, so that once a buffer has been touched it
+//  stays resident.
+//
+
+void lock_memory( void)
+{
+   mallopt( M_TRIM_THRESHOLD, -1);
+   mallopt( M_MMAP_MAX, 0);
 
    if( mlockall( MCL_CURRENT | MCL_FUTURE) < 0)
       report( -1, "unable to lock memory: %s", strerror( errno));
+   else
+      report( 1, "memory locked");
 }
 
 int main( int argc, char *argv[])
 {
+   int i, selftest = 0;
+
    while( 1)
    {
-      int c = getopt( argc, argv, "vfmic:p:");
+      int c = getopt( argc, argv, "vfmitc:p:");
 
       if( c == 'v') VFLAG++;
       else
@@ -1365,21 +7074,31 @@ int main( int argc, char *argv[])
       else
       if( c == 'p') pid_file = optarg;
       else
+      if( c == 't') selftest = 1;
+      else
       if( c == -1) break;
       else bailout( "unknown option [%c]", c);
    }
 
+   if( selftest) return self_test();
+
    setup_signal_handling();
+   reload_settings( &reload_defaults, 1);
    load_config();
 
-   if( CF_output_policy != OP_SPECTRUM)
+   // The bands are used if the main output or any other has a BANDS policy
+   for( i = 1; i < noutputs && outputs[i].policy == OP_SPECTRUM; i++);
+   if( CF_output_policy != OP_SPECTRUM || i < noutputs)
    {
-      int i;
       struct BAND *b;
 
       for( i=0, b=bands; i<nbands; i++, b++)
+      {
          report( 1, "band %s %d %d %s",
             b->ident, b->start, b->end, b->side->name);
+         if( CF_chans == 1 && b->side == &right)
+            bailout( "band %s: only the left side exists in mono", b->ident);
+      }
    }
 
    if( background && !logfile)
@@ -1387,41 +7106,98 @@ int main( int argc, char *argv[])
 
    if( background) make_daemon();
 
-   setup_input_stream();
+   // Lock memory before the buffers are allocated, so that they are all
+   // locked as they are touched below
+   if( CF_lock_memory) lock_memory();
+
+   choose_input();
+   input->setup();
 
    DF = (double) CF_sample_rate/(double) FFTWID;
    report( 1, "resolution: bins=%d fftwid=%d df=%f", CF_bins, FFTWID, DF);
 
-   if( CF_uspec_file)
+   if( CF_uspec_file || CF_shm_name)
    {
-      // Convert CF_uspec_secs seconds to uspec_max frames
-      uspec_max = rint( CF_uspec_secs * CF_sample_rate / FFTWID);
-      report( 2, "utility spectrum interval: %d frames", uspec_max);
-      report( 2, "utility spectrum file: %s", CF_uspec_file); 
+      if( CF_uspec_secs <= 0) bailout( "utility spectrum interval must be set");
+      report( 2, "utility spectrum interval: %.3f seconds", CF_uspec_secs);
+      if( CF_uspec_file)
+         report( 2, "utility spectrum file: %s", CF_uspec_file);
    }
 
-   // Convert CF_output_interval seconds to output_int frames
-   output_int = rint( CF_output_interval * CF_sample_rate / FFTWID);
-   if( output_int == 0) output_int = 1;
-   report( 2, "output interval: %d frames", output_int);
+   if( CF_shm_name) setup_shm_spectrum();
 
-   if( CF_output_policy == OP_SPECTRUM)
+   setup_outputs();
+
+   if( CF_flare_file)
+   {
+      if( CF_output_policy == OP_SPECTRUM)
+         bailout( "flare_detect needs a BANDS output policy");
+      setup_flare();
+   }
+
+   for( i = 0; i < noutputs && outputs[i].policy != OP_SPECTRUM; i++);
+   if( i < noutputs && CF_zoom_df > 0) setup_zoom_range();
+   else
+   if( i < noutputs)
    {
       // Convert range variables Hertz to bins
       cuton = CF_range1 / DF;
       cutoff = CF_range2 / DF;
-      report( 2, "output bins: %d to %d", cuton, cutoff);
-   }   
+   }
+   if( i < noutputs) report( 2, "output bins: %d to %d", cuton, cutoff);
 
-   // Both sets of channel data structures are initialised, even if mono
-   initialise_channel( &left);
-   initialise_channel( &right);
+   if( CF_cross)
+   {
+      if( CF_chans != 2) bailout( "cross_spectrum needs stereo input");
+      if( CF_output_policy == OP_SPECTRUM)
+         bailout( "cross_spectrum needs a BANDS output policy");
+      ncross = 3 * nbands;
+   }
+
+   // Room for the values of the largest possible record
+   i = MAX( 4 + nbands + ncross, MAX( CF_bins, cutoff - cuton));
+   if( (rec_vals = calloc( i, sizeof( double))) == NULL)
+      bailout( "not enough memory for output records");
+
+   if( CF_rsock_path) setup_record_socket();
 
+   if( CF_output_policy == OP_SPECTRUM)
+      setup_rollups( cutoff - cuton, 0, cutoff - cuton);
+   else
+   if( CF_output_policy == OP_BANDS_MULTI)
+      setup_rollups( 4 + nbands + ncross, 4, 4 + nbands);
+   else setup_rollups( nbands + ncross, 0, nbands);
+
+   if( CF_chans == 1) CF_fft_workers = 0;
+#if FIXED_POINT
+   if( CF_fixed && CF_pfb_taps) bailout( "filter_bank needs dsp_path float");
+#endif
+   setup_fft_threads();
+   setup_arena();
    setup_hamming_window();
+   setup_filter_bank();
+   setup_zoom();
+   initialise_channel( &left);
+   if( CF_chans == 2) initialise_channel( &right);
+#if FIXED_POINT
+   if( CF_fixed)
+   {
+      setup_fixed_point();
+      initialise_fixed_channel( &left);
+      if( CF_chans == 2) initialise_fixed_channel( &right);
+   }
+#endif
+   setup_output_buffers();
+
+   setup_raw_capture();
+   setup_capture_ring();
+#if PROFILING
+   setup_profiling();
+#endif
 
    if( CF_card_delay) sleep( CF_card_delay);
    report( 0, "sidc version %s %s: starting work",
-      PACKAGE_VERSION, soundsystem);
+      PACKAGE_VERSION, input->name);
    alert_on = 1;
    if( CF_priority) set_scheduling();   // Setup real time scheduling
 
@@ -1437,9 +7213,33 @@ int main( int argc, char *argv[])
    }
    if( CF_uspec_file)
       free( CF_uspec_file);
+   if( CF_shm_name)
+      free( CF_shm_name);
+   if( CF_rsock_path)
+   {
+      unlink( CF_rsock_path);
+      free( CF_rsock_path);
+   }
    if( CF_mailaddr)
       free( CF_mailaddr);
-   if( out_prefix)
-      free( out_prefix);
+   if( CF_alert_hook)
+      free( CF_alert_hook);
+   if( CF_alert_file)
+      free( CF_alert_file);
+   if( CF_flare_file)
+      free( CF_flare_file);
+   for( i=0; i<nrollups; i++)
+   {
+      free( rollups[i].file);
+      free( rollups[i].sum);
+      free( rollups[i].min);
+      free( rollups[i].max);
+   }
+   for( i=0; i<noutputs; i++)
+   {
+      if( i) free( outputs[i].files);
+      free( outputs[i].bfo);
+      free( outputs[i].bix);
+   }
    return 0;
 }
@@ -16,6 +16,7 @@ Source0:        https://github.com/sorki/sidc/tarball/v%{version}/sidc-v%{versio
 BuildRequires:  autoconf
 BuildRequires:  fftw-devel
 BuildRequires:  alsa-lib-devel
+BuildRequires:  zlib-devel
 BuildRequires:  systemd-units
 Requires:       fftw
 Requires:       alsa-utils
@@ -52,6 +53,9 @@ install -Dm 644 sidc.tmpfiles %{buildroot}%{_tmpfilesdir}/tmpfiles.d/sidc.conf
 %doc AUTHORS
 %doc LICENSE
 %{_bindir}/sidc
+%{_bindir}/sidc-query
+%{_bindir}/sidc-convert
+%{_includedir}/sidc_format.h
 %config(noreplace) %{_sysconfdir}/sidc.conf
 %config(noreplace) %{_sysconfdir}/sysconfig/sidc
 %config(noreplace) %{_sysconfdir}/logrotate.d/sidc
@@ -0,0 +1,186 @@
+/*
+# sid-collector: A VLF signal monitor for recording sudden ionospheric disturbances
+#
+#  Layouts of the data which sidc shares with other programs.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; version 2 of the License.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+*/
+
+#ifndef SIDC_FORMAT_H
+#define SIDC_FORMAT_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//  Shared Memory Spectrum                                                   //
+///////////////////////////////////////////////////////////////////////////////
+//
+//  With the shm_spectrum option, sidc publishes a POSIX shared memory
+//  object containing this header, followed by the latest averaged
+//  spectrum and a ring of the most recent per-frame spectra (the
+//  waterfall).  All spectra are single precision power values,
+//  channel-major: [chans][bins], left first.
+//
+//  Each part is protected by a sequence lock.  A reader copies what it
+//  wants, then checks that the sequence number was even before the copy
+//  and unchanged after it, otherwise it retries:
+//
+//     do {
+//        s = h->spec_seq;  read barrier;
+//        copy spectrum;
+//        read barrier;
+//     } while( (s & 1) || s != h->spec_seq);
+//
+//  Readers never write to the object, so any number of them can attach
+//  without disturbing sidc.
+//
+
+#define SIDC_SHM_MAGIC 0x53494443                                     // "SIDC"
+#define SIDC_SHM_VERSION 1
+
+struct SIDC_SHM_HEADER
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t bins;                         // Number of bins in each spectrum
+   uint32_t chans;                                   // 1 = mono, 2 = stereo
+   uint32_t rows;                       // Number of rows in the waterfall ring
+   uint32_t sample_rate;                                 // Samples per second
+   double df;                                  // Bin width, Hertz
+
+   uint64_t spectrum_offset;      // Byte offset of the averaged spectrum
+   uint64_t waterfall_offset;      // Byte offset of waterfall row 0
+   uint64_t stamps_offset;   // Byte offset of double[rows] row timestamps
+
+   volatile uint32_t spec_seq;           // Sequence lock for the spectrum
+   uint32_t spec_frames;         // Number of frames in the averaged spectrum
+   double spec_stamp;          // Time of the averaged spectrum, unix seconds
+
+   volatile uint32_t wf_seq;             // Sequence lock for the waterfall
+   uint32_t wf_head;              // Index of the next row to be written
+   uint64_t wf_count;           // Total number of rows written since start
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  Binary Records                                                           //
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Binary output records are this header followed by 'count' single
+//  precision values, in the order given by the '# fields' line of the
+//  handshake.  Values are scaled exactly as the text records are.  All
+//  fields are in the byte order of the host running sidc.
+//
+//  A binary data file names its values with a HEADING record, written
+//  each time sidc opens the file, so before any records which it
+//  describes.  It is followed by 'count' bytes holding the heading line
+//  of the equivalent text file, "# stamp ..." or "# FREQ ...", ending in
+//  a newline and padded with NULs to a multiple of four bytes.  Records
+//  of other types have 'count' values only if they are DATA.
+//
+
+#define SIDC_RECORD_MAGIC 0x52444953                                  // "SIDR"
+
+#define SIDC_RECORD_DATA 1                          // A normal output record
+#define SIDC_RECORD_DROPPED 2      // 'count' records were dropped, no values
+#define SIDC_RECORD_GAP 3         // 'count' input frames were lost, no values
+#define SIDC_RECORD_SHED 4      // Load shedding now at level 'count', no values
+#define SIDC_RECORD_HEADING 5          // 'count' bytes of heading text follow
+
+struct SIDC_RECORD
+{
+   uint32_t magic;
+   uint32_t type;
+   uint32_t count;
+   uint32_t reserved;
+   double stamp;                            // Time of the record, unix seconds
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  Time Index                                                               //
+///////////////////////////////////////////////////////////////////////////////
+//
+//  With the index_block option, each data file <file> has a sidecar index
+//  <file>.idx, a sequence of these entries each followed by 'nvals' single
+//  precision minimum values and then 'nvals' maximum values.  An entry
+//  covers 'count' consecutive records; any gap or header lines among them
+//  lie inside the byte range.  Entries are in time order, so a reader can
+//  load the index and binary search it for the first block of interest.
+//
+//  The values are those of the records: for BANDS_MULTI the peak and rms
+//  columns then the bands, for BANDS_EACH the one band, for SPECTRUM the
+//  bins output.  As with binary records, the byte order is the host's.
+//
+
+#define SIDC_INDEX_MAGIC 0x58444953                                   // "SIDX"
+
+struct SIDC_INDEX_ENTRY
+{
+   uint32_t magic;
+   uint32_t nvals;                     // Number of minimum and maximum values
+   uint32_t count;                         // Number of records in the block
+   uint32_t reserved;
+   double first;                  // Time of the first record, unix seconds
+   double last;                    // Time of the last record, unix seconds
+   uint64_t offset;        // Byte offset of the first record in the data file
+   uint64_t length;      // Bytes from the first record to the end of the last
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  Compressed Data Files                                                    //
+///////////////////////////////////////////////////////////////////////////////
+//
+//  sidc-convert writes binary data files compressed, as a sequence of
+//  blocks each holding the records of one index entry.  A block is this
+//  header followed by 'length' bytes of zlib stream (RFC 1950), which
+//  inflates to 'size' bytes of binary records.  Each block starts with the
+//  HEADING record in force, if there is one, so can be read on its own.  The index
+//  entries of a compressed file give the offset and length of the whole
+//  block holding their records, header included.
+//
+
+#define SIDC_BLOCK_MAGIC 0x5a444953                                   // "SIDZ"
+
+struct SIDC_BLOCK
+{
+   uint32_t magic;
+   uint32_t count;                 // Number of DATA records in the block
+   uint32_t length;                     // Bytes of zlib stream which follow
+   uint32_t size;                             // Bytes of records inflated
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  Rollups                                                                  //
+///////////////////////////////////////////////////////////////////////////////
+//
+//  A rollup file is a sequence of these summaries, one for each bucket in
+//  which records were output, each followed by 'nvals' triples of single
+//  precision mean, minimum and maximum.  The values are those of the
+//  records, as for the time index, except that in SPECTRUM policy each
+//  value may summarise 'group' adjacent bins.  A bucket cut short when
+//  sidc stopped has a smaller count, and may be followed by a second
+//  summary with the same start time after a restart.  NaN values in the
+//  records are left out; a value that was NaN throughout is NaN.  With
+//  field_scale db, the mean of powers in dB is of the power, in dB, over
+//  the group as well as the bucket.
+//
+
+#define SIDC_ROLLUP_MAGIC 0x55444953                                  // "SIDU"
+
+struct SIDC_ROLLUP
+{
+   uint32_t magic;
+   uint32_t nvals;                          // Number of (mean, min, max) triples
+   uint32_t count;                        // Number of records in the bucket
+   uint32_t group;                          // Spectrum bins per value, else 1
+   double start;               // Start time of the bucket, unix seconds
+   double secs;                                  // Length of the bucket
+};
+
+#endif // SIDC_FORMAT_H
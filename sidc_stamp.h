@@ -0,0 +1,295 @@
+/*
+# sid-collector: A VLF signal monitor for recording sudden ionospheric disturbances
+#
+#  Parsing of the numbers and timestamps in sidc's text data files, for
+#  sidc-convert and sidc-query.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; version 2 of the License.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+*/
+
+#ifndef SIDC_STAMP_H
+#define SIDC_STAMP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+
+//
+//  Fields of a timestamp or file name, as they are parsed.  Anything not
+//  present is left at -1.
+//
+
+struct STAMP
+{
+   int year, mon, mday;
+   int hour, min, sec;
+   double epoch;                                  // %U or %u, unix seconds
+   double tod;                                // %E or %e, seconds of day
+   char *band;                            // %B, start and length of name
+   int band_len;
+};
+
+//
+//  Date and band taken from a file name, and the last date converted to
+//  unix time, which is nearly always the next one's too
+//
+
+struct STAMP_DATE
+{
+   char band[64];                     // Band name from the file name, if any
+   int year, mon, mday;     // Date from the file name, year -1 if none
+   int stamp_year, stamp_mon, stamp_mday;      // Last date converted, and
+   double stamp_day;                            // its unix time
+};
+
+//
+//  Quick conversion of the plain decimal numbers which sidc writes,
+//  falling back to strtod() for anything else
+//
+
+static double scan_num( char *p, char **end)
+{
+   static const double p10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+      1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18,
+      1e19, 1e20, 1e21, 1e22 };
+   char *s = p;
+   uint64_t v = 0;
+   int neg = 0, nd = 0, exp = 0;
+   double x;
+
+   if( *p == '-' || *p == '+') neg = *p++ == '-';
+   for( ; isdigit( *p); p++)
+      if( nd < 18) v = 10 * v + *p - '0', nd++;
+      else exp++;
+   if( *p == '.')
+      for( p++; isdigit( *p); p++)
+         if( nd < 18) v = 10 * v + *p - '0', nd++, exp--;
+   if( p == s + neg || (p == s + neg + 1 && s[neg] == '.'))
+      return strtod( s, end);
+
+   if( *p == 'e' || *p == 'E')
+   {
+      char *q = p + 1;
+      int eneg = 0, e = 0;
+
+      if( *q == '-' || *q == '+') eneg = *q++ == '-';
+      if( !isdigit( *q)) return strtod( s, end);
+      for( ; isdigit( *q); q++) if( e < 10000) e = 10 * e + *q - '0';
+      exp += eneg ? -e : e;
+      p = q;
+   }
+   if( isalpha( *p)) return strtod( s, end);
+
+   x = v;
+   if( exp > 22 || exp < -22) x *= pow( 10, exp);
+   else
+   if( exp >= 0) x *= p10[exp];
+   else x /= p10[-exp];
+
+   *end = p;
+   return neg ? -x : x;
+}
+
+static inline int two_digits( char *p, char *e, int *v)
+{
+   if( p + 2 > e || !isdigit( p[0]) || !isdigit( p[1])) return 0;
+   *v = 10 * (p[0] - '0') + p[1] - '0';
+   return 1;
+}
+
+static inline char *scan_int( char *p, char *e, long *v)
+{
+   char *s = p;
+
+   for( *v = 0; p < e && isdigit( *p); p++) *v = 10 * *v + *p - '0';
+   return p == s ? NULL : p;
+}
+
+//
+//  Parse text at p, up to e, against a format of sidc's % codes: the
+//  timestamp option or the output_files option.  Returns the end of the
+//  text matched, or NULL if it doesn't match.  As in sidc, an unknown code
+//  ends the format, and %% takes the next character literally.
+//
+
+static char *match_stamp( char *format, char *p, char *e, struct STAMP *s)
+{
+   long n;
+   char *q;
+
+   while( *format)
+   {
+      if( *format != '%')
+      {
+         if( p >= e || *p != *format) return NULL;
+         p++, format++;
+         continue;
+      }
+
+      format++;
+      switch( *format++)
+      {
+         case '%': if( !*format) return p;
+                   if( p >= e || *p != *format) return NULL;
+                   p++, format++;
+                   break;
+
+         case 'y': if( !two_digits( p, e, &s->year)) return NULL;
+                   s->year += s->year < 70 ? 2000 : 1900;
+                   p += 2; break;
+         case 'm': if( !two_digits( p, e, &s->mon)) return NULL;
+                   p += 2; break;
+         case 'd': if( !two_digits( p, e, &s->mday)) return NULL;
+                   p += 2; break;
+
+         case 'H': if( !two_digits( p, e, &s->hour)) return NULL;
+                   p += 2; break;
+         case 'M': if( !two_digits( p, e, &s->min)) return NULL;
+                   p += 2; break;
+         case 'S': if( !two_digits( p, e, &s->sec)) return NULL;
+                   p += 2; break;
+
+         //  A band name runs to the next literal in the format, trying the
+         //  longest first as another code may follow directly.  It has no
+         //  spaces, and may be empty, as in gap lines.
+         case 'B': for( q = p; q < e && !isspace( *q); ) q++;
+                   for( ; q >= p; q--)
+                   {
+                      struct STAMP t = *s;
+                      char *r;
+
+                      t.band = p;
+                      t.band_len = q - p;
+                      if( (r = match_stamp( format, q, e, &t)) != NULL)
+                      {
+                         *s = t;
+                         return r;
+                      }
+                   }
+                   return NULL;
+
+         case 'U': if( (p = scan_int( p, e, &n)) == NULL) return NULL;
+                   s->epoch = n; break;
+         case 'u': s->epoch = scan_num( p, &q);
+                   if( q == p || q > e) return NULL;
+                   p = q; break;
+
+         case 'E': if( (p = scan_int( p, e, &n)) == NULL) return NULL;
+                   s->tod = n; break;
+         case 'e': s->tod = scan_num( p, &q);
+                   if( q == p || q > e) return NULL;
+                   p = q; break;
+
+         default: return p;
+      }
+   }
+
+   return p;
+}
+
+static char *parse_stamp( char *format, char *p, char *e, struct STAMP *s)
+{
+   s->year = s->mon = s->mday = -1;
+   s->hour = s->min = s->sec = -1;
+   s->epoch = s->tod = -1;
+   s->band = NULL;
+   s->band_len = 0;
+
+   return match_stamp( format, p, e, s);
+}
+
+//
+//  Unix time of a parsed timestamp, taking the date from the file name if
+//  the timestamp has none.  Returns -1 if there is no date to be had.
+//
+
+static double stamp_time( struct STAMP_DATE *c, struct STAMP *s)
+{
+   int y = s->year, m = s->mon, d = s->mday;
+   double t;
+
+   if( s->epoch >= 0) return s->epoch;
+
+   if( y < 0) y = c->year, m = c->mon, d = c->mday;
+   if( y < 0) return -1;
+   if( m < 0) m = 1;
+   if( d < 0) d = 1;
+
+   //  Consecutive records are nearly always from the same day
+   if( y != c->stamp_year || m != c->stamp_mon || d != c->stamp_mday)
+   {
+      struct tm tm;
+
+      memset( &tm, 0, sizeof( tm));
+      tm.tm_year = y - 1900;
+      tm.tm_mon = m - 1;
+      tm.tm_mday = d;
+      c->stamp_day = timegm( &tm);
+      c->stamp_year = y;
+      c->stamp_mon = m;
+      c->stamp_mday = d;
+   }
+
+   if( s->tod >= 0) t = s->tod;
+   else t = 3600 * (s->hour < 0 ? 0 : s->hour) +
+              60 * (s->min < 0 ? 0 : s->min) + (s->sec < 0 ? 0 : s->sec);
+
+   return c->stamp_day + t;
+}
+
+//
+//  Take the date and band, if any, from the name of the input file.  The
+//  format may include directories, so it is matched against as many of the
+//  trailing components of the path.
+//
+
+static void parse_name( struct STAMP_DATE *c, char *format, char *path)
+{
+   struct STAMP s;
+   char *p = path + strlen( path), *e = p, *f;
+   int n = 0;
+
+   c->year = c->stamp_year = -1;
+   c->band[0] = 0;
+   if( !format) return;
+
+   for( f = format; *f; f++) if( *f == '/') n++;
+   while( p > path && (p[-1] != '/' || n--)) p--;
+
+   if( parse_stamp( format, p, e, &s) != e) return;
+
+   if( s.year >= 0 || s.epoch >= 0)
+   {
+      if( s.epoch >= 0)
+      {
+         time_t t = s.epoch;
+         struct tm tm;
+
+         gmtime_r( &t, &tm);
+         s.year = tm.tm_year + 1900;
+         s.mon = tm.tm_mon + 1;
+         s.mday = tm.tm_mday;
+      }
+      c->year = s.year;
+      c->mon = s.mon < 0 ? 1 : s.mon;
+      c->mday = s.mday < 0 ? 1 : s.mday;
+   }
+
+   if( s.band && s.band_len < (int) sizeof( c->band))
+   {
+      memcpy( c->band, s.band, s.band_len);
+      c->band[s.band_len] = 0;
+   }
+}
+
+#endif // SIDC_STAMP_H